@@ -1,17 +1,55 @@
 // Terminal Puyo
 // Jude Rorie
 
+#ifndef _WIN32
+#define _GNU_SOURCE					// usleep/clock_gettime/pthread extensions under -std=c99
+#endif
+
+#ifdef _WIN32
 #include <ncursesw\ncurses.h>
+#else
+#include <ncursesw/ncurses.h>
+#endif
+#include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
 #include <windows.h>
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <signal.h>
+#endif
 
-#define WIDTH 10			// playfield width (columns)
-#define HEIGHT 20			// playfield height (rows)
+#define MAX_WIDTH 16			// widest board a game can hold (columns)
+#define MAX_HEIGHT 64			// tallest board a game can hold (rows, one 64-bit word per column)
+#define MAX_COLORS 14			// puyo colors 1..14
+#define NUISANCE 15				// color code of nuisance puyos (never form groups)
+#define COLOR_BITS 4			// bits of a cell's color code
+#define PLANES (1 + COLOR_BITS)	// occupancy plane + one plane per color code bit
+#define GARBAGE_ROWS 5			// most rows of nuisance puyos dropped after one lock
 #define SIZE 3				// 3x3 piece matrix (rotation center at [1,1])
+#define MAX_PREVIEW 5			// deepest preview queue (pairs dealt ahead of the current one)
 
 // Block data
 typedef struct {
@@ -19,46 +57,1182 @@ typedef struct {
 	int color[SIZE][SIZE];	// color index for each cell
 } Block;
 
-// Board occupancy and color grids
-int board[HEIGHT][WIDTH];			// 1 if occupied, 0 otherwise
-int board_color[HEIGHT][WIDTH];		// color index for occupied cells
+// Board size and rules a game is played with
+typedef struct {
+	int width, height;					// playfield columns and rows
+	int hidden;							// rows at the top that never pop (classic field: 1)
+	int colors;							// how many colors are available (difficulty)
+	int threshold;						// puyos a group needs to pop (2..8)
+	int preview;						// pairs dealt ahead and shown (1..MAX_PREVIEW)
+	int scoring;						// score table, index into score_tables
+	int all_clear;						// bonus points for a chain that empties the board
+	int garbage_rate;					// nuisance puyos sent after every lock (training drill), 0 = none
+} Rules;
+
+typedef struct BoardKernels BoardKernels;
+
+// Complete state of one game: board, pieces and stats
+typedef struct {
+	Rules rules;						// board size and rules
+	const BoardKernels *kernels;		// gravity/clear kernels for the board size
+	uint64_t planes[PLANES][MAX_WIDTH];	// column bitplanes: plane 0 = occupancy, plane 1 + b = bit b of each cell's color code
+	Block current;						// currently falling piece
+	uint8_t queue[MAX_PREVIEW][2];		// preview ring of pair colors {pivot, child}, rules.preview slots
+	int queue_head;						// ring slot holding the next pair
+	int cx, cy;							// current piece top-left (in 3x3 local coords)
+	int score;							// player's score
+	int level;							// current level
+	int clears;							// number of group clears (groups cleared)
+	int pieces;							// pieces locked so far
+	int over;							// 1 once the spawn location is blocked
+	int garbage;						// nuisance puyos waiting to fall
+	int garbage_turn;					// where in garbageColumn order the next odd nuisance puyo falls
+	uint32_t rng;						// piece generator state (same seed = same pieces)
+	uint32_t seed;						// seed the game was reset with
+} Game;
+
+/*
+ * Scoring
+ * -------
+ * Every chain step scores 10 x cleared x clamp(chain power + color bonus +
+ * group bonus, 1, MAX_BONUS), the formula of the arcade games. The terms
+ * come from integer tables (a ScoreTable per ruleset, see score_tables):
+ * the chain power by step number, the color bonus by how many colors
+ * popped in the step and the group bonus by the size of each popped group,
+ * summed over the groups. Scores are therefore exact on every compiler,
+ * which replays and garbage counts rely on. A chain that leaves the board
+ * empty (an all-clear) also earns the rules' all-clear bonus.
+ */
+#define CHAIN_POWERS 24				// chain power entries; longer chains use the last one
+#define GROUP_BONUSES 12			// group bonus entries by group size; larger groups use the last one
+#define MAX_BONUS 999				// cap on a step's combined bonus
+#define TRACE_STEPS 32				// chain steps a ChainTrace keeps
+
+// One scoring ruleset
+typedef struct {
+	const char *name;					// name for --scoring
+	uint16_t chain_power[CHAIN_POWERS];	// by chain step, step 1 first
+	uint16_t color_bonus[MAX_COLORS + 1];	// by number of colors popped in the step
+	uint8_t group_bonus[GROUP_BONUSES];	// by group size
+} ScoreTable;
+
+// Score breakdown of one chain step
+typedef struct {
+	int cleared;						// puyos popped
+	int groups;							// groups popped
+	int nuisance;						// nuisance puyos cleared alongside (not scored)
+	int colors;							// distinct colors popped
+	int chain_power;					// chain power of the step number
+	int color_bonus;					// color bonus for `colors`
+	int group_bonus;					// group bonuses summed over the groups
+	int bonus;							// the three terms summed and clamped to 1..MAX_BONUS
+	int points;							// 10 x cleared x bonus
+} ChainStep;
+
+// Everything the chain set off by one lock scored
+typedef struct {
+	int steps;							// chain steps (may exceed TRACE_STEPS)
+	ChainStep step[TRACE_STEPS];		// breakdown of the first TRACE_STEPS steps
+	int all_clear;						// 1 if the chain emptied the board
+	int points;							// points over all steps, all-clear bonus included
+} ChainTrace;
+
+/*
+ * Board kernels
+ * -------------
+ * A board is PLANES bitplanes: occupancy plus the four bits of every cell's
+ * color code (1..MAX_COLORS, NUISANCE), sliced so each plane holds one bit
+ * per cell. A color's cells are the occupied cells whose four code bits
+ * all match, found without branches as occupancy & ~OR(plane ^ code bit).
+ *
+ * Gravity and group clearing work on whole columns at once: a column of a
+ * plane is a run of 64-bit words with row 0 (the top) in bit 0 of the
+ * first word, so vertical neighbors are one shift away (carrying between
+ * words) and horizontal neighbors are the adjacent columns. The kernels are
+ * written once as always-inline bodies taking the board geometry and
+ * instantiated with constant sizes for the common fields (6x13 classic,
+ * 10x20 wide), letting the compiler fix every loop bound and row mask; any
+ * other size runs the same bodies with the size read from the game.
+ * resetGame picks the instance matching the board. A Game holds one word
+ * per column; boards too big for that live in a Field (see below).
+ */
+struct BoardKernels {
+	int width, height;					// size the kernels are specialized for, 0 = any size
+	const char *name;					// size label, "generic" for the fallback
+	int (*gravity_step)(Game *g);		// drops every floating puyo one row; 1 if anything moved
+	void (*gravity)(Game *g);			// drops every floating puyo all the way down
+	int (*clear_groups)(Game *g, int chain, ChainStep *step);	// pops groups, see clearGroups
+};
+
+// What one clear pass removed
+typedef struct {
+	int cleared;						// puyos popped
+	int groups;							// groups popped
+	int nuisance;						// nuisance puyos cleared next to popped groups
+	uint32_t colors;					// bit c set when a group of color c popped
+	int group_bonus;					// score table group bonuses of the popped groups
+} ClearResult;
+
+/*
+ * Fields
+ * ------
+ * Boards beyond MAX_WIDTH x MAX_HEIGHT (stress tests, the mega mode) are
+ * heap-allocated with as many words per column as the height needs and
+ * run through the same kernels with the geometry passed at runtime. A
+ * field drops pairs straight down (no falling piece, no rotation kicks).
+ */
+#define FIELD_MAX_SIDE 4096			// widest/tallest field
+
+// Large board with multi-word columns
+typedef struct {
+	Rules rules;						// board size and rules
+	int words;							// 64-bit words per column
+	uint64_t *bits;						// PLANES planes, each width columns of `words` words
+	uint64_t *scratch;					// kernel scratch, 3 * width * words words
+	uint32_t rng;						// pair generator state
+	long score;							// points scored
+	long clears;						// groups cleared
+	long pieces;						// pairs dropped
+	int max_chain;						// longest chain so far
+	uint64_t gravity_ns, clear_ns;		// time spent in each kernel
+} Field;
+
+/*
+ * CPU dispatch
+ * ------------
+ * Every kernel (gravity, clearing, the bot evaluation) is compiled once per
+ * instruction set level with __attribute__((target)) and selectCpu picks a
+ * level at startup. The bodies are shared; the levels differ in what the
+ * compiler may use: POPCNT and SSE4.2, then AVX2 with BMI1, then BMI2's
+ * PEXT for the compaction in gravity, then AVX-512. PEXT is microcoded and
+ * slow on AMD before Zen 3, so detection skips the PEXT levels there.
+ * --cpu NAME forces a level for benchmarking. Builds for other
+ * architectures only have the scalar level.
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CPU_DISPATCH 1
+#define TARGET_SSE42 __attribute__((target("popcnt,sse4.2")))
+#define TARGET_AVX2 __attribute__((target("popcnt,sse4.2,avx2,bmi")))
+#define TARGET_AVX2_PEXT __attribute__((target("popcnt,sse4.2,avx2,bmi,bmi2")))
+#define TARGET_AVX512 __attribute__((target("popcnt,sse4.2,avx2,bmi,bmi2,avx512f,avx512bw,avx512vl,avx512dq")))
+#else
+#define CPU_DISPATCH 0
+#endif
+
+// Every kernel instance built for one instruction set level
+typedef struct {
+	const char *name;					// level name for --cpu
+	int pext;							// 1 if gravity uses PEXT (skipped by detection where it is slow)
+	int (*supported)(void);				// 1 if the host has the level's instructions
+	BoardKernels boards[3];				// game kernels, most specific size first; the last matches any size
+	void (*field_gravity)(Field *f);	// gravity on a field
+	void (*field_clear)(Field *f, ClearResult *r);	// one clear pass on a field
+	int (*evaluate)(Game *g);			// evaluateBoard
+} CpuKernels;
+
+// A final resting spot for the current pair, as chosen by a bot
+typedef struct {
+	int column;							// board column of the pivot cell
+	int rotation;						// clockwise quarter turns from spawn (0 = child above pivot)
+} Placement;
+
+/*
+ * Bot protocol
+ * ------------
+ * An external bot listens on a Unix domain socket and the engine connects to
+ * it (--bot PATH). The engine then asks for one placement per spawned piece.
+ * Several games can share a connection: the engine batches every game that
+ * is waiting for a move into a single request message.
+ *
+ * Every message is a BotHeader followed by `count` fixed-size records:
+ *
+ *   engine -> bot:  BotHeader{BOT_MAGIC, BOT_VERSION, BOT_STATE, count, sizeof(BotState)}
+ *                   + count x BotState
+ *   bot -> engine:  BotHeader{BOT_MAGIC, BOT_VERSION, BOT_MOVE, count, sizeof(BotMove)}
+ *                   + count x BotMove
+ *
+ * The reply must contain one BotMove per BotState, in request order, with
+ * the `game` id echoed back. All integers are little-endian and the records
+ * contain no padding, so they can be read with a plain struct/array unpack
+ * in any language. The board is sent as column bitplanes: bit y of
+ * planes[c][x] is set when cell (x, y) holds color c (row 0 is the top row),
+ * plane 0 is the occupancy of all colors combined and plane 15 holds
+ * nuisance puyos.
+ *
+ * A placement names the pivot column and the number of clockwise quarter
+ * turns from the spawn orientation (0 = child above the pivot, 1 = child to
+ * the right, 2 = below, 3 = left). The engine slides the pair there along the
+ * spawn row and hard-drops it; a placement that cannot be reached that way is
+ * replaced by a plain drop at the spawn column.
+ */
+#define BOT_MAGIC 0x4f595550u		// "PUYO" in little-endian byte order
+#define BOT_VERSION 3				// bumped on any layout change
+#define BOT_STATE 1					// message kind: engine -> bot states
+#define BOT_MOVE 2					// message kind: bot -> engine placements
+#define BOT_PLANES 16				// occupancy plane + colors 1..14 + nuisance
+#define BOT_COLS 16					// widest board the protocol can describe
+#define BOT_ROWS 32					// tallest board the protocol can describe
+#define BOT_MAX_BATCH 4096			// most games carried in one message
+
+// Header in front of every protocol message
+typedef struct {
+	uint32_t magic;						// BOT_MAGIC
+	uint16_t version;					// BOT_VERSION
+	uint16_t kind;						// BOT_STATE or BOT_MOVE
+	uint32_t count;						// number of records that follow
+	uint32_t size;						// size of each record in bytes
+} BotHeader;
+
+// Engine -> bot: snapshot of one game waiting for a placement
+typedef struct {
+	uint32_t game;						// game id, echoed back in BotMove
+	uint32_t piece;						// pieces locked so far in this game
+	int32_t score;						// current score
+	int32_t garbage;					// nuisance puyos due to fall after this piece locks (at most GARBAGE_ROWS rows)
+	uint8_t width, height;				// board dimensions
+	uint8_t colors;						// colors in play (1..colors)
+	uint8_t threshold;					// puyos a group needs to pop
+	uint8_t current[2];					// falling pair colors: {pivot, child}
+	uint8_t next[MAX_PREVIEW][2];		// preview queue, next pair first; {0, 0} past the preview depth
+	uint32_t planes[BOT_PLANES][BOT_COLS];	// column bitplanes (see above)
+} BotState;
+
+// Bot -> engine: the placement chosen for one game
+typedef struct {
+	uint32_t game;						// game id from the matching BotState
+	uint8_t column;						// board column of the pivot cell
+	uint8_t rotation;					// clockwise quarter turns from spawn
+	uint16_t reserved;					// always 0
+} BotMove;
+
+// The wire format is fixed; fail the build if the compiler pads anything
+typedef char bot_header_size_check[sizeof(BotHeader) == 16 ? 1 : -1];
+typedef char bot_state_size_check[sizeof(BotState) == 1056 ? 1 : -1];
+typedef char bot_move_size_check[sizeof(BotMove) == 8 ? 1 : -1];
+
+/*
+ * Shared-memory transport
+ * -----------------------
+ * For bots on the same host (--bot shm:NAME, Linux only) the engine creates
+ * the POSIX shared-memory object /puyo-NAME holding one ShmRegion and the bot
+ * maps it. The same BotState/BotMove records are exchanged without copies
+ * through the kernel:
+ *
+ *   - Every game owns an ShmSlot. The engine publishes a state under the
+ *     slot's seqlock (seq is odd while it writes; a reader copies the state
+ *     and retries if seq was odd or changed meanwhile), then bumps the
+ *     slot's `request`. A game needs a move whenever `request` differs from
+ *     the last request the bot answered for it.
+ *   - After publishing a batch the engine bumps `requests`.
+ *   - The bot answers by writing BotMoves into `ring[ring_head % ring_slots]`
+ *     and then advancing `ring_head`; the engine consumes them at
+ *     `ring_tail`. Moves may arrive in any order.
+ *
+ * Each side spins briefly before sleeping, so a busy pair of processes never
+ * enters the kernel. To sleep, a side sets its `*_sleeping` flag, re-checks
+ * the counter and FUTEX_WAITs on it; after advancing a counter the other
+ * side issues FUTEX_WAKE only if the sleeping flag is set. The engine waits
+ * on `ring_head`, the bot on `requests`. Counters are 32-bit and wrap.
+ *
+ * On attaching, the bot stores its process id in `bot_pid`, and it
+ * clears it if it detaches. The engine's futex waits time out every
+ * SHM_WAIT_MS. A wait that ends with the bot gone, because the pid no
+ * longer exists or was cleared after being set, fails the exchange, just
+ * as EOF fails the socket transport.
+ */
+#define SHM_MAGIC 0x4d485350u		// "PSHM" in little-endian byte order
+#define SHM_VERSION 4				// bumped on any layout change
+#define SHM_RING_SLOTS 4096			// action ring size, >= BOT_MAX_BATCH
+#define SHM_SPIN 20000				// polls before falling back to a futex wait
+#define SHM_WAIT_MS 100				// futex wait between bot liveness checks
+
+// One game's published state
+typedef struct {
+	uint32_t seq;						// seqlock counter, odd while the engine writes
+	uint32_t request;					// bumped when the game needs a new placement
+	BotState state;						// latest state of the game
+} ShmSlot;
+
+// Layout of the shared-memory object; engine and bot fields sit on separate cache lines
+typedef struct {
+	uint32_t magic;						// SHM_MAGIC
+	uint32_t version;					// SHM_VERSION
+	uint32_t games;						// number of slots
+	uint32_t ring_slots;				// SHM_RING_SLOTS
+	uint32_t requests;					// engine: bumped after each published batch
+	uint32_t engine_sleeping;			// engine: 1 while waiting on ring_head
+	uint32_t ring_tail;					// engine: moves consumed
+	uint32_t engine_reserved[9];		// pads the engine line to 64 bytes
+	uint32_t ring_head;					// bot: moves written
+	uint32_t bot_sleeping;				// bot: 1 while waiting on requests
+	uint32_t bot_pid;					// bot: its process id while attached, 0 before and after
+	uint32_t bot_reserved[13];			// pads the bot line to 64 bytes
+	BotMove ring[SHM_RING_SLOTS];		// action ring written by the bot
+	ShmSlot slots[];					// one per game
+} ShmRegion;
+
+typedef char shm_region_size_check[sizeof(ShmRegion) == 128 + 8 * SHM_RING_SLOTS ? 1 : -1];
+
+#ifdef _WIN32
+typedef SOCKET BotSocket;
+#define BOT_NO_SOCKET INVALID_SOCKET
+#else
+typedef int BotSocket;
+#define BOT_NO_SOCKET (-1)
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0				// Windows has no SIGPIPE to suppress
+#endif
+
+#define BOT_LINK_NONE 0				// no bot attached
+#define BOT_LINK_SOCKET 1			// Unix domain socket
+#define BOT_LINK_SHM 2				// shared-memory region
+
+// Connection to an external bot
+typedef struct {
+	int kind;							// BOT_LINK_* transport in use
+	BotSocket fd;						// connected socket, BOT_NO_SOCKET when closed
+	ShmRegion *shm;						// mapped region for BOT_LINK_SHM
+	size_t shm_size;					// mapped size in bytes
+	char shm_name[64];					// shared-memory object name
+	int *shm_batch;						// game id -> batch index while waiting for moves
+	uint32_t shm_pid;					// bot process last seen attached, 0 if none yet
+} BotLink;
+
+// In-process bot: picks a placement for a game's freshly spawned pair
+typedef Placement (*BotThink)(Game *g);
+
+// Named built-in bot
+typedef struct {
+	const char *name;					// name used on the command line
+	BotThink think;						// move function
+} BuiltinBot;
+
+/*
+ * Search arenas
+ * -------------
+ * Bot searches take their scratch positions from a per-thread bump arena
+ * instead of malloc or deep stack frames: an allocation is a pointer
+ * bump, nested searches give memory back by rewinding to a mark, and the
+ * whole arena is reset in O(1) after every decision. The arena is one
+ * large reservation made on first use; pages are committed as they are
+ * touched and can be backed by huge pages (--huge-pages), falling back to
+ * transparent huge pages and then to normal pages. Windows does not
+ * commit on touch, so there the arena commits ARENA_COMMIT bytes at a
+ * time as it grows.
+ */
+#define ARENA_RESERVE ((size_t)256 << 20)	// bytes reserved per thread (address space only)
+#define ARENA_HUGE_SIZE ((size_t)16 << 20)	// bytes per thread when mapped with explicit huge pages (committed up front)
+#define ARENA_COMMIT ((size_t)1 << 20)		// bytes committed per step on Windows, divides ARENA_RESERVE
+#define ARENA_ALIGN 64				// allocation alignment, one cache line
+
+// Per-thread bump allocator for search scratch memory
+typedef struct {
+	char *base;							// reservation, NULL until first use
+	size_t size;						// bytes reserved
+	size_t used;						// bytes handed out since the last reset
+	size_t committed;					// bytes committed so far (Windows only)
+} Arena;
+
+/*
+ * Chain cache
+ * -----------
+ * Searches resolve the same chains over and over: transposed placements,
+ * both orientations of a one-color pair and sibling chance nodes all lock
+ * into identical boards. settle() looks the board up by a hash of its
+ * planes and rules (see chainKey) before running the clear/gravity loop.
+ * A small direct-mapped front cache per thread answers most repeats
+ * without sharing anything; it is backed by a table shared by every
+ * search thread. Shared slots are guarded by a sequence lock: readers
+ * retry nothing and just miss if a writer is active or got in between,
+ * and writers skip a slot another writer holds, so no thread ever waits.
+ * Chains whose outcome does not fit a ChainSummary are not cached.
+ */
+#define CHAIN_FRONT_SIZE 128		// per-thread front cache entries, a power of two
+#define CHAIN_SHARED_SIZE 4096		// shared cache slots, a power of two
+#define CHAIN_CACHE_STEPS 16		// longest chain a summary holds
+
+// What resolving one board's chain does to the game; all words, so slots copy it word by word
+typedef struct {
+	uint64_t key;						// chainKey of the board before the chain, 0 = empty
+	uint64_t planes[PLANES][MAX_WIDTH];	// board once the chain has resolved
+	uint64_t points;					// points over all steps, all-clear bonus excluded
+	uint64_t groups[CHAIN_CACHE_STEPS / 8];	// groups popped per step, one byte each, ending at the first 0
+} ChainSummary;
+
+// Shared chain cache slot
+typedef struct {
+	uint32_t sequence;					// odd while a writer fills the slot (atomic)
+	ChainSummary summary;				// read and written with relaxed atomics under `sequence`
+} ChainSlot;
+
+/*
+ * Worker placement
+ * ----------------
+ * Tournament, book and analyze workers are spread over the NUMA nodes in
+ * proportion to the CPUs each node lets this process use (see workerCpu),
+ * and with --pin each is bound to its CPU before it starts. Linux puts a
+ * page on the node of the thread that first touches it, so a pinned
+ * worker's stack, games and search arena are local to it, and the shared
+ * chain cache is kept once per node. Only finished results (a match's
+ * scores, a position's move) cross nodes. The layout is read from
+ * /sys/devices/system/node; without it all usable CPUs form one node.
+ */
+#define TOPOLOGY_MAX_NODES 4		// NUMA nodes told apart; further nodes join the last one
+#define TOPOLOGY_MAX_CPUS 1024		// most usable CPUs recorded
+
+// CPUs this process may run on, grouped by NUMA node
+typedef struct {
+	int nodes;							// nodes with a usable CPU, at least 1
+	int first[TOPOLOGY_MAX_NODES + 1];	// node n's CPUs are cpus[first[n]] .. cpus[first[n + 1] - 1]
+	int cpus[TOPOLOGY_MAX_CPUS];		// CPU numbers, node by node
+} Topology;
+
+/*
+ * Expectimax bot
+ * --------------
+ * Pairs are dealt uniformly from the colors in play, so the expectimax bot
+ * averages over the unseen pair instead of guessing it: it places the
+ * current pair, then for each pair the next spawn could reveal places the
+ * known next pair and the revealed one. The book command runs the same
+ * search offline. Colors absent from the position
+ * are interchangeable, so the colors^2 possible deals collapse into a few
+ * weighted classes (see chanceClasses). Leaf values are memoized per
+ * thread under color-canonical keys (see positionKey), which also merges
+ * transposed and recolored leaves.
+ */
+#define EXPECTI_BEAM 6				// first moves the bot searches past the greedy lookahead
+#define EXPECTI_TABLE_SIZE 8192		// transposition table entries per thread, a power of two
+#define EXPECTI_CLASSES (MAX_COLORS * (MAX_COLORS + 1) / 2 + 3)	// most pair classes at a chance node
+
+// Transposition table entry: a leaf's value
+typedef struct {
+	uint64_t key;						// positionKey of the leaf, 0 = empty
+	long value;							// best score gain plus board heuristic (see leafValue)
+} ExpectiEntry;
+
+/*
+ * Opening book
+ * ------------
+ * Every game starts from an empty board, so the first pairs' best moves
+ * can be searched offline. The book command enumerates every early pair
+ * sequence up to a depth (colors canonicalized, see positionKey), searches
+ * each position with a wide expectimax beam and writes a BookHeader followed by an
+ * open-addressed hash table of `slots` words. Each word holds a position
+ * key in its upper 56 bits and the move in the low byte (column << 2 |
+ * rotation); 0 marks an empty slot. The book bot maps the file and looks a
+ * position up in O(1), falling back to search when it is not in the book.
+ */
+#define BOOK_MAGIC 0x4b4f4250u			// "PBOK" in little-endian byte order
+#define BOOK_VERSION 2				// bumped on any layout or key change
+#define BOOK_MAX_DEPTH 8			// deepest book (pairs placed from the empty board)
+#define BOOK_KEY_MASK (~(uint64_t)0xff)	// key bits of a slot; the low byte is the move
+
+// Book file header: the rules the book was searched under
+typedef struct {
+	uint32_t magic;						// BOOK_MAGIC
+	uint16_t version;					// BOOK_VERSION
+	uint8_t width;						// board width
+	uint8_t height;						// board height
+	uint8_t hidden;						// rows at the top that never pop
+	uint8_t colors;						// colors in play
+	uint8_t threshold;					// puyos a group needs to pop
+	uint8_t preview;					// pairs dealt ahead (part of every key)
+	uint8_t scoring;					// score table
+	uint8_t depth;						// pairs placed by the deepest positions
+	uint16_t all_clear;					// all-clear bonus
+	uint32_t slots;						// hash slots, a power of two
+	uint32_t entries;					// slots in use
+	uint8_t garbage_rate;				// nuisance puyos dropped after every lock
+	uint8_t reserved[7];				// always 0; keeps the slot table 8-byte aligned
+} BookHeader;
+
+typedef char book_header_size_check[sizeof(BookHeader) == 32 ? 1 : -1];
+
+// A loaded (mapped) opening book
+typedef struct {
+	BookHeader header;					// file header, slots == 0 when no book is loaded
+	const uint64_t *slots;				// hash table
+	void *map;							// mapping (or buffer) holding the file
+	size_t size;						// mapped bytes
+} Book;
+
+// Offline book search over one level of positions, shared by the worker threads
+typedef struct {
+	Game *positions;					// positions to search
+	Placement *moves;					// best move per position
+	int *found;							// 1 if the position has a legal move
+	int count;							// positions
+	int next;							// next position to claim (atomic)
+	int beam;							// first moves searched a ply deeper
+} BookLevel;
+
+// Book hash table while it is being built
+typedef struct {
+	uint64_t *slots;					// open-addressed slots (see Opening book)
+	uint32_t count;						// slots allocated, a power of two
+	uint32_t used;						// slots in use
+} BookTable;
+
+#define BOOK_PENDING 0xff			// move byte of a position queued but not searched yet
+
+/*
+ * Versus mode
+ * -----------
+ * The player races a built-in AI on the same piece sequence, and chains
+ * send nuisance puyos across (one per VERSUS_TARGET_POINTS points, first
+ * cancelling any pending against the sender). The AI thinks on its own
+ * thread, kept off the UI thread's CPU. It sees a copy of its game
+ * posted when each pair spawns and answers with keys in an InputQueue,
+ * the same kind of queue the player's keystrokes go through. The UI thread
+ * applies them no faster than the level's input cap and never waits on
+ * the AI: a request is skipped for a tick if the AI holds the lock, and a
+ * slow AI just lets its piece keep falling.
+ */
+#define INPUT_QUEUE_SIZE 64			// keys an input queue holds, a power of two
+#define VERSUS_TARGET_POINTS 70		// points per nuisance puyo sent to the opponent
+
+// Results of feeding one key to a game (see gameInput)
+#define INPUT_IGNORED 0				// not a game key
+#define INPUT_MOVED 1				// move or rotation attempted
+#define INPUT_SOFT 2				// soft drop held
+#define INPUT_DROP 3				// piece hard-dropped; the caller locks it
+
+// One queued key, tagged with the piece it was meant for
+typedef struct {
+	int key;							// curses key code
+	int piece;							// Game.pieces when the key was queued
+} InputKey;
+
+// Single-producer single-consumer key queue feeding one game
+typedef struct {
+	InputKey keys[INPUT_QUEUE_SIZE];	// ring of queued keys
+	uint32_t head;						// next key to read (consumer, atomic)
+	uint32_t tail;						// next slot to fill (producer, atomic)
+} InputQueue;
+
+// AI strength: search budget and input speed cap
+typedef struct {
+	const char *name;					// name used with --versus
+	int beam;							// expectimax first moves (see searchExpectimax), 0 = greedy lookahead
+	int budget_ms;						// most thinking time per move
+	int keys_per_second;				// input speed cap
+} VersusLevel;
+
+// Versus match against the AI
+typedef struct {
+	int active;							// 1 while a match runs
+	const VersusLevel *level;			// AI strength
+	Game game;							// AI's game (UI thread only)
+	InputQueue input;					// keys from the AI thread to its game
+	uint64_t last_fall;					// monotonicNs of the AI piece's last fall step
+	uint64_t next_key;					// monotonicNs before which no AI key is applied
+	int requested;						// AI game's piece count when its move was last requested
+	int carry[2];						// points not yet sent as nuisance: player, AI
+	pthread_t thread;					// AI thread
+	pthread_mutex_t lock;				// guards the request fields below
+	pthread_cond_t wake;				// signaled on a new request or quit
+	Game request;						// position the AI thinks about
+	uint64_t deadline;					// monotonicNs by which its keys should be queued
+	uint32_t sequence;					// bumped on every request
+	int quit;							// 1 asks the AI thread to exit
+} Versus;
+
+/*
+ * Hints
+ * -----
+ * With --hint the player's pair gets a suggested placement, drawn where
+ * it would land. The search runs on its own thread. A chain's outcome is
+ * known the moment the pair locks, so lock_and_cascade settles a copy of
+ * the board at once and posts that position: the search runs while the
+ * chain animation plays and the hint is ready when control returns. A
+ * hint is shown only on the position it was searched for (same
+ * positionKey), so a wrong guess, such as versus nuisance arriving during
+ * the animation, is dropped and the real position searched instead.
+ */
+#define HINT_BEAM 24				// expectimax first moves a hint search may re-score
+#define HINT_BUDGET_MS 150			// thinking time for a position posted without an animation to hide behind
+
+// Hint engine for the live game
+typedef struct {
+	int active;							// 1 while the hint thread runs
+	pthread_t thread;					// hint thread
+	pthread_mutex_t lock;				// guards the request and result fields below
+	pthread_cond_t wake;				// signaled on a new request or quit
+	Game request;						// position to search
+	uint64_t request_key;				// positionKey of the request
+	uint64_t deadline;					// monotonicNs by which the hint should be ready
+	uint64_t result_key;				// position the result was found for, 0 = none yet
+	Placement result;					// suggested placement
+	int quit;							// 1 asks the hint thread to exit
+	uint64_t posted;					// key of the last posted position (UI thread only)
+} Hint;
+
+#define TOURNAMENT_MAX_BOTS 64		// most entrants in one tournament
+#define TOURNAMENT_MAX_THREADS 256	// most worker threads
+
+// A worker's move request queued on an external entrant (see entrantMove)
+typedef struct {
+	BotMove move;						// the bot's answer, valid once done
+	int status;							// result of the exchange that carried it
+	int done;							// 1 once answered (guarded by the entrant's lock)
+} EntrantRequest;
+
+// Tournament participant: a built-in bot or an external one behind a BotLink
+typedef struct {
+	const char *name;					// spec given on the command line
+	BotThink think;						// built-in move function, NULL for external bots
+	BotLink link;						// external bot connection
+	pthread_mutex_t lock;				// guards the batch fields below
+	pthread_cond_t answered;			// broadcast after every exchange
+	int exchanging;						// 1 while a worker is exchanging a batch with the bot
+	int pending;						// requests queued for the next exchange
+	BotState *queue;					// queued states; a state's game id is its position
+	BotState *sending;					// states of the exchange in flight
+	EntrantRequest **queue_requests;	// worker waiting on each queued state
+	EntrantRequest **sending_requests;	// worker waiting on each state in flight
+	BotMove *moves;						// answers of the exchange in flight
+} Entrant;
+
+// One scheduled versus match between two entrants on a shared seed
+typedef struct {
+	int a, b;							// entrant indices
+	uint32_t seed;						// piece sequence both sides receive
+	int b_first;						// 1 if b places first in each round (mirrored game)
+	int result;							// 1 = a wins, 0 = draw, -1 = b wins
+	int score[2];						// final scores of a and b
+} Match;
+
+// Tournament settings, entrants and schedule
+typedef struct {
+	Entrant entrants[TOURNAMENT_MAX_BOTS];	// registered bots
+	int entrant_count;					// number of registered bots
+	Match *matches;						// schedule, filled round by round
+	int match_count;					// matches scheduled so far
+	int next_match;						// next match a worker claims (atomic)
+	int games_per_pair;					// matches per pairing
+	int max_pieces;						// piece limit per game
+	Rules rules;						// board size and colors every match is played with
+	int threads;						// worker threads
+	uint32_t seed;						// base seed for the schedule
+	int failed;							// set when an external bot fails (atomic)
+} Tournament;
+
+#define METRIC_BUCKETS 40			// log2 latency buckets: [2^i, 2^(i+1)) ns
+#define METRIC_DIFFICULTIES 5		// custom, easy, medium, hard, very hard
+#define TICK_LIVE 0					// tick latency of the interactive loop
+#define TICK_SIM 1					// tick latency of a headless piece
+
+// Latency histogram with running sum and count
+typedef struct {
+	uint64_t count;						// samples recorded
+	uint64_t sum_ns;					// sum of all samples
+	uint64_t buckets[METRIC_BUCKETS];	// samples per log2 bucket
+} LatencyStats;
+
+// Per-thread counters; only the owning thread writes, scrapes sum all shards
+typedef struct MetricsShard {
+	struct MetricsShard *next;			// next shard in metrics_shards
+	int in_use;							// 1 while a live thread owns the shard
+	uint64_t sessions;					// interactive sessions started
+	uint64_t frames;					// frames rendered
+	uint64_t chains;					// locks that triggered a chain
+	uint64_t chain_steps;				// chain steps resolved
+	uint64_t games_started[METRIC_DIFFICULTIES];	// games started per difficulty
+	uint64_t games_finished[METRIC_DIFFICULTIES];	// games finished per difficulty
+	LatencyStats frame;					// drawBoard latency
+	LatencyStats tick[2];				// TICK_LIVE / TICK_SIM latency
+} MetricsShard;
+
+// Metrics registry (see metricsShard) and exporter state
+MetricsShard *metrics_shards;		// every shard ever created (lock-free push)
+__thread MetricsShard *metrics_local;	// this thread's shard
+pthread_key_t metrics_key;			// hands a shard back when its thread exits
+uint64_t metrics_start_ns;			// exporter start, for the first rate window
+char metrics_path[256];				// file: exporter target
+int metrics_interval = 10;			// file: exporter period in seconds
+char metrics_page[16384];			// page buffer of the exporter thread
+const char *difficulty_names[METRIC_DIFFICULTIES] = { "custom", "easy", "medium", "hard", "very_hard" };
+
+/*
+ * Replay files
+ * ------------
+ * A ReplayHeader followed by `moves` ReplayMove records, one per locked
+ * piece. Games are deterministic given the seed, so replaying every lock
+ * at its recorded position reproduces the game exactly; the tick says when
+ * the lock happened for live-speed playback. Timed games (see TimedRun)
+ * store their result in the header and follow the moves with `splits`
+ * uint32 split times in microseconds. Little-endian, no padding.
+ */
+#define REPLAY_MAGIC 0x4c505250u		// "PRPL" in little-endian byte order
+#define REPLAY_VERSION 7			// bumped on any layout or rules change
+#define REPLAY_ALL_CLEAR 1			// move flag: the lock's chain emptied the board
+#define REPLAY_MAX_SPLITS 255		// most level-up splits a replay keeps
+
+// Replay file header
+typedef struct {
+	uint32_t magic;						// REPLAY_MAGIC
+	uint16_t version;					// REPLAY_VERSION
+	uint8_t colors;						// colors in play
+	uint8_t width;						// board width
+	uint8_t height;						// board height
+	uint8_t hidden;						// rows at the top that never pop
+	uint8_t threshold;					// puyos a group needs to pop
+	uint8_t preview;					// pairs dealt ahead of the current one
+	uint8_t scoring;					// score table (index into score_tables)
+	uint8_t garbage_rate;				// nuisance puyos sent after every lock
+	uint16_t all_clear;					// all-clear bonus
+	uint32_t seed;						// piece sequence seed
+	uint32_t moves;						// records that follow
+	int32_t score;						// final score
+	uint32_t goal;						// timed mode goal: clears, points or seconds
+	uint32_t elapsed_us;				// timed mode: microseconds played
+	uint8_t mode;						// MODE_* the game was played in
+	uint8_t splits;						// level-up split times after the moves
+	uint8_t completed;					// timed mode: 1 if the goal was reached
+	uint8_t reserved;					// zero
+} ReplayHeader;
+
+// One locked piece
+typedef struct {
+	uint32_t tick;						// player tick at which the piece locked
+	int8_t x, y;						// 3x3 top-left of the piece when it locked
+	uint8_t rotation;					// clockwise quarter turns from spawn
+	uint8_t flags;						// REPLAY_* bits: what the lock set off
+} ReplayMove;
+
+typedef char replay_header_size_check[sizeof(ReplayHeader) == 40 ? 1 : -1];
+typedef char replay_move_size_check[sizeof(ReplayMove) == 8 ? 1 : -1];
+
+// Replay held in memory while recording or playing back
+typedef struct {
+	ReplayHeader header;				// file header
+	ReplayMove *moves;					// recorded locks
+	int count;							// moves in use
+	int capacity;						// moves allocated
+	uint32_t split_us[REPLAY_MAX_SPLITS];	// timed mode level-up splits (header.splits used)
+} Replay;
+
+// A recorded game re-simulated next to the player's
+typedef struct {
+	int active;							// 1 while a race is running
+	Replay replay;						// replay being raced
+	Game game;							// ghost's re-simulated game
+	int next_move;						// next replay move to apply
+} GhostRace;
+
+/*
+ * Timed modes
+ * -----------
+ * Sprints race to a clear count or a score, and time attack scores as
+ * much as possible before the clock runs out. The clock is the monotonic
+ * clock, sampled once per UI tick. Nothing in the loop sleeps past a tick
+ * (chains animate across ticks, see ChainAnimation), so times are accurate
+ * to a tick however slow a frame renders. Every level-up records a split,
+ * and the result and splits are saved with the replay.
+ */
+#define MODE_ENDLESS 0				// no clock: play until topping out
+#define MODE_CLEARS 1				// sprint: reach `goal` group clears
+#define MODE_SCORE 2				// sprint: reach `goal` points
+#define MODE_TIME 3					// time attack: best score in `goal` seconds
+
+// Clock of a timed game
+typedef struct {
+	int mode;							// MODE_*
+	uint32_t goal;						// clears, points or seconds, by mode
+	uint64_t start;						// monotonicNs when play started
+	uint64_t elapsed;					// ns played, frozen once finished
+	int completed;						// 1 if the goal was reached (or the time ran out)
+	int level;							// level the latest split was taken at
+	int splits;							// splits recorded
+	uint64_t split[REPLAY_MAX_SPLITS];	// elapsed ns at each level-up
+} TimedRun;
+
+// Phases of the live game's chain animation (see advanceChain)
+#define CHAIN_IDLE 0				// no lock being resolved
+#define CHAIN_CLEAR 1				// next: pop the groups that reach the threshold
+#define CHAIN_FLASH 2				// showing a step's chain text
+#define CHAIN_FALL 3				// dropping the board one row per frame
+#define CHAIN_FLASH_FRAMES 4		// chain text frames per step
+#define CHAIN_FLASH_NS 100000000u	// duration of a chain text frame
+#define CHAIN_FALL_NS 25000000u		// duration of a gravity frame
+
+// Live game's lock being resolved across UI ticks
+typedef struct {
+	int phase;							// CHAIN_*
+	int chain;							// steps resolved so far
+	int frame;							// chain text frames shown for the current step
+	uint64_t next;						// monotonicNs the next phase step is due
+	int recorded;						// 1 if the lock made it into the replay
+	int score_before;					// score before the lock, for versus nuisance
+} ChainAnimation;
+
+/*
+ * Corpus analysis
+ * ---------------
+ * The analyze command re-simulates every game of a replay corpus and
+ * aggregates where pieces go and what sets chains off. Each worker thread
+ * claims whole files and streams their games into its own fixed-size
+ * Analysis, reusing one move buffer, so nothing is allocated per game;
+ * the workers' results are summed at the end. Saved analyses are an
+ * AnalysisHeader followed by the Analysis, little-endian, no padding.
+ */
+#define ANALYSIS_MAGIC 0x4c4e4150u		// "PANL" in little-endian byte order
+#define ANALYSIS_VERSION 1			// bumped on any layout change
+#define PROFILES 4					// stack height quarters placements are split by
+#define MOVE_BUCKETS 16				// move number ranges chains are split by (the last is open-ended)
+#define MOVE_BUCKET_SIZE 25			// moves per range
+#define CHAIN_BUCKETS 20			// chain lengths counted (the last is that length or longer)
+#define SHAPE_SLOTS 1024			// pre-chain skylines tracked per analysis
+
+// A pre-chain skyline and how often it set a chain off
+typedef struct {
+	uint64_t key;						// column heights above the lowest, 4 bits per column
+	uint64_t count;						// chains it set off, including `error`
+	uint64_t error;						// count inherited from the shape it evicted (overestimate bound)
+	uint64_t chain_steps;				// total length of the chains counted since it was added
+} ShapeCount;
+
+// Aggregates over a corpus (or one worker's share of it)
+typedef struct {
+	uint64_t games;						// games re-simulated
+	uint64_t moves;						// locks re-simulated
+	uint64_t chains;					// locks that popped at least one group
+	uint64_t desynced;					// games that stopped matching their replay
+	uint64_t width, height;				// largest board seen
+	uint64_t placements[PROFILES][MAX_WIDTH][4];	// locks by stack height quarter, pivot column and rotation
+	uint64_t triggers[MAX_HEIGHT][MAX_WIDTH];		// pair cells of chain-starting locks by row (0 = floor) and column
+	uint64_t bucket_moves[MOVE_BUCKETS];			// locks by move number range
+	uint64_t chain_lengths[MOVE_BUCKETS][CHAIN_BUCKETS];	// chains by move number range and length
+	uint64_t shape_count;				// shapes in use
+	ShapeCount shapes[SHAPE_SLOTS];		// most frequent pre-chain skylines (space-saving summary)
+} Analysis;
+
+// Saved analysis header: the dimensions the Analysis arrays were built with
+typedef struct {
+	uint32_t magic;						// ANALYSIS_MAGIC
+	uint16_t version;					// ANALYSIS_VERSION
+	uint8_t profiles;					// PROFILES
+	uint8_t max_width;					// MAX_WIDTH
+	uint8_t max_height;					// MAX_HEIGHT
+	uint8_t move_buckets;				// MOVE_BUCKETS
+	uint8_t move_bucket_size;			// MOVE_BUCKET_SIZE
+	uint8_t chain_buckets;				// CHAIN_BUCKETS
+	uint16_t shape_slots;				// SHAPE_SLOTS
+	uint16_t reserved;					// 0
+} AnalysisHeader;
+
+typedef char analysis_header_size_check[sizeof(AnalysisHeader) == 16 ? 1 : -1];
+
+// Replay files being analyzed; workers claim them in order
+typedef struct {
+	char **paths;						// replay files (each holds one or more replays back to back)
+	int count;							// files
+	int capacity;						// paths allocated
+	int next;							// next file to claim (atomic)
+} Corpus;
+
+// One analyze worker thread and its accumulators
+typedef struct {
+	Corpus *corpus;						// shared file list
+	Analysis analysis;					// this worker's aggregates
+	int failed;							// 1 if a file could not be read
+	pthread_t thread;					// worker thread
+} AnalyzeWorker;
+
+#define CELL_EMPTY 0				// cell code: nothing drawn
+#define CELL_LANDING 16				// cell code: landing outline ("..")
+#define CELL_SPAWN 17				// cell code: death spawn mark ("XX")
+#define CELL_HINT 32				// cell code: hint outline ("::"), plus the puyo's color
+
+// Screen area showing one board; remembers what is on screen so only changed cells are redrawn
+typedef struct {
+	int top, left;						// screen position of the top-left border corner
+	int drawn;							// 0 until borders and cells are on screen
+	int shadow[MAX_HEIGHT][MAX_WIDTH];	// cell code currently shown per cell
+} BoardView;
+
+// Preview panel; remembers which pair colors are on screen
+typedef struct {
+	int drawn;							// 0 until the label and slots are on screen
+	uint8_t shadow[MAX_PREVIEW][2];		// pair shown per slot, {0, 0} when empty
+} PreviewView;
+
+// Scoring rulesets for --scoring, default first
+ScoreTable score_tables[] = {
+	{ "tsu",							// Puyo Puyo Tsu and most later games
+		{ 0, 8, 16, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 480, 512, 544, 576, 608, 640, 672 },
+		{ 0, 0, 3, 6, 12, 24, 48, 96, 192, 384, 768, 999, 999, 999, 999 },
+		{ 0, 0, 0, 0, 0, 2, 3, 4, 5, 6, 7, 10 } },
+	{ "classic",						// the first Puyo Puyo: steeper chain power capped early
+		{ 0, 8, 16, 32, 64, 128, 256, 512, 999, 999, 999, 999, 999, 999, 999, 999, 999, 999, 999, 999, 999, 999, 999, 999 },
+		{ 0, 0, 3, 6, 12, 24, 48, 96, 192, 384, 768, 999, 999, 999, 999 },
+		{ 0, 0, 0, 0, 0, 2, 3, 4, 5, 6, 7, 10 } },
+};
+
+// Live game shown on screen
+Game game;							// the player's game
+uint32_t ticks = 0;					// main loop iterations since the game started
+int attempts = 0;					// games started before the current one (see retryGame)
+
+// Timed modes
+TimedRun timed_run;					// clock of the live game (MODE_ENDLESS if untimed)
+
+// Replay recording and ghost race
+const char *record_path = NULL;		// where to save the live game's replay, if anywhere
+Replay recording;					// live game's replay
+GhostRace ghost_race;				// replay raced against, if any
+
+// Search arenas
+__thread Arena search_arena;		// this thread's bot search scratch memory
+int arena_huge_pages = 0;			// 1 to back search arenas with huge pages (--huge-pages)
+int arena_failed = 0;				// 1 once an arena failure has been printed (atomic)
+
+// Chain cache
+ChainSlot chain_cache[TOPOLOGY_MAX_NODES][CHAIN_SHARED_SIZE];	// resolved chains shared by the search threads of each node
+__thread ChainSummary chain_front[CHAIN_FRONT_SIZE];	// this thread's recently resolved chains
+
+// Worker placement
+Topology topology;					// usable CPUs by node (read at startup)
+int pin_workers = 0;				// 1 to bind each worker thread to one CPU (--pin)
+__thread int worker_node = -1;		// node this thread runs on, -1 until workerNode looks it up
 
-// Current and next pieces + current piece coords
-Block current;						// currently falling piece
-Block next;							// next-piece preview
-int cx = WIDTH / 2 - 1, cy = 0;		// current piece top-left (in 3x3 local coords)
+// Opening book
+Book opening_book;					// book the book bot, the versus AI and hints play from (--book)
 
-// Game stats / difficulty
-int score = 0;						// player's score
-int level = 1;						// current level
-int clears = 0;						// number of group clears (groups cleared)
-int max_colors = 4;					// how many colors are available (difficulty)
+// Versus mode
+VersusLevel versus_levels[] = {
+	{ "easy", 0, 50, 3 },				// greedy lookahead, slow hands
+	{ "normal", 0, 100, 8 },
+	{ "hard", 3, 250, 15 },				// expectimax
+	{ "expert", EXPECTI_BEAM, 500, 30 },
+};
+Versus versus;						// match against the AI, if any
+InputQueue player_input;			// player's keys on their way to the live game
+Hint hints;							// placement hints for the player, if enabled
+
+// Board views
+BoardView player_view = { 0, 0, 0, {{0}} };				// player's board at the left edge
+BoardView ghost_view = { 0, 0, 0, {{0}} };				// ghost's board right of the preview (placed in main)
+PreviewView preview_view = { 0, {{0}} };				// player's preview queue
+
+// UI / difficulty
 double base_speed = 1.0;			// base fall interval (seconds) for difficulty
 int input_locked = 0;				// when 1, ignore movement input
 
 // Chain visual fade state
+ChainAnimation chain_anim;			// lock being resolved, if any
 double fade_timer = 0.0;			// fade timer [0..1], >0 means show chain text
 int last_chain = 0;					// last chain size for display
+ChainStep last_step;				// score breakdown of the last chain step
+int last_all_clear = -1;			// all-clear bonus of the last chain, -1 if it left puyos
 
 // Function declarations
 int isCorner(int y, int x);
-void makeBlock(Block *b);
-void drawNextBlock();
+void dealPair(Game *g, uint8_t pair[2]);
+void pairBlock(const uint8_t pair[2], Block *b);
+uint32_t nextRandom(uint32_t *state);
+int parseBoard(const char *spec, Rules *rules, const char *(*check)(const Rules *rules));
+int parseScoring(const char *name, Rules *rules);
+const char *rulesError(const Rules *rules);
+const char *fieldRulesError(const Rules *rules);
+const BoardKernels *boardKernels(int width, int height);
+void resetGame(Game *g, const Rules *rules, uint32_t seed);
+void spawnPiece(Game *g);
+void drawPreview(PreviewView *v, Game *g);
 void rotateRight(Block *b);
 void rotateLeft(Block *b);
-int checkCollision(Block *b, int nx, int ny);
-int attemptRotation(Block rotated, int *nx, int *ny);
-void placeBlock(Block *b, int bx, int by);
-void drawGhost(Block *b, int x, int y);
-int gravityFailSafe();
-void animateGravity(int delay_us);
-void gravity();
-int dfs(int y, int x, int color, int coords[][2], int *count);
-int clearGroups(double chain_mult);
+int checkCollision(Game *g, Block *b, int nx, int ny);
+int attemptRotation(Game *g, Block rotated, int *nx, int *ny);
+void placeBlock(Game *g, Block *b, int bx, int by);
+void drawGhost(Game *g, int cells[MAX_HEIGHT][MAX_WIDTH]);
+void drawHint(Game *g, Placement p, int cells[MAX_HEIGHT][MAX_WIDTH]);
+void initColors();
+void drawPuyo(int sy, int sx, int color);
+void invalidateView(BoardView *v);
+void drawPlayfield(BoardView *v, Game *g, int show_piece);
+int cellColor(Game *g, int x, int y);
+uint64_t colorColumn(Game *g, int color, int x);
+void putCell(uint64_t *bits, int WORDS, int STRIDE, int x, int y, int color);
+uint64_t extractBits(uint64_t value, uint64_t mask);
+#if CPU_DISPATCH
+uint64_t pextBits(uint64_t value, uint64_t mask);
+int cpuHasSse42(void);
+int cpuHasAvx2(void);
+int cpuHasAvx2Pext(void);
+int cpuHasAvx512(void);
+#endif
+int cpuHasScalar(void);
+int selectCpu(const char *name);
+// Kernel instances of one instruction set level (see CPU_KERNELS)
+#define CPU_KERNEL_DECLS(LEVEL) \
+	int gravityStep6x13##LEVEL(Game *g); void gravity6x13##LEVEL(Game *g); \
+	int clearGroups6x13##LEVEL(Game *g, int chain, ChainStep *step); \
+	int gravityStep10x20##LEVEL(Game *g); void gravity10x20##LEVEL(Game *g); \
+	int clearGroups10x20##LEVEL(Game *g, int chain, ChainStep *step); \
+	int gravityStepGeneric##LEVEL(Game *g); void gravityGeneric##LEVEL(Game *g); \
+	int clearGroupsGeneric##LEVEL(Game *g, int chain, ChainStep *step); \
+	void fieldGravity##LEVEL(Field *f); void fieldClear##LEVEL(Field *f, ClearResult *r); \
+	int evaluate##LEVEL(Game *g);
+CPU_KERNEL_DECLS(Scalar)
+#if CPU_DISPATCH
+CPU_KERNEL_DECLS(Sse42)
+CPU_KERNEL_DECLS(Avx2)
+CPU_KERNEL_DECLS(Avx2Pext)
+CPU_KERNEL_DECLS(Avx512)
+#endif
+int applyClear(Game *g, int chain, const ClearResult *r, ChainStep *step);
+int gravityStep(Game *g);
+void gravity(Game *g);
+int clearGroups(Game *g, int chain, ChainStep *step);
+void scoreStep(const ScoreTable *t, int chain, const ClearResult *r, ChainStep *s);
+void traceStep(ChainTrace *trace, const ChainStep *step);
+int boardEmpty(const Game *g);
+int awardAllClear(Game *g);
+int garbageColumn(int width, int i);
+int dropGarbage(Game *g);
+int initField(Field *f, const Rules *rules, uint32_t seed);
+void freeField(Field *f);
+void fillRandom(uint64_t *bits, int W, int H, int WORDS, int STRIDE, int colors, uint32_t *rng);
+int fieldDrop(Field *f);
+int fieldSettle(Field *f);
+int pairTriggers(Game *g, Block *b, int bx, int by);
+int settle(Game *g, Block *pair, int bx, int by, ChainTrace *trace);
+uint64_t chainKey(const Game *g);
+int chainLookup(uint64_t key, ChainSummary *s);
+void chainStore(const ChainSummary *s);
+int resolveChain(Game *g);
+int applyPlacement(Game *g, Placement p);
+int lockPiece(Game *g, ChainTrace *trace);
 void drawBoard(int chain, double fade);
-void hardDrop();
-void chooseDifficulty();
+void hardDrop(Game *g);
+void chooseDifficulty(Rules *rules);
 void lock_and_cascade();
+void advanceChain(uint64_t now);
+void finishLock();
+void dropAfterLock(Game *g, int points, int *carry, Game *opponent);
+int showEnd(const char *message);
+int retryGame(uint32_t seed);
+void botFillState(Game *g, uint32_t id, BotState *s);
+int sendAll(BotSocket fd, const void *buf, size_t len);
+int recvAll(BotSocket fd, void *buf, size_t len);
+int botConnect(BotLink *link, const char *spec, int games);
+void botClose(BotLink *link);
+#ifdef __linux__
+void futexWait(uint32_t *addr, uint32_t val, int timeout_ms);
+void futexWake(uint32_t *addr);
+#endif
+int shmCreate(BotLink *link, const char *name, int games);
+int shmExchange(BotLink *link, const BotState *states, BotMove *moves, int count);
+int botExchange(BotLink *link, const BotState *states, BotMove *moves, int count);
+int runBotGames(BotLink *link, const Rules *rules, int count, int max_pieces, uint32_t seed);
+uint64_t monotonicNs(void);
+void metricsReleaseShard(void *shard);
+void metricsInitKey(void);
+MetricsShard *metricsShard(void);
+void metricAdd(uint64_t *counter, uint64_t n);
+void metricTime(LatencyStats *s, uint64_t ns);
+int difficultyIndex(int colors);
+void metricsGameStarted(Game *g);
+void metricsGameFinished(Game *g);
+int simStep(Game *g, int *carry, Game *opponent);
+double histogramQuantile(const uint64_t *buckets, uint64_t count, double q);
+size_t renderSummary(char *buf, size_t cap, size_t len, const char *name, const char *labels, const LatencyStats *s);
+void addLatency(LatencyStats *total, LatencyStats *s);
+uint64_t processOutputBytes(void);
+size_t renderMetrics(char *buf, size_t cap);
+void *metricsFileWriter(void *arg);
+#ifndef _WIN32
+void *metricsServer(void *arg);
+#endif
+int metricsStart(const char *spec);
+int evaluateBoard(Game *g);
+Placement thinkRandom(Game *g);
+Placement thinkGreedy(Game *g);
+int entrantOpen(Entrant *e, const char *spec, int workers);
+void entrantClose(Entrant *e);
+int entrantMove(Entrant *e, Game *g, Placement *p);
+void playMatch(Tournament *t, Match *m);
+void *tournamentWorker(void *arg);
+void runMatches(Tournament *t, int first);
+void queuePairing(Tournament *t, int a, int b);
+void queueSwissRound(Tournament *t, const int *points, char *met);
+void computeRatings(Tournament *t, double *elo, double *margin);
+void writeResults(Tournament *t, FILE *out);
+int runTournament(int argc, char **argv);
+int runMega(int argc, char **argv);
+double benchField(Field *f, const uint64_t *input, int clear, int reps);
+double benchGame(const Game *input, int clear, int reps);
+int runBench(int argc, char **argv);
+int blockRotation(Block *b);
+void replayInit(Replay *r, Game *g);
+int replayAppend(Replay *r, Game *g, uint32_t tick);
+int saveReplay(Replay *r, const char *path, int score, int append);
+int readReplay(FILE *f, Replay *r, const char *path);
+int loadReplay(Replay *r, const char *path);
+Rules *replayRules(const Replay *r, Rules *rules);
+void freeReplay(Replay *r);
+int replayApply(Game *g, const ReplayMove *m, ChainTrace *trace);
+int startGhostRace(GhostRace *race, const char *path);
+void ghostAdvance(GhostRace *race, uint32_t tick);
+void restartGhostRace(GhostRace *race);
+int inputPush(InputQueue *q, int key, int piece);
+int inputPop(InputQueue *q, int piece);
+int gameInput(Game *g, int key);
+const VersusLevel *findVersusLevel(const char *name);
+void *versusThread(void *arg);
+int startVersus(Versus *v, const VersusLevel *level, const Rules *rules, uint32_t seed);
+void stopVersus(Versus *v);
+void *hintThread(void *arg);
+int startHints(Hint *h);
+void stopHints(Hint *h);
+void postHint(Hint *h, const Game *g, uint64_t deadline);
+int currentHint(Hint *h, const Game *g, Placement *p);
+void versusSend(Game *from, Game *to, int *carry, int points);
+void versusLock(Versus *v);
+int lockVersusPiece(Game *g, int *carry, Game *opponent);
+void versusTick(Versus *v);
+int addCorpusPath(Corpus *c, const char *path);
+void countShape(Analysis *a, uint64_t key, uint64_t count, uint64_t error, uint64_t chain_steps);
+void analyzeGame(Analysis *a, const Replay *r);
+void *analyzeWorker(void *arg);
+void mergeAnalysis(Analysis *total, const Analysis *a);
+int saveAnalysis(const Analysis *a, const char *path);
+char heatChar(uint64_t count, uint64_t max);
+void writeAnalysis(const Analysis *a, FILE *out);
+int runAnalyze(int argc, char **argv);
+int parseMode(const char *spec, TimedRun *t);
+void startTimedRun(TimedRun *t, uint64_t now);
+int timedRunTick(TimedRun *t, Game *g, uint64_t now);
+char *formatTime(char *buf, size_t size, uint64_t ns);
+void finishRecording();
+uint64_t positionKey(const Game *g, int pairs);
+uint64_t *bookSlot(const uint64_t *slots, uint32_t count, uint64_t key);
+int bookRulesMatch(const BookHeader *h, const Rules *rules);
+int loadBook(Book *b, const char *path);
+void closeBook(Book *b);
+int bookMove(const Book *b, const Game *g, Placement *p);
+Placement thinkBook(Game *g);
+void *arenaAlloc(Arena *a, size_t size);
+void arenaRewind(Arena *a, size_t mark);
+void arenaFree(Arena *a);
+int parseCpuList(const char *list, int *cpus, int max);
+void readTopology(Topology *t);
+int workerCpu(const Topology *t, int worker, int workers);
+int workerNode(void);
+int startWorker(pthread_t *thread, void *(*body)(void *), void *arg, int worker, int workers);
+void keepOffUiCpu(pthread_attr_t *attr);
+long bestReply(Game *g, long base);
+void *bookWorker(void *arg);
+int bookInsert(BookTable *t, uint64_t key, int move);
+int nextCanonical(uint8_t *colors, int n, int max_colors);
+int queuePosition(BookTable *t, Game *g, Game **level, int *count, int *capacity);
+int runBook(int argc, char **argv);
+long leafValue(Game *g);
+int chanceClasses(Game *g, uint8_t pairs[][2], int *weights);
+long expectiReply(Game *a, long base);
+int searchExpectimax(Game *g, int beam, uint64_t deadline, Placement *best);
+Placement thinkExpectimax(Game *g);
 
 /**
  * Determines whether the given coordinates represent a corner cell
@@ -73,44 +1247,206 @@ int isCorner(int y, int x) {
 }
 
 /**
- * Creates a new vertical 1x2 puyo piece (facing upward by default)
- * with random colors in the available color range.
+ * Advances a xorshift32 generator. Each game owns one, so games seeded
+ * alike receive identical piece sequences regardless of thread timing.
+ *
+ * @param state Generator state; must be nonzero.
+ * @return Next pseudo-random value.
+ */
+uint32_t nextRandom(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+/**
+ * Draws the colors of a new pair from the game's generator, two draws
+ * per pair (child first, then pivot).
+ *
+ * @param g    Game whose generator and color count apply.
+ * @param pair Output colors {pivot, child}.
+ * @return void
+ */
+void dealPair(Game *g, uint8_t pair[2]) {
+	pair[1] = (uint8_t)(1 + nextRandom(&g->rng) % g->rules.colors);
+	pair[0] = (uint8_t)(1 + nextRandom(&g->rng) % g->rules.colors);
+}
+
+/**
+ * Creates a vertical 1x2 puyo piece (facing upward by default) from
+ * pair colors.
  *
- * @param b Pointer to the Block structure to initialize.
+ * @param pair Colors {pivot, child}.
+ * @param b    Pointer to the Block structure to initialize.
  * @return void
  */
-void makeBlock(Block *b) {
+void pairBlock(const uint8_t pair[2], Block *b) {
 	memset(b->shape, 0, sizeof(b->shape));
 	memset(b->color, 0, sizeof(b->color));
 	// Fill middle column top and middle (vertical 1x2)
 	b->shape[0][1] = 1;
 	b->shape[1][1] = 1;
-	// Assign random colors from available set
-	b->color[0][1] = 1 + rand() % max_colors;
-	b->color[1][1] = 1 + rand() % max_colors;
+	b->color[0][1] = pair[1];
+	b->color[1][1] = pair[0];
 }
 
 /**
- * Draws the "next piece" preview to the right of the playfield.
+ * Parses a board size for --board: "classic" (6x13 with one hidden row),
+ * "wide" (10x20) or "WxH[+HIDDEN]". The color count is left untouched.
  *
- * @return void
+ * @param spec  Board spec from the command line.
+ * @param rules Rules whose size fields are set.
+ * @param check Limits to apply: rulesError for games, fieldRulesError for fields.
+ * @return 0 on success, -1 if the spec is malformed or out of range (reason printed to stderr).
  */
-void drawNextBlock() {
-	int offset = WIDTH * 2 + 8;
-	mvprintw(3, offset, "Next:");
-	for (int y = 0; y < SIZE; y++) {
-		for (int x = 0; x < SIZE; x++) {
-			if (next.shape[y][x]) {
-				attron(COLOR_PAIR(next.color[y][x]));
-				mvaddch(4 + y, offset + x * 2, ' ' | A_REVERSE);
-				mvaddch(4 + y, offset + x * 2 + 1, ' ' | A_REVERSE);
-				attroff(COLOR_PAIR(next.color[y][x]));
-			} else {
-				mvaddch(4 + y, offset + x * 2, ' ');
-				mvaddch(4 + y, offset + x * 2 + 1, ' ');
-			}
+int parseBoard(const char *spec, Rules *rules, const char *(*check)(const Rules *rules)) {
+	Rules r = *rules;
+	char tail;
+	r.hidden = 0;
+	if (strcmp(spec, "classic") == 0) {
+		r.width = 6;
+		r.height = 13;
+		r.hidden = 1;
+	} else if (strcmp(spec, "wide") == 0) {
+		r.width = 10;
+		r.height = 20;
+	} else if (sscanf(spec, "%dx%d%c", &r.width, &r.height, &tail) != 2
+		&& sscanf(spec, "%dx%d+%d%c", &r.width, &r.height, &r.hidden, &tail) != 3) {
+		fprintf(stderr, "bad board '%s' (use classic, wide or WxH[+HIDDEN])\n", spec);
+		return -1;
+	}
+	const char *error = check(&r);
+	if (error) {
+		fprintf(stderr, "bad board '%s': %s\n", spec, error);
+		return -1;
+	}
+	*rules = r;
+	return 0;
+}
+
+/**
+ * Parses a score table name for --scoring (see score_tables).
+ *
+ * @param name  Table name from the command line.
+ * @param rules Rules whose scoring is set.
+ * @return 0 on success, -1 if no table has that name (reason printed to stderr).
+ */
+int parseScoring(const char *name, Rules *rules) {
+	for (size_t i = 0; i < sizeof(score_tables) / sizeof(score_tables[0]); i++) {
+		if (strcmp(name, score_tables[i].name) == 0) {
+			rules->scoring = (int)i;
+			return 0;
 		}
 	}
+	fprintf(stderr, "unknown scoring '%s' (use tsu or classic)\n", name);
+	return -1;
+}
+
+/**
+ * Checks that a board size and color count can be played.
+ *
+ * @param rules Rules to check.
+ * @return NULL if valid, otherwise a description of the problem.
+ */
+const char *rulesError(const Rules *rules) {
+	if (rules->width < 3 || rules->width > MAX_WIDTH) return "width must be 3..16";
+	if (rules->height < 4 || rules->height > MAX_HEIGHT) return "height must be 4..64";
+	if (rules->hidden < 0 || rules->hidden > rules->height - 2) return "hidden rows must leave at least two visible rows";
+	if (rules->colors < 1 || rules->colors > MAX_COLORS) return "colors must be 1..14";
+	if (rules->threshold < 2 || rules->threshold > 8) return "the pop threshold must be 2..8";
+	if (rules->preview < 1 || rules->preview > MAX_PREVIEW) return "the preview must be 1..5 pairs";
+	if (rules->all_clear < 0 || rules->all_clear > 65535) return "the all-clear bonus must be 0..65535";
+	if (rules->garbage_rate < 0 || rules->garbage_rate > 255) return "the garbage rate must be 0..255";
+	if (rules->scoring < 0 || rules->scoring >= (int)(sizeof(score_tables) / sizeof(score_tables[0]))) return "unknown score table";
+	return NULL;
+}
+
+/**
+ * Checks that a field (see Field) can be played.
+ *
+ * @param rules Rules to check.
+ * @return NULL if valid, otherwise a description of the problem.
+ */
+const char *fieldRulesError(const Rules *rules) {
+	if (rules->width < 2 || rules->width > FIELD_MAX_SIDE) return "width must be 2..4096";
+	if (rules->height < 4 || rules->height > FIELD_MAX_SIDE) return "height must be 4..4096";
+	if (rules->hidden < 0 || rules->hidden > rules->height - 2) return "hidden rows must leave at least two visible rows";
+	if (rules->colors < 1 || rules->colors > MAX_COLORS) return "colors must be 1..14";
+	if (rules->threshold < 2 || rules->threshold > 8) return "the pop threshold must be 2..8";
+	if (rules->scoring < 0 || rules->scoring >= (int)(sizeof(score_tables) / sizeof(score_tables[0]))) return "unknown score table";
+	return NULL;
+}
+
+/**
+ * Clears a game back to an empty board with a fresh current piece, a
+ * full preview queue and zeroed stats.
+ *
+ * @param g     Game to reset.
+ * @param rules Board size and colors; must pass rulesError.
+ * @param seed  Piece sequence seed.
+ * @return void
+ */
+void resetGame(Game *g, const Rules *rules, uint32_t seed) {
+	memset(g, 0, sizeof(*g));
+	g->rules = *rules;
+	g->kernels = boardKernels(rules->width, rules->height);
+	g->level = 1;
+	g->seed = seed;
+	g->rng = seed * 2654435761u ^ 0x9e3779b9u;	// spread small seeds, never zero
+	if (g->rng == 0) g->rng = 1;
+	uint8_t pair[2];
+	dealPair(g, pair);
+	pairBlock(pair, &g->current);
+	for (int i = 0; i < g->rules.preview; i++) dealPair(g, g->queue[i]);
+	g->cx = g->rules.width / 2 - 1;
+	g->cy = 0;
+}
+
+/**
+ * Promotes the next pair in the preview queue to the current piece at
+ * the spawn location and deals a new pair into the freed ring slot, so
+ * the queue costs no more generator draws than a single preview.
+ *
+ * @param g Game to advance.
+ * @return void
+ */
+void spawnPiece(Game *g) {
+	uint8_t *slot = g->queue[g->queue_head];
+	pairBlock(slot, &g->current);
+	dealPair(g, slot);
+	if (++g->queue_head == g->rules.preview) g->queue_head = 0;
+	g->cx = g->rules.width / 2 - 1;
+	g->cy = 0;
+}
+
+/**
+ * Draws the preview queue to the right of the playfield, next pair
+ * first and deeper pairs to its right. Only slots whose pair changed
+ * since the last frame are repainted.
+ *
+ * @param v View remembering what is on screen.
+ * @param g Game whose queue is shown.
+ * @return void
+ */
+void drawPreview(PreviewView *v, Game *g) {
+	int offset = g->rules.width * 2 + 8;
+	if (!v->drawn) {
+		mvprintw(3, offset, "Next:");
+		memset(v->shadow, 0xff, sizeof(v->shadow));
+		v->drawn = 1;
+	}
+	int slot = g->queue_head;
+	for (int i = 0; i < g->rules.preview; i++) {
+		const uint8_t *pair = g->queue[slot];
+		if (++slot == g->rules.preview) slot = 0;
+		if (pair[0] == v->shadow[i][0] && pair[1] == v->shadow[i][1]) continue;
+		v->shadow[i][0] = pair[0];
+		v->shadow[i][1] = pair[1];
+		drawPuyo(4, offset + 2 + i * 3, pair[1]);
+		drawPuyo(5, offset + 2 + i * 3, pair[0]);
+	}
 }
 
 /**
@@ -165,20 +1501,21 @@ void rotateLeft(Block *b) {
  * Checks for collision when placing a block with its 3x3 top-left
  * positioned at (nx, ny) on the playfield.
  *
+ * @param g  Game whose board is tested.
  * @param b  Pointer to the Block being tested.
  * @param nx X-coordinate for the block's 3x3 top-left on the board.
  * @param ny Y-coordinate for the block's 3x3 top-left on the board.
  * @return 1 if a collision or out-of-bounds is detected, 0 otherwise.
  */
-int checkCollision(Block *b, int nx, int ny) {
+int checkCollision(Game *g, Block *b, int nx, int ny) {
 	for (int y = 0; y < SIZE; y++) {
 		for (int x = 0; x < SIZE; x++) {
 			if (b->shape[y][x]) {
 				int gx = nx + x;
 				int gy = ny + y;
 				// out-of-bounds or occupied
-				if (gx < 0 || gx >= WIDTH || gy >= HEIGHT) return 1;
-				if (gy >= 0 && board[gy][gx]) return 1;
+				if (gx < 0 || gx >= g->rules.width || gy >= g->rules.height) return 1;
+				if (gy >= 0 && (g->planes[0][gx] >> gy & 1)) return 1;
 			}
 		}
 	}
@@ -189,21 +1526,22 @@ int checkCollision(Block *b, int nx, int ny) {
  * Attempts to apply a rotation (already computed in `rotated`) with basic
  * wall and floor kicks, adjusting the piece position as needed.
  *
+ * @param g       Game whose current piece is rotated.
  * @param rotated A copy of the rotated Block to test.
  * @param nx      Pointer to the current X-coordinate; updated on success.
  * @param ny      Pointer to the current Y-coordinate; updated on success.
  * @return 1 if the rotation succeeds and `current` is updated, 0 otherwise.
  */
-int attemptRotation(Block rotated, int *nx, int *ny) {
+int attemptRotation(Game *g, Block rotated, int *nx, int *ny) {
 	// offsets to try: no offset, left, right, up, up-left, up-right
 	int offsets[][2] = { {0,0}, {-1,0}, {1,0}, {0,-1}, {-1,-1}, {1,-1} };
 	for (int i = 0; i < 6; i++) {
 		int tx = *nx + offsets[i][0];
 		int ty = *ny + offsets[i][1];
-		if (!checkCollision(&rotated, tx, ty)) {
+		if (!checkCollision(g, &rotated, tx, ty)) {
 			*nx = tx;
 			*ny = ty;
-			current = rotated;
+			g->current = rotated;
 			return 1;
 		}
 	}
@@ -214,20 +1552,20 @@ int attemptRotation(Block rotated, int *nx, int *ny) {
  * Places a block permanently onto the board grid at the specified
  * 3x3 top-left board coordinates.
  *
+ * @param g  Game whose board receives the block.
  * @param b  Pointer to the Block to place.
  * @param bx X-coordinate of the block's 3x3 top-left on the board.
  * @param by Y-coordinate of the block's 3x3 top-left on the board.
  * @return void
  */
-void placeBlock(Block *b, int bx, int by) {
+void placeBlock(Game *g, Block *b, int bx, int by) {
 	for (int y = 0; y < SIZE; y++) {
 		for (int x = 0; x < SIZE; x++) {
 			if (b->shape[y][x]) {
 				int gx = bx + x;
 				int gy = by + y;
-				if (gy >= 0 && gy < HEIGHT && gx >= 0 && gx < WIDTH) {
-					board[gy][gx] = 1;
-					board_color[gy][gx] = b->color[y][x];
+				if (gy >= 0 && gy < g->rules.height && gx >= 0 && gx < g->rules.width) {
+					putCell(g->planes[0], 1, MAX_WIDTH, gx, gy, b->color[y][x]);
 				}
 			}
 		}
@@ -235,414 +1573,5478 @@ void placeBlock(Block *b, int bx, int by) {
 }
 
 /**
- * Draws a "ghost" outline of where the current piece would land if it
- * were hard-dropped from its current position.
+ * Looks up the color of one cell.
  *
- * @param b Pointer to the Block to visualize.
- * @param x Current X-coordinate of the block's 3x3 top-left.
- * @param y Current Y-coordinate of the block's 3x3 top-left.
- * @return void
+ * @param g Game whose board is read.
+ * @param x Column.
+ * @param y Row (0 = top).
+ * @return Color code (1..MAX_COLORS or NUISANCE), or 0 if the cell is empty.
  */
-void drawGhost(Block *b, int x, int y) {
-	for (int xx = 0; xx < SIZE; xx++) {
-		for (int yy = 0; yy < SIZE; yy++) {
-			if (b->shape[yy][xx]) {
-				int gx = x + xx;
-				int gy = y + yy;
-				
-				// Drop each cell separately to its lowest possible position
-				while (gy + 1 < HEIGHT && !board[gy + 1][gx]) {
-					gy++;
-				}
-				
-				if (gy >= 0 && gy < HEIGHT && gx >= 0 && gx < WIDTH) {
-					mvaddch(gy + 1, (gx + 1) * 2, '.');
-					mvaddch(gy + 1, (gx + 1) * 2 + 1, '.');
-				}
-			}
-		}
-	}
+int cellColor(Game *g, int x, int y) {
+	int code = 0;
+	for (int b = 0; b < COLOR_BITS; b++) code |= (int)(g->planes[1 + b][x] >> y & 1) << b;
+	return code;
 }
 
 /**
- * Performs a single gravity step using a temporary buffer to avoid
- * mid-step corruption and moves each block as far down as possible.
+ * Finds the cells of one color in a column of a game's board.
  *
- * @return 1 if any block moved during this step, 0 otherwise.
+ * @param g     Game whose board is read.
+ * @param color Color code to match.
+ * @param x     Column.
+ * @return Column word with a bit set for every cell of that color.
  */
-int gravityFailSafe() {
-	int moved = 0;
-	int tmp[HEIGHT][WIDTH] = {0};
-	int tmpc[HEIGHT][WIDTH] = {0};
-	// Copy each block to its lowest stable position in tmp buffers
-	for (int y = HEIGHT - 1; y >= 0; y--) {
-		for (int x = 0; x < WIDTH; x++) {
-			if (board[y][x]) {
-				int ny = y;
-				while (ny + 1 < HEIGHT && !board[ny + 1][x]) ny++;
-				if (ny != y) moved = 1;
-				tmp[ny][x] = 1;
-				tmpc[ny][x] = board_color[y][x];
-			}
-		}
-	}
-	// Commit tmp back to the real board
-	memcpy(board, tmp, sizeof(board));
-	memcpy(board_color, tmpc, sizeof(board_color));
-	return moved;
+uint64_t colorColumn(Game *g, int color, int x) {
+	uint64_t differ = 0;
+	for (int b = 0; b < COLOR_BITS; b++) differ |= g->planes[1 + b][x] ^ -(uint64_t)(color >> b & 1);
+	return g->planes[0][x] & ~differ;
 }
 
 /**
- * Applies animated gravity, repeatedly performing safe gravity steps
- * and redrawing the board with a delay between frames.
+ * Gathers the bits of `value` selected by `mask` into the low bits of the
+ * result, keeping their order (a portable PEXT).
  *
- * @param delay_us Delay in microseconds between gravity frames.
- * @return void
+ * @param value Bits to gather from.
+ * @param mask  Positions to gather.
+ * @return Gathered bits.
  */
-void animateGravity(int delay_us) {
-	while (gravityFailSafe()) {
-		drawBoard(last_chain, fade_timer);	// update display while visible gravity runs
-		usleep(delay_us);
+uint64_t extractBits(uint64_t value, uint64_t mask) {
+	uint64_t out = 0;
+	for (uint64_t bit = 1; mask; bit <<= 1) {
+		if (value & mask & -mask) out |= bit;
+		mask &= mask - 1;
 	}
+	return out;
 }
 
+#if CPU_DISPATCH
 /**
- * Applies gravity in a non-animated manner until all blocks are settled.
+ * extractBits in one BMI2 instruction. Only called by kernel levels that
+ * require BMI2.
  *
- * @return void
+ * @param value Bits to gather from.
+ * @param mask  Positions to gather.
+ * @return Gathered bits.
+ */
+__attribute__((target("bmi2"))) uint64_t pextBits(uint64_t value, uint64_t mask) {
+	return __builtin_ia32_pext_di(value, mask);
+}
+#endif
+
+/**
+ * Mask of the rows [lo, hi) that fall in one word of a column.
+ *
+ * @param lo First row.
+ * @param hi One past the last row.
+ * @param w  Word index (rows 64w .. 64w+63).
+ * @return Bits of word w covering the range.
  */
-void gravity() {
-	while (gravityFailSafe());
+static inline __attribute__((always_inline)) uint64_t rowRange(int lo, int hi, int w) {
+	lo -= w * 64;
+	hi -= w * 64;
+	if (lo < 0) lo = 0;
+	if (hi > 64) hi = 64;
+	if (lo >= hi) return 0;
+	return (hi == 64 ? ~0ull : (1ull << hi) - 1) & ~((1ull << lo) - 1);
 }
 
-// Visited map used by DFS group detection
-int visited[HEIGHT][WIDTH];
+// Word w of column x in plane c of a kernel bitboard
+#define BITS(c, x, w) bits[((size_t)(c) * STRIDE + (x)) * WORDS + (w)]
 
 /**
- * Performs a depth-first search to collect all connected blocks of the
- * same color starting from (y, x), storing their coordinates.
+ * Stores a puyo in a kernel bitboard: sets its occupancy bit and its
+ * color code bits. The cell must be empty.
  *
- * @param y      Starting row on the board.
- * @param x      Starting column on the board.
- * @param color  Target color to match.
- * @param coords Output array of (y, x) coordinate pairs for the group.
- * @param count  Pointer to an integer that accumulates the group size.
- * @return 1 if a new group exploration started from this call, 0 otherwise.
+ * @param bits   Bitplanes (see BITS).
+ * @param WORDS  Words per column.
+ * @param STRIDE Columns allocated per plane.
+ * @param x      Column.
+ * @param y      Row (0 = top).
+ * @param color  Color code (1..MAX_COLORS or NUISANCE).
+ * @return void
  */
-int dfs(int y, int x, int color, int coords[][2], int *count) {
-	if (y < 0 || y >= HEIGHT || x < 0 || x >= WIDTH) return 0;
-	if (!board[y][x] || board_color[y][x] != color || visited[y][x]) return 0;
-	visited[y][x] = 1;
-	coords[*count][0] = y;
-	coords[*count][1] = x;
-	(*count)++;
-	dfs(y + 1, x, color, coords, count);
-	dfs(y - 1, x, color, coords, count);
-	dfs(y, x + 1, color, coords, count);
-	dfs(y, x - 1, color, coords, count);
-	return 1;
+void putCell(uint64_t *bits, int WORDS, int STRIDE, int x, int y, int color) {
+	uint64_t bit = 1ull << (y & 63);
+	BITS(0, x, y / 64) |= bit;
+	for (int b = 0; b < COLOR_BITS; b++) BITS(1 + b, x, y / 64) |= bit & -(uint64_t)(color >> b & 1);
 }
 
 /**
- * Finds and clears all color groups of size 4 or more, updating the
- * score and level based on the chain multiplier.
+ * Gravity step kernel: every puyo with an empty cell anywhere below it
+ * falls one row, carrying across word boundaries. Used for animation,
+ * one frame per step.
  *
- * @param chain_mult Multiplier applied to the score for this chain step.
- * @return Total number of blocks cleared during this pass.
+ * @param bits   Bitplanes (see BITS).
+ * @param W      Board width.
+ * @param H      Board height.
+ * @param WORDS  Words per column.
+ * @param STRIDE Columns allocated per plane.
+ * @return 1 if any puyo moved, 0 otherwise.
  */
-int clearGroups(double chain_mult) {
-	memset(visited, 0, sizeof(visited));
-	int total = 0, groups = 0;
-	for (int y = 0; y < HEIGHT; y++) {
-		for (int x = 0; x < WIDTH; x++) {
-			if (board[y][x] && !visited[y][x]) {
-				int coords[HEIGHT * WIDTH][2];
-				int cnt = 0;
-				int color = board_color[y][x];
-				dfs(y, x, color, coords, &cnt);
-				if (cnt >= 4) {
-					// Remove only the matched group's cells
-					for (int i = 0; i < cnt; i++) {
-						int cy = coords[i][0], cx = coords[i][1];
-						board[cy][cx] = 0;
-						board_color[cy][cx] = 0;
-					}
-					score += (int)(cnt * 100 * chain_mult); // scoring per block * chain mult
-					total += cnt;
-					groups++;
-				}
+static inline __attribute__((always_inline)) int gravityStepBits(uint64_t *bits, const int W, const int H,
+	const int WORDS, const int STRIDE) {
+	int moved = 0;
+	for (int x = 0; x < W; x++) {
+		// Everything above the lowest hole is floating
+		int hole = -1;
+		for (int w = WORDS - 1; w >= 0 && hole < 0; w--) {
+			uint64_t empty = ~BITS(0, x, w) & rowRange(0, H, w);
+			if (empty) hole = w * 64 + 63 - __builtin_clzll(empty);
+		}
+		if (hole < 0) continue;
+		uint64_t floating = 0;
+		for (int w = 0; w <= hole / 64; w++) floating |= BITS(0, x, w) & rowRange(0, hole, w);
+		if (!floating) continue;
+		moved = 1;
+		for (int c = 0; c < PLANES; c++) {
+			for (int w = hole / 64; w >= 0; w--) {
+				uint64_t p = BITS(c, x, w), below = rowRange(0, hole, w);
+				uint64_t carry = w > 0 ? (BITS(c, x, w - 1) & rowRange(0, hole, w - 1)) >> 63 : 0;
+				BITS(c, x, w) = (p & ~below) | (p & below) << 1 | carry;
 			}
 		}
 	}
-	// Update clears and level if any groups removed
-	if (groups > 0) {
-		clears += groups;
-		if (clears / 5 >= level) level++;
-	}
-	return total;
+	return moved;
 }
 
 /**
- * Draws the playfield, including the settled board, the current piece,
- * the next-piece preview, UI elements, and any active chain fade text.
+ * Gravity kernel: packs every column's puyos against the floor in one
+ * pass, keeping their order. Each word's puyos are gathered with
+ * `extract` and streamed into the settled rows.
  *
- * @param chain Current chain count being displayed.
- * @param fade  Fade factor for the chain text (0.0–1.0).
+ * @param bits    Bitplanes (see BITS).
+ * @param scratch WORDS words of scratch space.
+ * @param W       Board width.
+ * @param H       Board height.
+ * @param WORDS   Words per column.
+ * @param STRIDE  Columns allocated per plane.
+ * @param extract extractBits or pextBits.
  * @return void
  */
-void drawBoard(int chain, double fade) {
-	move(0, 0);
-
-	// Draw top border
-	mvprintw(0, 0, "+");
-	for (int i = 0; i < WIDTH * 2 + 1; i++) printw("=");
-	printw("+");
-
-	// Draw sides and board
-	for (int y = 0; y < HEIGHT; y++) {
-		mvaddch(y + 1, 0, 'O');
-		for (int x = 0; x < WIDTH; x++) {
-			int screen_x = (x + 1) * 2; // shifted right one column
-			if (board[y][x]) {
-				attron(COLOR_PAIR(board_color[y][x]));
-				mvaddch(y + 1, screen_x, ' ' | A_REVERSE);
-				mvaddch(y + 1, screen_x + 1, ' ' | A_REVERSE);
-				attroff(COLOR_PAIR(board_color[y][x]));
-			} else {
-				mvaddch(y + 1, screen_x, ' ');
-				mvaddch(y + 1, screen_x + 1, ' ');
+static inline __attribute__((always_inline)) void gravityBits(uint64_t *bits, uint64_t *scratch, const int W, const int H,
+	const int WORDS, const int STRIDE, uint64_t (*extract)(uint64_t value, uint64_t mask)) {
+	for (int x = 0; x < W; x++) {
+		int n = 0, settled = 1;
+		for (int w = 0; w < WORDS; w++) n += __builtin_popcountll(BITS(0, x, w));
+		for (int w = 0; w < WORDS && settled; w++) settled = BITS(0, x, w) == rowRange(H - n, H, w);
+		if (settled) continue;
+		for (int c = 1; c < PLANES; c++) {
+			int pos = H - n;
+			for (int w = 0; w < WORDS; w++) scratch[w] = 0;
+			for (int w = 0; w < WORDS; w++) {
+				uint64_t occupied = BITS(0, x, w);
+				if (!occupied) continue;
+				uint64_t v = extract(BITS(c, x, w), occupied);
+				int k = __builtin_popcountll(occupied), shift = pos & 63;
+				scratch[pos / 64] |= v << shift;
+				// Never true for one word, but the bound lets the compiler see that too
+				if (shift + k > 64 && pos / 64 + 1 < WORDS) scratch[pos / 64 + 1] |= v >> (64 - shift);
+				pos += k;
 			}
+			for (int w = 0; w < WORDS; w++) BITS(c, x, w) = scratch[w];
 		}
-		mvaddch(y + 1, (WIDTH + 1) * 2, 'O'); // right wall
+		for (int w = 0; w < WORDS; w++) BITS(0, x, w) = rowRange(H - n, H, w);
 	}
+}
 
-	// Draw bottom border
-	mvprintw(HEIGHT + 1, 0, "+");
-	for (int i = 0; i < WIDTH * 2 + 1; i++) printw("=");
-	printw("+");
-
-	// Draw death spawn location
-	mvprintw(1, 12, "X");
-	mvprintw(2, 12, "X");
-	mvprintw(1, 13, "X");
-	mvprintw(2, 13, "X");
-	
-	// Draw ghost and current piece
-	drawGhost(&current, cx, cy);
-	for (int y = 0; y < SIZE; y++) {
-		for (int x = 0; x < SIZE; x++) {
-			if (current.shape[y][x]) {
-				int gx = cx + x;
-				int gy = cy + y;
-				if (gy >= 0 && gy < HEIGHT && gx >= 0 && gx < WIDTH) {
-					attron(COLOR_PAIR(current.color[y][x]));
-					mvaddch(gy + 1, (gx + 1) * 2, ' ' | A_REVERSE);
-					mvaddch(gy + 1, (gx + 1) * 2 + 1, ' ' | A_REVERSE);
-					attroff(COLOR_PAIR(current.color[y][x]));
+/**
+ * Clear kernel: finds every same-color group of at least `threshold`
+ * puyos in the visible rows by bit-parallel flood fill (a seed cell is
+ * grown to its neighbors in the color's mask, one step per sweep over the
+ * group's bounding box, until it stops changing) and removes the groups.
+ * Nuisance puyos never group; those next to a popped group are cleared
+ * with it (the popped mask dilated by one cell, ANDed with the nuisance
+ * cells). Whether a group pops is applied as a mask, so no setting adds a
+ * branch. Runs in constant stack space whatever the
+ * board size. Points are left to scoreStep.
+ *
+ * @param bits       Bitplanes (see BITS).
+ * @param scratch    3 * W * WORDS words of scratch space.
+ * @param W          Board width.
+ * @param H          Board height.
+ * @param WORDS      Words per column.
+ * @param STRIDE     Columns allocated per plane.
+ * @param colors     Colors in play (1..colors are grouped).
+ * @param threshold  Puyos a group needs to pop.
+ * @param hidden     Rows at the top that never pop.
+ * @param group_bonus Group bonus by size from the score table.
+ * @param out        What the pass removed.
+ * @return void
+ */
+static inline __attribute__((always_inline)) void clearBits(uint64_t *bits, uint64_t *scratch, const int W, const int H,
+	const int WORDS, const int STRIDE, int colors, int threshold, int hidden, const uint8_t *group_bonus, ClearResult *out) {
+	uint64_t *rest = scratch, *group = scratch + W * WORDS, *popped = scratch + 2 * W * WORDS;
+#define CELL(a, x, w) a[(x) * WORDS + (w)]
+	memset(group, 0, sizeof(uint64_t) * W * WORDS * 2);
+	memset(out, 0, sizeof(*out));
+	for (int c = 1; c <= colors; c++) {
+		for (int x = 0; x < W; x++) {
+			for (int w = 0; w < WORDS; w++) {
+				uint64_t differ = 0;
+				for (int b = 0; b < COLOR_BITS; b++) differ |= BITS(1 + b, x, w) ^ -(uint64_t)(c >> b & 1);
+				CELL(rest, x, w) = BITS(0, x, w) & ~differ & rowRange(hidden, H, w);
+			}
+		}
+		for (int x = 0; x < W; x++) {
+			for (int w = 0; w < WORDS; w++) {
+				while (CELL(rest, x, w)) {
+					CELL(group, x, w) = CELL(rest, x, w) & -CELL(rest, x, w);
+					int xlo = x, xhi = x, wlo = w, whi = w, grown = 1;
+					while (grown) {
+						// Widen the box only past edges the group touches
+						uint64_t left = 0, right = 0, top = 0, bottom = 0;
+						for (int j = wlo; j <= whi; j++) {
+							left |= CELL(group, xlo, j);
+							right |= CELL(group, xhi, j);
+						}
+						for (int i = xlo; i <= xhi; i++) {
+							top |= CELL(group, i, wlo) & 1;
+							bottom |= CELL(group, i, whi) >> 63;
+						}
+						if (left && xlo > 0) xlo--;
+						if (right && xhi < W - 1) xhi++;
+						if (top && wlo > 0) wlo--;
+						if (bottom && whi < WORDS - 1) whi++;
+						grown = 0;
+						for (int i = xlo; i <= xhi; i++) {
+							for (int j = wlo; j <= whi; j++) {
+								uint64_t cur = CELL(group, i, j);
+								uint64_t next = cur | cur << 1 | cur >> 1;
+								if (j > 0) next |= CELL(group, i, j - 1) >> 63;
+								if (j < WORDS - 1) next |= CELL(group, i, j + 1) << 63;
+								if (i > 0) next |= CELL(group, i - 1, j);
+								if (i < W - 1) next |= CELL(group, i + 1, j);
+								next &= CELL(rest, i, j);
+								if (next != cur) {
+									CELL(group, i, j) = next;
+									grown = 1;
+								}
+							}
+						}
+					}
+					int count = 0;
+					for (int i = xlo; i <= xhi; i++) {
+						for (int j = wlo; j <= whi; j++) count += __builtin_popcountll(CELL(group, i, j));
+					}
+					uint64_t pops = -(uint64_t)(count >= threshold);
+					for (int i = xlo; i <= xhi; i++) {
+						for (int j = wlo; j <= whi; j++) {
+							CELL(rest, i, j) &= ~CELL(group, i, j);
+							CELL(popped, i, j) |= CELL(group, i, j) & pops;
+							CELL(group, i, j) = 0;
+						}
+					}
+					out->group_bonus += group_bonus[count < GROUP_BONUSES ? count : GROUP_BONUSES - 1] & (int)pops;
+					out->colors |= (uint32_t)pops & 1u << c;
+					out->cleared += count & (int)pops;
+					out->groups += (int)(pops & 1);
+				}
+			}
+		}
+	}
+	if (out->groups > 0) {
+		// Nuisance next to a popped cell goes too; `group` is all zero again and holds the result
+		for (int x = 0; x < W; x++) {
+			for (int w = 0; w < WORDS; w++) {
+				uint64_t p = CELL(popped, x, w);
+				uint64_t near = p | p << 1 | p >> 1;
+				if (w > 0) near |= CELL(popped, x, w - 1) >> 63;
+				if (w < WORDS - 1) near |= CELL(popped, x, w + 1) << 63;
+				if (x > 0) near |= CELL(popped, x - 1, w);
+				if (x < W - 1) near |= CELL(popped, x + 1, w);
+				uint64_t nuisance = BITS(0, x, w) & rowRange(hidden, H, w);
+				for (int b = 0; b < COLOR_BITS; b++) nuisance &= BITS(1 + b, x, w) ^ -(uint64_t)(~NUISANCE >> b & 1);
+				CELL(group, x, w) = near & nuisance;
+			}
+		}
+		for (int x = 0; x < W; x++) {
+			for (int w = 0; w < WORDS; w++) {
+				out->nuisance += __builtin_popcountll(CELL(group, x, w));
+				CELL(popped, x, w) |= CELL(group, x, w);
+			}
+		}
+		// Remove the popped cells from every plane
+		for (int x = 0; x < W; x++) {
+			for (int w = 0; w < WORDS; w++) {
+				if (!CELL(popped, x, w)) continue;
+				for (int c = 0; c < PLANES; c++) BITS(c, x, w) &= ~CELL(popped, x, w);
+			}
+		}
+	}
+#undef CELL
+}
+
+/**
+ * Scores one clear pass as a chain step (see Scoring).
+ *
+ * @param t     Score table.
+ * @param chain Chain step number, 1 for the pass right after a lock.
+ * @param r     What the pass removed.
+ * @param s     Output breakdown.
+ * @return void
+ */
+void scoreStep(const ScoreTable *t, int chain, const ClearResult *r, ChainStep *s) {
+	s->cleared = r->cleared;
+	s->groups = r->groups;
+	s->nuisance = r->nuisance;
+	s->colors = __builtin_popcount(r->colors);
+	s->chain_power = t->chain_power[(chain < CHAIN_POWERS ? chain : CHAIN_POWERS) - 1];
+	s->color_bonus = t->color_bonus[s->colors];
+	s->group_bonus = r->group_bonus;
+	int bonus = s->chain_power + s->color_bonus + s->group_bonus;
+	s->bonus = bonus < 1 ? 1 : bonus > MAX_BONUS ? MAX_BONUS : bonus;
+	s->points = 10 * s->cleared * s->bonus;
+}
+
+/**
+ * Adds a clear pass to a game's score, clear count and level.
+ *
+ * @param g     Game the pass ran on.
+ * @param chain Chain step number of the pass.
+ * @param r     What the pass removed.
+ * @param step  Output score breakdown, or NULL.
+ * @return Number of puyos cleared.
+ */
+int applyClear(Game *g, int chain, const ClearResult *r, ChainStep *step) {
+	ChainStep s;
+	scoreStep(&score_tables[g->rules.scoring], chain, r, &s);
+	if (r->groups > 0) {
+		g->score += s.points;
+		g->clears += r->groups;
+		if (g->clears / 5 >= g->level) g->level++;
+	}
+	if (step) *step = s;
+	return r->cleared;
+}
+
+/**
+ * Scores a settled board for the built-in bots: rewards same-color
+ * neighbors (chain material) and penalizes tall columns, especially the
+ * spawn column whose blockage ends the game. Instanced per CPU level by
+ * CPU_KERNELS; evaluateBoard calls the selected one.
+ *
+ * @param g Game to evaluate.
+ * @return Heuristic value; higher is better.
+ */
+static inline __attribute__((always_inline)) int evaluateBits(Game *g) {
+	if (g->over) return -1000000;
+	int value = 0, width = g->rules.width, rows = g->rules.height;
+	for (int x = 0; x < width; x++) {
+		uint64_t occupied = g->planes[0][x];
+		int height = occupied ? rows - __builtin_ctzll(occupied) : 0;
+		// Same-color neighbors: both occupied, no color code bit differs, not nuisance
+		uint64_t vertical = occupied & occupied >> 1, horizontal = x + 1 < width ? occupied & g->planes[0][x + 1] : 0;
+		uint64_t nuisance = occupied;
+		for (int b = 0; b < COLOR_BITS; b++) {
+			uint64_t p = g->planes[1 + b][x];
+			vertical &= ~(p ^ p >> 1);
+			horizontal &= ~(p ^ g->planes[1 + b][x + 1 < width ? x + 1 : x]);
+			nuisance &= -(uint64_t)(NUISANCE >> b & 1) ^ ~p;
+		}
+		value += 20 * (__builtin_popcountll(vertical & ~nuisance) + __builtin_popcountll(horizontal & ~nuisance));
+		value -= height * height;
+		if (x == width / 2 && height > rows - 6) value -= 5000;
+	}
+	return value;
+}
+
+// Instantiates the game kernels for one board size (one word per column) and CPU level
+#define BOARD_KERNELS(SIZE, W, H, LEVEL, ATTR, EXTRACT) \
+	ATTR int gravityStep##SIZE##LEVEL(Game *g) { \
+		return gravityStepBits(g->planes[0], W, H, 1, MAX_WIDTH); \
+	} \
+	ATTR void gravity##SIZE##LEVEL(Game *g) { \
+		uint64_t scratch[1]; \
+		gravityBits(g->planes[0], scratch, W, H, 1, MAX_WIDTH, EXTRACT); \
+	} \
+	ATTR int clearGroups##SIZE##LEVEL(Game *g, int chain, ChainStep *step) { \
+		uint64_t scratch[3 * MAX_WIDTH]; \
+		ClearResult r; \
+		clearBits(g->planes[0], scratch, W, H, 1, MAX_WIDTH, g->rules.colors, g->rules.threshold, g->rules.hidden, \
+			score_tables[g->rules.scoring].group_bonus, &r); \
+		return applyClear(g, chain, &r, step); \
+	}
+
+// Instantiates every kernel for one CPU level: 6x13, 10x20, any game size, fields and evaluation
+#define CPU_KERNELS(LEVEL, ATTR, EXTRACT) \
+	BOARD_KERNELS(6x13, 6, 13, LEVEL, ATTR, EXTRACT) \
+	BOARD_KERNELS(10x20, 10, 20, LEVEL, ATTR, EXTRACT) \
+	BOARD_KERNELS(Generic, g->rules.width, g->rules.height, LEVEL, ATTR, EXTRACT) \
+	ATTR void fieldGravity##LEVEL(Field *f) { \
+		gravityBits(f->bits, f->scratch, f->rules.width, f->rules.height, f->words, f->rules.width, EXTRACT); \
+	} \
+	ATTR void fieldClear##LEVEL(Field *f, ClearResult *r) { \
+		clearBits(f->bits, f->scratch, f->rules.width, f->rules.height, f->words, f->rules.width, f->rules.colors, \
+			f->rules.threshold, f->rules.hidden, score_tables[f->rules.scoring].group_bonus, r); \
+	} \
+	ATTR int evaluate##LEVEL(Game *g) { \
+		return evaluateBits(g); \
+	}
+
+CPU_KERNELS(Scalar, , extractBits)
+#if CPU_DISPATCH
+CPU_KERNELS(Sse42, TARGET_SSE42, extractBits)
+CPU_KERNELS(Avx2, TARGET_AVX2, extractBits)
+CPU_KERNELS(Avx2Pext, TARGET_AVX2_PEXT, pextBits)
+CPU_KERNELS(Avx512, TARGET_AVX512, pextBits)
+#endif
+
+// One CPU level's entry in cpu_kernels
+#define CPU_LEVEL(NAME, LEVEL, PEXT) \
+	{ NAME, PEXT, cpuHas##LEVEL, { \
+		{ 6, 13, "6x13", gravityStep6x13##LEVEL, gravity6x13##LEVEL, clearGroups6x13##LEVEL }, \
+		{ 10, 20, "10x20", gravityStep10x20##LEVEL, gravity10x20##LEVEL, clearGroups10x20##LEVEL }, \
+		{ 0, 0, "generic", gravityStepGeneric##LEVEL, gravityGeneric##LEVEL, clearGroupsGeneric##LEVEL } }, \
+		fieldGravity##LEVEL, fieldClear##LEVEL, evaluate##LEVEL }
+
+// Kernel levels, slowest first
+CpuKernels cpu_kernels[] = {
+	CPU_LEVEL("scalar", Scalar, 0),
+#if CPU_DISPATCH
+	CPU_LEVEL("sse4.2", Sse42, 0),
+	CPU_LEVEL("avx2", Avx2, 0),
+	CPU_LEVEL("avx2-pext", Avx2Pext, 1),
+	CPU_LEVEL("avx512", Avx512, 1),
+#endif
+};
+
+const CpuKernels *cpu = &cpu_kernels[0];	// level picked by selectCpu
+
+/**
+ * The scalar level runs anywhere.
+ *
+ * @return 1.
+ */
+int cpuHasScalar(void) {
+	return 1;
+}
+
+#if CPU_DISPATCH
+/**
+ * Tells whether the host has POPCNT and SSE4.2.
+ *
+ * @return 1 if supported, 0 otherwise.
+ */
+int cpuHasSse42(void) {
+	return __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("sse4.2");
+}
+
+/**
+ * Tells whether the host has AVX2 and BMI1 (and SSE4.2).
+ *
+ * @return 1 if supported, 0 otherwise.
+ */
+int cpuHasAvx2(void) {
+	return cpuHasSse42() && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi");
+}
+
+/**
+ * Tells whether the host has AVX2 and BMI2.
+ *
+ * @return 1 if supported, 0 otherwise.
+ */
+int cpuHasAvx2Pext(void) {
+	return cpuHasAvx2() && __builtin_cpu_supports("bmi2");
+}
+
+/**
+ * Tells whether the host has the AVX-512 F, BW, VL and DQ subsets and BMI2.
+ *
+ * @return 1 if supported, 0 otherwise.
+ */
+int cpuHasAvx512(void) {
+	return cpuHasAvx2Pext() && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+		&& __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq");
+}
+#endif
+
+/**
+ * Selects the kernel level every later game, field and bot uses. Call it
+ * before starting any thread. Detection picks the fastest supported
+ * level, skipping PEXT levels on AMD families where PEXT is microcoded.
+ *
+ * @param name Level name from --cpu, or NULL / "auto" to detect.
+ * @return 0 on success, -1 if the level is unknown or unsupported.
+ */
+int selectCpu(const char *name) {
+	size_t count = sizeof(cpu_kernels) / sizeof(cpu_kernels[0]);
+#if CPU_DISPATCH
+	__builtin_cpu_init();
+	int slow_pext = __builtin_cpu_is("amdfam15h") || __builtin_cpu_is("amdfam17h");
+#else
+	int slow_pext = 0;
+#endif
+	if (!name || strcmp(name, "auto") == 0) {
+		for (size_t i = count; i-- > 0;) {
+			if (cpu_kernels[i].supported() && !(cpu_kernels[i].pext && slow_pext)) {
+				cpu = &cpu_kernels[i];
+				return 0;
+			}
+		}
+		cpu = &cpu_kernels[0];
+		return 0;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (strcmp(name, cpu_kernels[i].name) != 0) continue;
+		if (!cpu_kernels[i].supported()) {
+			fprintf(stderr, "this CPU does not support the %s kernels\n", name);
+			return -1;
+		}
+		cpu = &cpu_kernels[i];
+		return 0;
+	}
+	fprintf(stderr, "unknown CPU level '%s' (auto, scalar", name);
+	for (size_t i = 1; i < count; i++) fprintf(stderr, ", %s", cpu_kernels[i].name);
+	fprintf(stderr, ")\n");
+	return -1;
+}
+
+/**
+ * Picks the kernels for a board size from the selected CPU level: a
+ * specialized instance if one exists, the generic one otherwise.
+ *
+ * @param width  Board width.
+ * @param height Board height.
+ * @return Kernel table (never NULL).
+ */
+const BoardKernels *boardKernels(int width, int height) {
+	const BoardKernels *k = cpu->boards;
+	while (k->width && (k->width != width || k->height != height)) k++;
+	return k;
+}
+
+/**
+ * Performs a single gravity step: every floating puyo falls one row.
+ *
+ * @param g Game whose board is updated.
+ * @return 1 if any block moved during this step, 0 otherwise.
+ */
+int gravityStep(Game *g) {
+	return g->kernels->gravity_step(g);
+}
+
+/**
+ * Applies gravity in a non-animated manner until all blocks are settled.
+ *
+ * @param g Game whose board is updated.
+ * @return void
+ */
+void gravity(Game *g) {
+	g->kernels->gravity(g);
+}
+
+/**
+ * Finds and clears all color groups that reach the rules' threshold,
+ * scoring the pass as chain step `chain` and updating the level. Rows
+ * hidden by the rules never pop.
+ *
+ * @param g     Game whose board is cleared.
+ * @param chain Chain step number, 1 for the first pass after a lock.
+ * @param step  Output score breakdown, or NULL.
+ * @return Total number of blocks cleared during this pass.
+ */
+int clearGroups(Game *g, int chain, ChainStep *step) {
+	return g->kernels->clear_groups(g, chain, step);
+}
+
+/**
+ * Allocates an empty field.
+ *
+ * @param f     Field to initialize; release it with freeField.
+ * @param rules Board size and colors; must pass fieldRulesError.
+ * @param seed  Pair sequence seed.
+ * @return 0 on success, -1 if out of memory.
+ */
+int initField(Field *f, const Rules *rules, uint32_t seed) {
+	memset(f, 0, sizeof(*f));
+	f->rules = *rules;
+	f->words = (rules->height + 63) / 64;
+	size_t column_words = (size_t)rules->width * f->words;
+	f->bits = calloc(column_words * PLANES, sizeof(uint64_t));
+	f->scratch = malloc(column_words * 3 * sizeof(uint64_t));
+	f->rng = seed * 2654435761u ^ 0x9e3779b9u;	// same spreading as resetGame
+	if (f->rng == 0) f->rng = 1;
+	if (!f->bits || !f->scratch) {
+		freeField(f);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Releases a field's planes.
+ *
+ * @param f Field to free.
+ * @return void
+ */
+void freeField(Field *f) {
+	free(f->bits);
+	free(f->scratch);
+	f->bits = f->scratch = NULL;
+}
+
+/**
+ * Fills roughly half of a bitboard's cells with random colors, without
+ * settling them. Used to build benchmark inputs.
+ *
+ * @param bits   Bitplanes (see BITS).
+ * @param W      Board width.
+ * @param H      Board height.
+ * @param WORDS  Words per column.
+ * @param STRIDE Columns allocated per plane.
+ * @param colors Colors to draw from.
+ * @param rng    Generator state.
+ * @return void
+ */
+void fillRandom(uint64_t *bits, int W, int H, int WORDS, int STRIDE, int colors, uint32_t *rng) {
+	for (int x = 0; x < W; x++) {
+		for (int y = 0; y < H; y++) {
+			uint32_t r = nextRandom(rng);
+			if (r & 1) continue;
+			putCell(bits, WORDS, STRIDE, x, y, 1 + (r >> 1) % colors);
+		}
+	}
+}
+
+/**
+ * Drops a random pair into a field: it appears in the top rows of a
+ * random column (vertical) or two neighboring columns (horizontal) and is
+ * left for fieldSettle to pull down.
+ *
+ * @param f Field to drop into.
+ * @return 1 if the pair fit, 0 if its cells were occupied (topped out).
+ */
+int fieldDrop(Field *f) {
+	int W = f->rules.width, WORDS = f->words, STRIDE = W;
+	uint64_t *bits = f->bits;
+	int x = nextRandom(&f->rng) % W;
+	int horizontal = (nextRandom(&f->rng) & 1) && x + 1 < W;
+	int cells[2][2] = { { x, 1 }, { horizontal ? x + 1 : x, horizontal ? 1 : 0 } };
+	for (int i = 0; i < 2; i++) {
+		if (BITS(0, cells[i][0], 0) >> cells[i][1] & 1) return 0;
+	}
+	for (int i = 0; i < 2; i++) putCell(bits, WORDS, STRIDE, cells[i][0], cells[i][1], 1 + nextRandom(&f->rng) % f->rules.colors);
+	f->pieces++;
+	return 1;
+}
+
+/**
+ * Resolves a field after a drop: gravity, then clear and gravity again
+ * until nothing pops, timing each kernel.
+ *
+ * @param f Field to resolve.
+ * @return Number of chain steps that cleared at least one group.
+ */
+int fieldSettle(Field *f) {
+	int chain = 0;
+	while (1) {
+		uint64_t start = monotonicNs();
+		cpu->field_gravity(f);
+		uint64_t mid = monotonicNs();
+		ClearResult r;
+		cpu->field_clear(f, &r);
+		f->gravity_ns += mid - start;
+		f->clear_ns += monotonicNs() - mid;
+		if (r.groups == 0) break;
+		ChainStep step;
+		scoreStep(&score_tables[f->rules.scoring], chain + 1, &r, &step);
+		f->score += step.points;
+		f->clears += r.groups;
+		chain++;
+	}
+	if (chain > f->max_chain) f->max_chain = chain;
+	return chain;
+}
+
+/**
+ * Tells whether a game's board is empty. Columns past the board width are
+ * always empty, so this is one OR over the fixed-size occupancy plane,
+ * cheap enough for every node of a bot search.
+ *
+ * @param g Game to test.
+ * @return 1 if no cell is occupied, 0 otherwise.
+ */
+int boardEmpty(const Game *g) {
+	uint64_t occupied = 0;
+	for (int x = 0; x < MAX_WIDTH; x++) occupied |= g->planes[0][x];
+	return occupied == 0;
+}
+
+/**
+ * Awards the all-clear bonus if a finished chain emptied the board.
+ *
+ * @param g Game whose chain just ended.
+ * @return Bonus added to the score, or -1 if the board is not empty.
+ */
+int awardAllClear(Game *g) {
+	if (!boardEmpty(g)) return -1;
+	g->score += g->rules.all_clear;
+	return g->rules.all_clear;
+}
+
+/**
+ * Column the i-th odd nuisance puyo of a drop falls into: the left and
+ * right halves of the board interleaved (0, 3, 1, 4, 2, 5 on the classic
+ * field), so a few puyos spread across the whole width.
+ *
+ * @param width Board width.
+ * @param i     Position in the order, 0..width-1.
+ * @return Board column.
+ */
+int garbageColumn(int width, int i) {
+	return i % 2 == 0 ? i / 2 : (width + 1) / 2 + i / 2;
+}
+
+/**
+ * Drops pending nuisance puyos onto a settled board: whole rows first,
+ * then the remainder one per column in garbageColumn order, continuing
+ * where the previous drop stopped. At most GARBAGE_ROWS rows fall at
+ * once; the rest stays pending. Nuisance puyos that do not fit above a
+ * column are lost. Each column is a single mask OR into every plane,
+ * since the nuisance code has all its bits set.
+ *
+ * @param g Game to drop onto.
+ * @return Number of nuisance puyos dropped.
+ */
+int dropGarbage(Game *g) {
+	int width = g->rules.width;
+	int count = g->garbage < GARBAGE_ROWS * width ? g->garbage : GARBAGE_ROWS * width;
+	int fall[MAX_WIDTH];
+	for (int x = 0; x < width; x++) fall[x] = count / width;
+	for (int i = 0; i < count % width; i++) {
+		fall[garbageColumn(width, g->garbage_turn)]++;
+		if (++g->garbage_turn == width) g->garbage_turn = 0;
+	}
+	for (int x = 0; x < width; x++) {
+		uint64_t occupied = g->planes[0][x];
+		int top = occupied ? __builtin_ctzll(occupied) : g->rules.height;
+		uint64_t cells = rowRange(top - fall[x], top, 0);
+		for (int p = 0; p < PLANES; p++) g->planes[p][x] |= cells;
+	}
+	g->garbage -= count;
+	return count;
+}
+
+/**
+ * Appends a chain step to a trace.
+ *
+ * @param trace Trace to extend.
+ * @param step  Step's score breakdown.
+ * @return void
+ */
+void traceStep(ChainTrace *trace, const ChainStep *step) {
+	if (trace->steps < TRACE_STEPS) trace->step[trace->steps] = *step;
+	trace->steps++;
+	trace->points += step->points;
+}
+
+/**
+ * Tells whether a pair that just locked can pop anything. The board was
+ * stable before the lock, so any group that pops contains a cell of the
+ * pair: this flood fills the visible cells of each landed pair cell's
+ * color (a pair cell ends up on top of its column once gravity has run)
+ * and stops as soon as a group reaches the threshold. Most locks
+ * pop nothing, and this lets them skip the full clear scan.
+ *
+ * @param g  Game after the pair was placed and gravity applied.
+ * @param b  The pair's block.
+ * @param bx X-coordinate of the block's 3x3 top-left when it was placed.
+ * @param by Y-coordinate of the block's 3x3 top-left when it was placed.
+ * @return 1 if a group can pop, 0 if nothing can.
+ */
+int pairTriggers(Game *g, Block *b, int bx, int by) {
+	int W = g->rules.width, landed[MAX_WIDTH] = {0};
+	for (int y = 0; y < SIZE; y++) {
+		for (int x = 0; x < SIZE; x++) {
+			if (b->shape[y][x] && by + y >= 0 && by + y < g->rules.height && bx + x >= 0 && bx + x < W) landed[bx + x]++;
+		}
+	}
+	uint64_t visible = rowRange(g->rules.hidden, g->rules.height, 0);
+	for (int seed_x = 0; seed_x < W; seed_x++) {
+		// The pair's cells are the top landed[seed_x] cells of the column
+		uint64_t occupied = g->planes[0][seed_x];
+		for (int i = 0; i < landed[seed_x]; i++, occupied &= occupied - 1) {
+			uint64_t seed = occupied & -occupied & visible;
+			if (!seed) continue;
+			int color = cellColor(g, seed_x, __builtin_ctzll(seed)), size = 0, grown = 1;
+			uint64_t mask[MAX_WIDTH], group[MAX_WIDTH];
+			for (int x = 0; x < W; x++) {
+				mask[x] = colorColumn(g, color, x) & visible;
+				group[x] = x == seed_x ? seed : 0;
+			}
+			while (grown) {
+				grown = 0;
+				size = 0;
+				uint64_t left = 0;
+				for (int x = 0; x < W; x++) {
+					uint64_t cell = group[x], right = x + 1 < W ? group[x + 1] : 0;
+					uint64_t next = (cell | cell << 1 | cell >> 1 | left | right) & mask[x];
+					grown |= next != cell;
+					left = cell;
+					group[x] = next;
+					size += __builtin_popcountll(next);
+				}
+				if (size >= g->rules.threshold) return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Resolves the board after a lock without any animation: applies gravity,
+ * then clears groups and re-applies gravity until nothing else pops. The
+ * group scan is skipped when pairTriggers shows the pair cannot pop
+ * anything, and without a trace the chain comes from the chain cache
+ * when it has been resolved before (see resolveChain).
+ *
+ * @param g     Game to resolve.
+ * @param pair  The pair that was just locked.
+ * @param bx    X-coordinate of the pair's 3x3 top-left.
+ * @param by    Y-coordinate of the pair's 3x3 top-left.
+ * @param trace Output score breakdown of every step, or NULL.
+ * @return Number of chain steps that cleared at least one group.
+ */
+int settle(Game *g, Block *pair, int bx, int by, ChainTrace *trace) {
+	int chain = 0;
+	ChainStep step;
+	if (trace) trace->steps = trace->points = trace->all_clear = 0;
+	gravity(g);
+	if (!pairTriggers(g, pair, bx, by)) return 0;
+	if (!trace) chain = resolveChain(g);
+	else {
+		while (clearGroups(g, chain + 1, &step) > 0) {
+			traceStep(trace, &step);
+			chain++;
+			gravity(g);
+		}
+	}
+	int bonus = chain > 0 ? awardAllClear(g) : -1;
+	if (trace && bonus >= 0) {
+		trace->all_clear = 1;
+		trace->points += bonus;
+	}
+	return chain;
+}
+
+/**
+ * Hashes what decides a board's chain: every plane of the board's columns
+ * and the rules that affect clearing and scoring.
+ *
+ * @param g Game whose board is hashed.
+ * @return Chain cache key, never 0.
+ */
+uint64_t chainKey(const Game *g) {
+	const Rules *r = &g->rules;
+	uint64_t h = (uint64_t)r->width | (uint64_t)r->height << 8 | (uint64_t)r->hidden << 16 | (uint64_t)r->colors << 24
+		| (uint64_t)r->threshold << 32 | (uint64_t)r->scoring << 40;
+	for (int p = 0; p < PLANES; p++) {
+		for (int x = 0; x < r->width; x++) {
+			h = (h ^ g->planes[p][x]) * 0x9e3779b97f4a7c15ull;
+			h ^= h >> 29;
+		}
+	}
+	return h ? h : 1;
+}
+
+/**
+ * Looks a board up in this thread's front cache, then in the shared one
+ * of the thread's NUMA node.
+ * A shared hit is copied into the front cache. A shared slot being
+ * written, or rewritten during the copy, counts as a miss.
+ *
+ * @param key Board's chainKey.
+ * @param s   Output summary on a hit.
+ * @return 1 on a hit, 0 on a miss.
+ */
+int chainLookup(uint64_t key, ChainSummary *s) {
+	ChainSummary *f = &chain_front[key & (CHAIN_FRONT_SIZE - 1)];
+	if (f->key == key) {
+		*s = *f;
+		return 1;
+	}
+	ChainSlot *slot = &chain_cache[workerNode()][(key >> 16) & (CHAIN_SHARED_SIZE - 1)];
+	uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+	if ((sequence & 1) || __atomic_load_n(&slot->summary.key, __ATOMIC_RELAXED) != key) return 0;
+	const uint64_t *from = (const uint64_t *)&slot->summary;
+	uint64_t *to = (uint64_t *)s;
+	for (size_t i = 0; i < sizeof(ChainSummary) / sizeof(uint64_t); i++) to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence || s->key != key) return 0;
+	*f = *s;
+	return 1;
+}
+
+/**
+ * Adds a resolved chain to this thread's front cache (see chainLookup)
+ * and to its node's shared cache, replacing whatever the slots held. The shared
+ * slot is left alone if another thread is writing it.
+ *
+ * @param s Summary to store.
+ * @return void
+ */
+void chainStore(const ChainSummary *s) {
+	chain_front[s->key & (CHAIN_FRONT_SIZE - 1)] = *s;
+	ChainSlot *slot = &chain_cache[workerNode()][(s->key >> 16) & (CHAIN_SHARED_SIZE - 1)];
+	uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+	if ((sequence & 1) || !__atomic_compare_exchange_n(&slot->sequence, &sequence, sequence + 1, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	const uint64_t *from = (const uint64_t *)s;
+	uint64_t *to = (uint64_t *)&slot->summary;
+	for (size_t i = 0; i < sizeof(ChainSummary) / sizeof(uint64_t); i++) __atomic_store_n(&to[i], from[i], __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Clears groups and re-applies gravity until nothing else pops, like
+ * settle's loop, but replays the outcome from the chain cache when the
+ * board has been resolved before: the final board, the points and the
+ * clears step by step, so level-ups land exactly as applyClear would
+ * have given them.
+ *
+ * @param g Game with a settled board that may pop.
+ * @return Number of chain steps that cleared at least one group.
+ */
+int resolveChain(Game *g) {
+	ChainSummary s;
+	uint64_t key = chainKey(g);
+	int chain = 0;
+	if (chainLookup(key, &s)) {
+		memcpy(g->planes, s.planes, sizeof(g->planes));
+		g->score += (int)s.points;
+		for (int groups; chain < CHAIN_CACHE_STEPS && (groups = s.groups[chain / 8] >> chain % 8 * 8 & 0xff); chain++) {
+			g->clears += groups;
+			if (g->clears / 5 >= g->level) g->level++;
+		}
+		return chain;
+	}
+
+	int score = g->score, clears = g->clears, cacheable = 1;
+	s.key = key;
+	memset(s.groups, 0, sizeof(s.groups));
+	while (clearGroups(g, chain + 1, NULL) > 0) {
+		int groups = g->clears - clears;
+		clears = g->clears;
+		if (chain < CHAIN_CACHE_STEPS && groups < 256) s.groups[chain / 8] |= (uint64_t)groups << chain % 8 * 8;
+		else cacheable = 0;
+		chain++;
+		gravity(g);
+	}
+	if (cacheable) {
+		memcpy(s.planes, g->planes, sizeof(s.planes));
+		s.points = (uint64_t)(g->score - score);
+		chainStore(&s);
+	}
+	return chain;
+}
+
+/**
+ * Moves the current piece of a freshly spawned pair to a placement:
+ * rotates it at the spawn location, slides it along the spawn row to the
+ * target column and hard-drops it. The piece is left in place (not locked).
+ *
+ * @param g Game whose current piece is moved.
+ * @param p Target column and rotation.
+ * @return 1 if the placement was reachable and applied, 0 if the piece was left untouched.
+ */
+int applyPlacement(Game *g, Placement p) {
+	Block b = g->current;
+	for (int i = 0; i < (p.rotation & 3); i++) rotateRight(&b);
+	int x = g->cx, y = g->cy;
+	if (checkCollision(g, &b, x, y)) return 0;
+	// Slide one column at a time so walls of stacked puyos block the path
+	int target = p.column - 1;
+	int step = target > x ? 1 : -1;
+	while (x != target) {
+		if (checkCollision(g, &b, x + step, y)) return 0;
+		x += step;
+	}
+	g->current = b;
+	g->cx = x;
+	hardDrop(g);
+	return 1;
+}
+
+/**
+ * Locks the current piece into the board without animation, resolves
+ * the resulting chain, spawns the next piece and flags game over if the
+ * spawn location is blocked.
+ *
+ * @param g     Game to advance.
+ * @param trace Output score breakdown of the chain, or NULL.
+ * @return Number of chain steps triggered by the lock.
+ */
+int lockPiece(Game *g, ChainTrace *trace) {
+	Block pair = g->current;
+	int bx = g->cx, by = g->cy;
+	placeBlock(g, &pair, bx, by);
+	g->pieces++;
+	spawnPiece(g);
+	int chain = settle(g, &pair, bx, by, trace);
+	g->garbage += g->rules.garbage_rate;
+	if (g->garbage > 0) dropGarbage(g);
+	if (checkCollision(g, &g->current, g->cx, g->cy)) g->over = 1;
+	return chain;
+}
+
+/**
+ * Marks a "ghost" outline of where the current piece would land if it
+ * were hard-dropped from its current position.
+ *
+ * @param g     Game whose current piece is previewed.
+ * @param cells Cell codes of the frame being built.
+ * @return void
+ */
+void drawGhost(Game *g, int cells[MAX_HEIGHT][MAX_WIDTH]) {
+	for (int xx = 0; xx < SIZE; xx++) {
+		for (int yy = 0; yy < SIZE; yy++) {
+			if (g->current.shape[yy][xx]) {
+				int gx = g->cx + xx;
+				int gy = g->cy + yy;
+
+				// Drop each cell separately to its lowest possible position
+				while (gy + 1 < g->rules.height && !(g->planes[0][gx] >> (gy + 1) & 1)) {
+					gy++;
+				}
+
+				if (gy >= 0 && gy < g->rules.height && gx >= 0 && gx < g->rules.width) {
+					cells[gy][gx] = CELL_LANDING;
 				}
 			}
 		}
 	}
+}
+
+/**
+ * Marks where a hinted placement would leave the current pair once it
+ * has settled, each puyo in its own color.
+ *
+ * @param g     Game whose current piece the hint is for.
+ * @param p     Suggested placement (see currentHint).
+ * @param cells Cell codes of the frame being built.
+ * @return void
+ */
+void drawHint(Game *g, Placement p, int cells[MAX_HEIGHT][MAX_WIDTH]) {
+	Game a = *g;
+	if (!applyPlacement(&a, p)) return;
+	placeBlock(&a, &a.current, a.cx, a.cy);
+	gravity(&a);
+	for (int x = 0; x < g->rules.width; x++) {
+		uint64_t landed = a.planes[0][x] & ~g->planes[0][x];
+		for (int y = 0; y < g->rules.height; y++) {
+			if (landed >> y & 1) cells[y][x] = CELL_HINT + cellColor(&a, x, y);
+		}
+	}
+}
+
+/**
+ * Sets up one color pair per color code. Colors 8..14 use the bright
+ * half of a 16-color terminal; nuisance puyos are white.
+ *
+ * @return void
+ */
+void initColors() {
+	for (int c = 1; c <= MAX_COLORS; c++) {
+		int base = c <= 7 ? c : c - 7;
+		init_pair(c, c > 7 && COLORS >= 16 ? base + 8 : base, COLOR_BLACK);
+	}
+	init_pair(NUISANCE, COLOR_WHITE, COLOR_BLACK);
+}
+
+/**
+ * Draws one puyo as a two-column cell: a solid block in its color.
+ * Nuisance puyos are drawn as "()", and on terminals with fewer than 16
+ * colors colors 8..14 are drawn as "<>" in the color they share a pair with.
+ *
+ * @param sy    Screen row.
+ * @param sx    Screen column of the cell's left half.
+ * @param color Color code (1..MAX_COLORS or NUISANCE).
+ * @return void
+ */
+void drawPuyo(int sy, int sx, int color) {
+	attron(COLOR_PAIR(color));
+	if (color == NUISANCE || (color > 7 && COLORS < 16)) {
+		const char *glyph = color == NUISANCE ? "()" : "<>";
+		mvaddch(sy, sx, glyph[0] | A_BOLD);
+		mvaddch(sy, sx + 1, glyph[1] | A_BOLD);
+	} else {
+		mvaddch(sy, sx, ' ' | A_REVERSE);
+		mvaddch(sy, sx + 1, ' ' | A_REVERSE);
+	}
+	attroff(COLOR_PAIR(color));
+}
+
+/**
+ * Forgets what a view has on screen so the next draw repaints it fully
+ * (after clear() or anything else that overwrote the screen).
+ *
+ * @param v View to invalidate.
+ * @return void
+ */
+void invalidateView(BoardView *v) {
+	v->drawn = 0;
+}
+
+/**
+ * Draws one board into its view: builds the frame's cell codes (settled
+ * puyos, spawn marks and optionally the falling piece with its landing
+ * outline) and repaints only the cells that differ from the last frame.
+ *
+ * @param v          View to draw into.
+ * @param g          Game to show.
+ * @param show_piece 1 to overlay the current piece and its landing spot.
+ * @return void
+ */
+void drawPlayfield(BoardView *v, Game *g, int show_piece) {
+	int width = g->rules.width, height = g->rules.height;
+	int cells[MAX_HEIGHT][MAX_WIDTH];
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) cells[y][x] = cellColor(g, x, y);
+	}
+
+	// Death spawn location
+	cells[0][width / 2] = CELL_SPAWN;
+	cells[1][width / 2] = CELL_SPAWN;
+
+	// Ghost, hint and current piece
+	if (show_piece) {
+		Placement hint;
+		drawGhost(g, cells);
+		if (g == &game && currentHint(&hints, g, &hint)) drawHint(g, hint, cells);
+		for (int y = 0; y < SIZE; y++) {
+			for (int x = 0; x < SIZE; x++) {
+				int gx = g->cx + x;
+				int gy = g->cy + y;
+				if (g->current.shape[y][x] && gy >= 0 && gy < height && gx >= 0 && gx < width) {
+					cells[gy][gx] = g->current.color[y][x];
+				}
+			}
+		}
+	}
+
+	if (!v->drawn) {
+		// Top and bottom borders
+		mvprintw(v->top, v->left, "+");
+		for (int i = 0; i < width * 2 + 1; i++) printw("=");
+		printw("+");
+		mvprintw(v->top + height + 1, v->left, "+");
+		for (int i = 0; i < width * 2 + 1; i++) printw("=");
+		printw("+");
+		// Side walls; hidden rows get a dotted wall
+		for (int y = 0; y < height; y++) {
+			char wall = y < g->rules.hidden ? ':' : 'O';
+			mvaddch(v->top + y + 1, v->left, wall);
+			mvaddch(v->top + y + 1, v->left + (width + 1) * 2, wall);
+		}
+		memset(v->shadow, -1, sizeof(v->shadow));
+		v->drawn = 1;
+	}
+
+	// Repaint changed cells only
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int c = cells[y][x];
+			if (c == v->shadow[y][x]) continue;
+			v->shadow[y][x] = c;
+			int sy = v->top + y + 1, sx = v->left + (x + 1) * 2;
+			if (c == CELL_EMPTY) {
+				mvaddch(sy, sx, ' ');
+				mvaddch(sy, sx + 1, ' ');
+			} else if (c == CELL_LANDING) {
+				mvaddch(sy, sx, '.');
+				mvaddch(sy, sx + 1, '.');
+			} else if (c == CELL_SPAWN) {
+				mvaddch(sy, sx, 'X');
+				mvaddch(sy, sx + 1, 'X');
+			} else if (c > CELL_HINT) {
+				attron(COLOR_PAIR(c - CELL_HINT));
+				mvaddch(sy, sx, ':' | A_BOLD);
+				mvaddch(sy, sx + 1, ':' | A_BOLD);
+				attroff(COLOR_PAIR(c - CELL_HINT));
+			} else {
+				drawPuyo(sy, sx, c);
+			}
+		}
+	}
+}
+
+/**
+ * Draws the playfield, including the settled board, the current piece,
+ * the preview queue, UI elements, and any active chain fade text.
+ * With a ghost race or a versus match running, the other board is drawn
+ * alongside.
+ *
+ * @param chain Current chain count being displayed.
+ * @param fade  Fade factor for the chain text (0.0–1.0).
+ * @return void
+ */
+void drawBoard(int chain, double fade) {
+	uint64_t start = monotonicNs();
+
+	drawPlayfield(&player_view, &game, 1);
+	if (ghost_race.active) {
+		drawPlayfield(&ghost_view, &ghost_race.game, 1);
+		int lead = game.score - ghost_race.game.score;
+		mvprintw(ghost_view.top + ghost_race.game.rules.height + 2, ghost_view.left, "Ghost: %d (%s%d)%s     ", ghost_race.game.score,
+			lead >= 0 ? "+" : "", lead, ghost_race.next_move >= ghost_race.replay.count ? " finished" : "");
+	}
+	if (versus.active) {
+		drawPlayfield(&ghost_view, &versus.game, 1);
+		mvprintw(ghost_view.top + versus.game.rules.height + 2, ghost_view.left, "CPU (%s): %d  Nuisance: %d     ",
+			versus.level->name, versus.game.score, versus.game.garbage);
+	}
+
+	// Chain and UI
+	if (fade_timer > 0.0 && last_chain > 1) {
+		int attr = (fade > 0.5) ? A_BOLD : A_DIM;
+		attron(attr);
+		mvprintw(1, game.rules.width * 2 + 8, "CHAIN x%d!", chain);
+		attroff(attr);
+	} else {
+		mvprintw(1, game.rules.width * 2 + 8, "             ");
+	}
+	// Score of the last step as the arcade shows it: 10 x cleared x bonus
+	if (fade_timer > 0.0 && last_all_clear >= 0) mvprintw(2, game.rules.width * 2 + 8, "ALL CLEAR +%-4d", last_all_clear);
+	else if (fade_timer > 0.0 && last_chain > 0) mvprintw(2, game.rules.width * 2 + 8, "%d x %-9d", 10 * last_step.cleared, last_step.bonus);
+	else mvprintw(2, game.rules.width * 2 + 8, "               ");
+
+	// Preview queue + info text
+	drawPreview(&preview_view, &game);
+	mvprintw(game.rules.height + 3, 0, "Z/X: Rotate | Up: Hard Drop | Down: Soft Drop | R: Retry | Q: Quit");
+	mvprintw(game.rules.height + 4, 0, "Score: %d  Level: %d  Clears: %d", game.score, game.level, game.clears);
+	if (versus.active) printw("  Nuisance: %d     ", game.garbage);
+
+	// Clock of a timed game, with the latest split
+	if (timed_run.mode != MODE_ENDLESS) {
+		char time[32], split[32];
+		if (timed_run.mode == MODE_TIME) {
+			mvprintw(game.rules.height + 5, 0, "Time left: %s", formatTime(time, sizeof(time),
+				(uint64_t)timed_run.goal * 1000000000u - timed_run.elapsed));
+		} else {
+			mvprintw(game.rules.height + 5, 0, "Time: %s  %d/%u %s", formatTime(time, sizeof(time), timed_run.elapsed),
+				timed_run.mode == MODE_CLEARS ? game.clears : game.score, timed_run.goal,
+				timed_run.mode == MODE_CLEARS ? "clears" : "points");
+		}
+		if (timed_run.splits > 0) {
+			printw("  Lv%d at %s", timed_run.splits + 1, formatTime(split, sizeof(split), timed_run.split[timed_run.splits - 1]));
+		}
+		printw("     ");
+	}
+
+	refresh();
+
+	MetricsShard *m = metricsShard();
+	metricAdd(&m->frames, 1);
+	metricTime(&m->frame, monotonicNs() - start);
+}
+
+/**
+ * Instantly moves the current piece to its lowest valid position on
+ * the board (a hard drop).
+ *
+ * @param g Game whose current piece is dropped.
+ * @return void
+ */
+void hardDrop(Game *g) {
+	while (!checkCollision(g, &g->current, g->cx, g->cy + 1)) g->cy++;
+}
+
+/**
+ * Presents a simple difficulty selection menu and configures the
+ * number of colors and base fall speed accordingly.
+ *
+ * @param rules Rules whose color count is set.
+ * @return void
+ */
+void chooseDifficulty(Rules *rules) {
+	clear();
+	echo();
+	nodelay(stdscr, FALSE);
+	mvprintw(4, 5, "Terminal Puyo");
+	mvprintw(5, 5, "Jude Rorie");
+	mvprintw(6, 5, "Select Difficulty:");
+	mvprintw(7, 7, "1. Easy");
+	mvprintw(8, 7, "2. Medium");
+	mvprintw(9, 7, "3. Hard");
+	mvprintw(10, 7, "4. Very Hard");
+	mvprintw(12, 5, "Enter Choice (1-4): ");
+	refresh();
+	int choice = getch();
+	noecho();
+	nodelay(stdscr, TRUE);
+	clear();
+	invalidateView(&player_view);
+	invalidateView(&ghost_view);
+	preview_view.drawn = 0;
+	switch (choice) {
+		case '1': rules->colors = 4; base_speed = 1.0; break;
+		case '2': rules->colors = 5; base_speed = 0.8; break;
+		case '3': rules->colors = 6; base_speed = 0.6; break;
+		default: rules->colors = 7; base_speed = 0.45; break;
+	}
+}
+
+/**
+ * Locks the live game's piece and starts resolving the lock: places it,
+ * spawns the next piece and, if the pair can pop anything, starts the
+ * chain animation that advanceChain plays over the following ticks.
+ * Movement input stays disabled until the lock is resolved.
+ *
+ * @return void
+ */
+void lock_and_cascade() {
+	// Disable movement
+	input_locked = 1;
+
+	// Record the lock for replays before the piece joins the board
+	chain_anim.recorded = record_path && replayAppend(&recording, &game, ticks) == 0;
+	chain_anim.score_before = game.score;
+
+	// Lock current piece into board
+	Block pair = game.current;
+	int bx = game.cx, by = game.cy;
+	placeBlock(&game, &pair, bx, by);
+	game.pieces++;
+
+	// Spawn next piece
+	spawnPiece(&game);
+	Game ahead = game;
+
+	// Same order as settle() so replays re-simulate exactly: drop split pairs,
+	// then clear → gravity → recheck until stable (see advanceChain)
+	gravity(&game);
+	chain_anim.chain = 0;
+	if (pairTriggers(&game, &pair, bx, by)) {
+		chain_anim.phase = CHAIN_CLEAR;
+		chain_anim.next = monotonicNs();
+
+		// The chain's outcome is already decided: search it while the animation plays
+		if (hints.active) {
+			int carry = versus.carry[0];
+			int chain = settle(&ahead, &pair, bx, by, NULL);
+			dropAfterLock(&ahead, ahead.score - chain_anim.score_before, versus.active ? &carry : NULL, NULL);
+			postHint(&hints, &ahead, chain_anim.next + (uint64_t)chain * CHAIN_FLASH_FRAMES * CHAIN_FLASH_NS);
+		}
+		advanceChain(chain_anim.next);
+	} else {
+		finishLock();
+	}
+}
+
+/**
+ * Plays the live game's chain animation up to a point in time: each step
+ * pops its groups, shows the chain text for CHAIN_FLASH_FRAMES frames and
+ * lets the board fall a row per frame, then the next step is checked.
+ * Returns at once when nothing is due, so the UI loop never sleeps in it.
+ *
+ * @param now monotonicNs of the current tick.
+ * @return void
+ */
+void advanceChain(uint64_t now) {
+	while (chain_anim.phase != CHAIN_IDLE && now >= chain_anim.next) {
+		if (chain_anim.phase == CHAIN_CLEAR) {
+			ChainStep step;
+			if (clearGroups(&game, chain_anim.chain + 1, &step) == 0) {
+				finishLock();
+				break;
+			}
+			chain_anim.chain++;
+			last_chain = chain_anim.chain;
+			last_step = step;
+			fade_timer = 5.0;
+			chain_anim.frame = 0;
+			chain_anim.phase = CHAIN_FLASH;
+			chain_anim.next = now + CHAIN_FLASH_NS;
+		} else if (chain_anim.phase == CHAIN_FLASH) {
+			if (++chain_anim.frame == CHAIN_FLASH_FRAMES) chain_anim.phase = CHAIN_FALL;
+			else chain_anim.next = now + CHAIN_FLASH_NS;
+		} else if (gravityStep(&game)) {
+			chain_anim.next = now + CHAIN_FALL_NS;
+		} else {
+			chain_anim.phase = CHAIN_CLEAR;
+		}
+	}
+}
+
+/**
+ * Finishes resolving the live game's lock once the board is stable:
+ * awards an all-clear, sends versus nuisance, drops pending nuisance,
+ * re-enables input and flags game over if the spawn location is blocked.
+ *
+ * @return void
+ */
+void finishLock() {
+	int chain = chain_anim.chain;
+	chain_anim.phase = CHAIN_IDLE;
+	last_all_clear = chain > 0 ? awardAllClear(&game) : -1;
+	if (chain_anim.recorded && last_all_clear >= 0) recording.moves[recording.count - 1].flags |= REPLAY_ALL_CLEAR;
+	dropAfterLock(&game, game.score - chain_anim.score_before, versus.active ? &versus.carry[0] : NULL, &versus.game);
+
+	// If no clears occurred, reset chain display
+	if (chain == 0) {
+		last_chain = 0;
+		fade_timer = 0.0;
+	} else {
+		metricAdd(&metricsShard()->chains, 1);
+		metricAdd(&metricsShard()->chain_steps, chain);
+	}
+
+	// Enable movement
+	input_locked = 0;
+
+	// Game Over check (the main loop shows it)
+	if (checkCollision(&game, &game.current, game.cx, game.cy)) {
+		game.over = 1;
+		metricsGameFinished(&game);
+	}
+}
+
+/**
+ * Finishes a resolved lock's nuisance: in a versus match the chain's
+ * points first cancel pending nuisance and the rest goes to the
+ * opponent, then the garbage drill adds its puyos and all pending
+ * nuisance drops.
+ *
+ * @param g        Game whose lock is resolved.
+ * @param points   Points the lock scored.
+ * @param carry    Player's leftover points toward the next nuisance puyo, NULL outside a versus match.
+ * @param opponent Game that receives nuisance, NULL to only predict g.
+ * @return void
+ */
+void dropAfterLock(Game *g, int points, int *carry, Game *opponent) {
+	if (carry) versusSend(g, opponent, carry, points);
+	g->garbage += g->rules.garbage_rate;
+	if (g->garbage > 0) dropGarbage(g);
+}
+
+/**
+ * Shows a message over the player's board and waits for a key.
+ *
+ * @param message Text to show, e.g. "GAME OVER!".
+ * @return The key pressed: R retries (see retryGame), anything else quits.
+ */
+int showEnd(const char *message) {
+	mvprintw(game.rules.height / 2, game.rules.width > 5 ? game.rules.width - 5 : 0, " %s ", message);
+	mvprintw(game.rules.height / 2 + 2, game.rules.width > 10 ? game.rules.width - 10 : 0, " R: retry, any other key: quit ");
+	refresh();
+	nodelay(stdscr, FALSE);
+	int key = getch();
+	nodelay(stdscr, TRUE);
+	return key;
+}
+
+/**
+ * Deals the next attempt in place, after a game ends or when the player
+ * restarts one: saves the attempt's replay and resets the game with the
+ * same rules and difficulty, along with the chain display, the animation,
+ * the timed run and any keys still queued. The terminal, the color pairs,
+ * the replay's move buffer and the hint thread are kept, so the new game
+ * is on screen by the next frame. A ghost race starts over against the
+ * same replay and a versus AI is restarted on the new seed.
+ *
+ * @param seed Piece sequence seed of the new game.
+ * @return 0 on success, -1 if the versus AI cannot restart.
+ */
+int retryGame(uint32_t seed) {
+	Rules rules = game.rules;
+	finishRecording();
+	attempts++;
+	if (!game.over) metricsGameFinished(&game);	// an abandoned attempt still ends
+	resetGame(&game, &rules, seed);
+	ReplayMove *moves = recording.moves;
+	int capacity = recording.capacity;
+	replayInit(&recording, &game);
+	recording.moves = moves;			// keep the move buffer
+	recording.capacity = capacity;
+
+	memset(&chain_anim, 0, sizeof(chain_anim));
+	last_chain = 0;
+	fade_timer = 0.0;
+	last_all_clear = -1;
+	input_locked = 0;
+	ticks = 0;
+	player_input.head = player_input.tail;
+	startTimedRun(&timed_run, monotonicNs());
+	if (ghost_race.active) restartGhostRace(&ghost_race);
+	if (versus.active) {
+		const VersusLevel *level = versus.level;
+		stopVersus(&versus);
+		if (startVersus(&versus, level, &rules, seed) != 0) return -1;
+	}
+	metricsGameStarted(&game);
+
+	clear();
+	invalidateView(&player_view);
+	invalidateView(&ghost_view);
+	preview_view.drawn = 0;
+	return 0;
+}
+
+/**
+ * Reads the monotonic clock.
+ *
+ * @return Nanoseconds since an arbitrary fixed point.
+ */
+uint64_t monotonicNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Releases a thread's metrics shard for reuse when the thread exits. The
+ * counts stay in the shard, so nothing recorded is lost.
+ *
+ * @param shard Shard owned by the exiting thread.
+ * @return void
+ */
+void metricsReleaseShard(void *shard) {
+	__atomic_store_n(&((MetricsShard *)shard)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Creates the thread-exit hook that hands shards back.
+ *
+ * @return void
+ */
+void metricsInitKey(void) {
+	pthread_key_create(&metrics_key, metricsReleaseShard);
+}
+
+/**
+ * Returns the calling thread's metrics shard, claiming a released one or
+ * pushing a new one onto the shard list the first time a thread records.
+ *
+ * @return Shard written only by the calling thread.
+ */
+MetricsShard *metricsShard(void) {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	if (metrics_local) return metrics_local;
+	pthread_once(&once, metricsInitKey);
+	MetricsShard *s;
+	for (s = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+		int free_shard = 0;
+		if (__atomic_compare_exchange_n(&s->in_use, &free_shard, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+	}
+	if (!s) {
+		s = calloc(1, sizeof(*s));
+		if (!s) {
+			// Keep recording somewhere rather than crash; counts go to a dropped shard
+			static __thread MetricsShard overflow;
+			return metrics_local = &overflow;
+		}
+		s->in_use = 1;
+		s->next = __atomic_load_n(&metrics_shards, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&metrics_shards, &s->next, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	pthread_setspecific(metrics_key, s);
+	return metrics_local = s;
+}
+
+/**
+ * Adds to a counter of the calling thread's shard. Only the owning thread
+ * writes, so a relaxed load/store pair is enough; scrapers read with
+ * relaxed loads and never see a torn value.
+ *
+ * @param counter Counter inside the caller's shard.
+ * @param n       Amount to add.
+ * @return void
+ */
+void metricAdd(uint64_t *counter, uint64_t n) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records one latency sample in a shard's log2-bucketed histogram.
+ *
+ * @param s  Latency stats inside the caller's shard.
+ * @param ns Sample in nanoseconds.
+ * @return void
+ */
+void metricTime(LatencyStats *s, uint64_t ns) {
+	int bucket = 63 - __builtin_clzll(ns | 1);
+	if (bucket >= METRIC_BUCKETS) bucket = METRIC_BUCKETS - 1;
+	metricAdd(&s->buckets[bucket], 1);
+	metricAdd(&s->count, 1);
+	metricAdd(&s->sum_ns, ns);
+}
+
+/**
+ * Maps a game's color count to the difficulty label used in metrics.
+ *
+ * @param colors Colors in play.
+ * @return Index into difficulty_names.
+ */
+int difficultyIndex(int colors) {
+	return colors >= 4 && colors <= 7 ? colors - 3 : 0;
+}
+
+/**
+ * Counts a game as started under its difficulty.
+ *
+ * @param g Game that just began.
+ * @return void
+ */
+void metricsGameStarted(Game *g) {
+	metricAdd(&metricsShard()->games_started[difficultyIndex(g->rules.colors)], 1);
+}
+
+/**
+ * Counts a game as finished under its difficulty.
+ *
+ * @param g Game that just ended (topped out or reached its piece limit).
+ * @return void
+ */
+void metricsGameFinished(Game *g) {
+	metricAdd(&metricsShard()->games_finished[difficultyIndex(g->rules.colors)], 1);
+}
+
+/**
+ * Locks the current piece of a headless game (see lockPiece) and records
+ * the step's latency, any chain it triggered and the end of the game.
+ * Bot search calls lockPiece directly so its simulations are not counted.
+ *
+ * @param g        Game to advance.
+ * @param carry    Player's leftover points in a versus match, NULL for a solo game.
+ * @param opponent Game that receives g's nuisance in a versus match.
+ * @return Number of chain steps triggered by the lock.
+ */
+int simStep(Game *g, int *carry, Game *opponent) {
+	uint64_t start = monotonicNs();
+	int chain = carry ? lockVersusPiece(g, carry, opponent) : lockPiece(g, NULL);
+	MetricsShard *m = metricsShard();
+	metricTime(&m->tick[TICK_SIM], monotonicNs() - start);
+	if (chain > 0) {
+		metricAdd(&m->chains, 1);
+		metricAdd(&m->chain_steps, chain);
+	}
+	if (g->over) metricsGameFinished(g);
+	return chain;
+}
+
+/**
+ * Estimates a quantile from a log2 histogram, reporting the middle of the
+ * bucket that holds it.
+ *
+ * @param buckets Bucket counts.
+ * @param count   Total samples.
+ * @param q       Quantile in [0, 1].
+ * @return Estimate in seconds, 0 without samples.
+ */
+double histogramQuantile(const uint64_t *buckets, uint64_t count, double q) {
+	if (count == 0) return 0.0;
+	uint64_t rank = (uint64_t)ceil(q * count), seen = 0;
+	if (rank == 0) rank = 1;
+	for (int i = 0; i < METRIC_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= rank) return ldexp(1.5, i) / 1e9;
+	}
+	return ldexp(1.5, METRIC_BUCKETS - 1) / 1e9;
+}
+
+/**
+ * Appends one latency summary (p50, p99, sum and count) to a metrics page.
+ *
+ * @param buf    Page buffer.
+ * @param cap    Buffer capacity.
+ * @param len    Bytes already used.
+ * @param name   Metric name.
+ * @param labels Extra labels ("" or `key="value",`).
+ * @param s      Aggregated stats.
+ * @return New length of the page.
+ */
+size_t renderSummary(char *buf, size_t cap, size_t len, const char *name, const char *labels, const LatencyStats *s) {
+	static const double quantiles[] = { 0.5, 0.99 };
+	for (int i = 0; i < 2; i++) {
+		len += snprintf(buf + len, len < cap ? cap - len : 0, "%s{%squantile=\"%g\"} %.9f\n", name, labels,
+			quantiles[i], histogramQuantile(s->buckets, s->count, quantiles[i]));
+	}
+	// Strip the trailing comma so the label set stays valid
+	char bare[64];
+	snprintf(bare, sizeof(bare), "%s", labels);
+	if (bare[0]) bare[strlen(bare) - 1] = '\0';
+	len += snprintf(buf + len, len < cap ? cap - len : 0, "%s_sum%s%s%s %.9f\n%s_count%s%s%s %llu\n",
+		name, bare[0] ? "{" : "", bare, bare[0] ? "}" : "", s->sum_ns / 1e9,
+		name, bare[0] ? "{" : "", bare, bare[0] ? "}" : "", (unsigned long long)s->count);
+	return len;
+}
+
+/**
+ * Adds one shard's latency stats into a running total.
+ *
+ * @param total Accumulator.
+ * @param s     Shard stats, read with relaxed loads.
+ * @return void
+ */
+void addLatency(LatencyStats *total, LatencyStats *s) {
+	total->count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+	total->sum_ns += __atomic_load_n(&s->sum_ns, __ATOMIC_RELAXED);
+	for (int i = 0; i < METRIC_BUCKETS; i++) total->buckets[i] += __atomic_load_n(&s->buckets[i], __ATOMIC_RELAXED);
+}
+
+/**
+ * Bytes the process has written through write(2) so far: the terminal
+ * output of the UI plus anything printed by headless commands. Socket
+ * traffic (bots, metrics scrapes) is not included.
+ *
+ * @return Byte count, or 0 where /proc/self/io is unavailable.
+ */
+uint64_t processOutputBytes(void) {
+	unsigned long long wchar = 0;
+	FILE *f = fopen("/proc/self/io", "r");
+	if (!f) return 0;
+	char line[128];
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "wchar: %llu", &wchar) == 1) break;
+	}
+	fclose(f);
+	return wchar;
+}
+
+/**
+ * Aggregates every thread's shard and renders the Prometheus text
+ * exposition page.
+ *
+ * @param buf Output buffer.
+ * @param cap Buffer capacity.
+ * @return Length of the page (truncated to the buffer if it did not fit).
+ */
+size_t renderMetrics(char *buf, size_t cap) {
+	static uint64_t last_chains, last_ns;
+	uint64_t sessions = 0, frames = 0, chains = 0, steps = 0;
+	uint64_t started[METRIC_DIFFICULTIES] = {0}, finished[METRIC_DIFFICULTIES] = {0};
+	LatencyStats frame, tick[2];
+	memset(&frame, 0, sizeof(frame));
+	memset(tick, 0, sizeof(tick));
+	for (MetricsShard *s = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+		sessions += __atomic_load_n(&s->sessions, __ATOMIC_RELAXED);
+		frames += __atomic_load_n(&s->frames, __ATOMIC_RELAXED);
+		chains += __atomic_load_n(&s->chains, __ATOMIC_RELAXED);
+		steps += __atomic_load_n(&s->chain_steps, __ATOMIC_RELAXED);
+		for (int d = 0; d < METRIC_DIFFICULTIES; d++) {
+			started[d] += __atomic_load_n(&s->games_started[d], __ATOMIC_RELAXED);
+			finished[d] += __atomic_load_n(&s->games_finished[d], __ATOMIC_RELAXED);
+		}
+		addLatency(&frame, &s->frame);
+		addLatency(&tick[TICK_LIVE], &s->tick[TICK_LIVE]);
+		addLatency(&tick[TICK_SIM], &s->tick[TICK_SIM]);
+	}
+	// Chain rate over the window since the previous scrape
+	uint64_t now = monotonicNs();
+	if (last_ns == 0) last_ns = metrics_start_ns;
+	double rate = now > last_ns ? (chains - last_chains) / ((now - last_ns) / 1e9) : 0.0;
+	last_chains = chains;
+	last_ns = now;
+
+	size_t len = 0;
+#define EMIT(...) (len += snprintf(buf + len, len < cap ? cap - len : 0, __VA_ARGS__))
+	EMIT("# HELP puyo_sessions_total Interactive sessions started.\n# TYPE puyo_sessions_total counter\n");
+	EMIT("puyo_sessions_total %llu\n", (unsigned long long)sessions);
+	EMIT("# HELP puyo_frames_rendered_total Frames drawn to the terminal.\n# TYPE puyo_frames_rendered_total counter\n");
+	EMIT("puyo_frames_rendered_total %llu\n", (unsigned long long)frames);
+	EMIT("# HELP puyo_output_bytes_total Bytes written to the terminal and stdout.\n# TYPE puyo_output_bytes_total counter\n");
+	EMIT("puyo_output_bytes_total %llu\n", (unsigned long long)processOutputBytes());
+	EMIT("# HELP puyo_frame_seconds Time spent drawing one frame.\n# TYPE puyo_frame_seconds summary\n");
+	len = renderSummary(buf, cap, len, "puyo_frame_seconds", "", &frame);
+	EMIT("# HELP puyo_tick_seconds Time spent on one game tick (live loop iteration or simulated piece).\n# TYPE puyo_tick_seconds summary\n");
+	len = renderSummary(buf, cap, len, "puyo_tick_seconds", "mode=\"live\",", &tick[TICK_LIVE]);
+	len = renderSummary(buf, cap, len, "puyo_tick_seconds", "mode=\"sim\",", &tick[TICK_SIM]);
+	EMIT("# HELP puyo_chain_resolutions_total Locks that triggered at least one clear.\n# TYPE puyo_chain_resolutions_total counter\n");
+	EMIT("puyo_chain_resolutions_total %llu\n", (unsigned long long)chains);
+	EMIT("# HELP puyo_chain_steps_total Chain steps resolved.\n# TYPE puyo_chain_steps_total counter\n");
+	EMIT("puyo_chain_steps_total %llu\n", (unsigned long long)steps);
+	EMIT("# HELP puyo_chain_resolutions_per_second Chain resolutions per second since the previous scrape.\n# TYPE puyo_chain_resolutions_per_second gauge\n");
+	EMIT("puyo_chain_resolutions_per_second %.3f\n", rate);
+	EMIT("# HELP puyo_games_started_total Games started by difficulty.\n# TYPE puyo_games_started_total counter\n");
+	for (int d = 0; d < METRIC_DIFFICULTIES; d++) {
+		EMIT("puyo_games_started_total{difficulty=\"%s\"} %llu\n", difficulty_names[d], (unsigned long long)started[d]);
+	}
+	EMIT("# HELP puyo_games_finished_total Games finished by difficulty.\n# TYPE puyo_games_finished_total counter\n");
+	for (int d = 0; d < METRIC_DIFFICULTIES; d++) {
+		EMIT("puyo_games_finished_total{difficulty=\"%s\"} %llu\n", difficulty_names[d], (unsigned long long)finished[d]);
+	}
+#undef EMIT
+	return len < cap ? len : cap - 1;
+}
+
+/**
+ * Periodically rewrites the metrics file (written to a temporary name and
+ * renamed, so readers such as a textfile collector never see a partial page).
+ *
+ * @param arg Unused.
+ * @return Never returns.
+ */
+void *metricsFileWriter(void *arg) {
+	(void)arg;
+	char tmp[sizeof(metrics_path) + 8];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+	while (1) {
+		size_t len = renderMetrics(metrics_page, sizeof(metrics_page));
+		FILE *f = fopen(tmp, "w");
+		if (f) {
+			fwrite(metrics_page, 1, len, f);
+			fclose(f);
+			rename(tmp, metrics_path);
+		}
+		sleep(metrics_interval);
+	}
+	return NULL;
+}
+
+#ifndef _WIN32
+/**
+ * Serves one metrics page per connection on a listening socket. Clients
+ * that send an HTTP GET get an HTTP response; anything else (for example
+ * `socat - UNIX-CONNECT:PATH`) gets the bare page. A client that
+ * disconnects early only has its connection closed (see sendAll).
+ *
+ * @param arg Listening socket descriptor, cast to a pointer.
+ * @return Never returns.
+ */
+void *metricsServer(void *arg) {
+	int listener = (int)(intptr_t)arg;
+	while (1) {
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR) usleep(100000);
+			continue;
+		}
+		char request[1024];
+		int n = 0;
+		struct pollfd p = { fd, POLLIN, 0 };
+		if (poll(&p, 1, 200) > 0) n = recv(fd, request, sizeof(request) - 1, 0);
+		size_t len = renderMetrics(metrics_page, sizeof(metrics_page));
+		if (n >= 4 && strncmp(request, "GET ", 4) == 0) {
+			char header[160];
+			int h = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+			if (sendAll(fd, header, h) != 0) {
+				close(fd);				// scraper hung up early
+				continue;
+			}
+		}
+		sendAll(fd, metrics_page, len);	// a failed write only loses this client
+		close(fd);
+	}
+	return NULL;
+}
+#endif
+
+/**
+ * Starts exposing metrics in the background.
+ *
+ * Specs:
+ *   unix:PATH          serve on a Unix domain socket
+ *   http:PORT          serve HTTP on 127.0.0.1:PORT (GET any path)
+ *   file:PATH[,SECS]   rewrite PATH every SECS seconds (default 10)
+ *
+ * @param spec Endpoint spec from --metrics.
+ * @return 0 on success, -1 on failure (reason printed to stderr).
+ */
+int metricsStart(const char *spec) {
+	pthread_t thread;
+	metrics_start_ns = monotonicNs();
+	if (strncmp(spec, "file:", 5) == 0) {
+		snprintf(metrics_path, sizeof(metrics_path), "%s", spec + 5);
+		char *comma = strrchr(metrics_path, ',');
+		if (comma) {
+			*comma = '\0';
+			metrics_interval = atoi(comma + 1);
+		}
+		if (metrics_interval < 1) metrics_interval = 1;
+		if (pthread_create(&thread, NULL, metricsFileWriter, NULL) != 0) return -1;
+		pthread_detach(thread);
+		return 0;
+	}
+#ifndef _WIN32
+	int fd = -1;
+	if (strncmp(spec, "unix:", 5) == 0) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", spec + 5);
+		unlink(addr.sun_path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	} else if (strncmp(spec, "http:", 5) == 0) {
+		struct sockaddr_in addr;
+		int one = 1;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((uint16_t)atoi(spec + 5));
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+			close(fd);
+			fd = -1;
+		}
+	} else {
+		fprintf(stderr, "unknown metrics endpoint '%s' (use unix:PATH, http:PORT or file:PATH)\n", spec);
+		return -1;
+	}
+	if (fd < 0 || listen(fd, 16) != 0 || pthread_create(&thread, NULL, metricsServer, (void *)(intptr_t)fd) != 0) {
+		fprintf(stderr, "cannot serve metrics on %s: %s\n", spec, strerror(errno));
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+#else
+	fprintf(stderr, "only file: metrics endpoints are supported on Windows\n");
+	return -1;
+#endif
+}
+
+/**
+ * Packs a game into the fixed-size protocol record sent to a bot.
+ *
+ * @param g  Game to describe; its current piece must be freshly spawned.
+ * @param id Game id the bot echoes back.
+ * @param s  Output record.
+ * @return void
+ */
+void botFillState(Game *g, uint32_t id, BotState *s) {
+	memset(s, 0, sizeof(*s));
+	s->game = id;
+	s->piece = g->pieces;
+	s->score = g->score;
+	s->garbage = g->garbage + g->rules.garbage_rate;
+	s->width = g->rules.width;
+	s->height = g->rules.height;
+	s->colors = g->rules.colors;
+	// Spawned pairs are vertical: pivot at [1][1], child above it at [0][1]
+	s->current[0] = g->current.color[1][1];
+	s->current[1] = g->current.color[0][1];
+	for (int i = 0, slot = g->queue_head; i < g->rules.preview; i++) {
+		s->next[i][0] = g->queue[slot][0];
+		s->next[i][1] = g->queue[slot][1];
+		if (++slot == g->rules.preview) slot = 0;
+	}
+	s->threshold = g->rules.threshold;
+	// Unpack the sliced color codes into one plane per color
+	for (int x = 0; x < g->rules.width; x++) {
+		s->planes[0][x] = (uint32_t)g->planes[0][x];
+		for (int c = 1; c < BOT_PLANES; c++) s->planes[c][x] = (uint32_t)colorColumn(g, c, x);
+	}
+}
+
+/**
+ * Writes a whole buffer to a socket, retrying short and interrupted writes.
+ * A peer that has gone away fails the write instead of raising SIGPIPE.
+ *
+ * @param fd   Connected socket.
+ * @param buf  Bytes to send.
+ * @param len  Number of bytes to send.
+ * @return 0 on success, -1 on error or closed connection.
+ */
+int sendAll(BotSocket fd, const void *buf, size_t len) {
+	const char *p = buf;
+	while (len > 0) {
+		int n = send(fd, p, (int)len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Reads exactly `len` bytes from a socket, retrying short and interrupted
+ * reads.
+ *
+ * @param fd   Connected socket.
+ * @param buf  Destination buffer.
+ * @param len  Number of bytes to read.
+ * @return 0 on success, -1 on error or closed connection.
+ */
+int recvAll(BotSocket fd, void *buf, size_t len) {
+	char *p = buf;
+	while (len > 0) {
+		int n = recv(fd, p, (int)len, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Connects to a bot. A spec of the form "shm:NAME" creates the shared-memory
+ * region /puyo-NAME for a co-located bot; anything else is taken as the path
+ * of a Unix domain socket the bot listens on.
+ *
+ * @param link  Link to initialize.
+ * @param spec  Socket path or "shm:NAME".
+ * @param games Number of game ids (0..games-1) the link will carry.
+ * @return 0 on success, -1 on failure (reason printed to stderr).
+ */
+int botConnect(BotLink *link, const char *spec, int games) {
+	memset(link, 0, sizeof(*link));
+	link->fd = BOT_NO_SOCKET;
+	if (strncmp(spec, "shm:", 4) == 0) return shmCreate(link, spec + 4, games);
+
+	struct sockaddr_un addr;
+	if (strlen(spec) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "bot socket path too long: %s\n", spec);
+		return -1;
+	}
+#ifdef _WIN32
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+		fprintf(stderr, "WSAStartup failed\n");
+		return -1;
+	}
+#endif
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, spec);
+	link->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	link->kind = BOT_LINK_SOCKET;
+	if (link->fd == BOT_NO_SOCKET || connect(link->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "cannot connect to bot at %s: %s\n", spec, strerror(errno));
+		botClose(link);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Closes a bot connection; safe to call on a link that is already closed.
+ * A shared-memory region is unmapped and its name removed.
+ *
+ * @param link Link to close.
+ * @return void
+ */
+void botClose(BotLink *link) {
+	if (link->kind == BOT_LINK_SHM) {
+#ifndef _WIN32
+		munmap(link->shm, link->shm_size);
+		shm_unlink(link->shm_name);
+#endif
+		free(link->shm_batch);
+		link->shm = NULL;
+		link->shm_batch = NULL;
+	}
+	if (link->fd != BOT_NO_SOCKET) {
+#ifdef _WIN32
+		closesocket(link->fd);
+		WSACleanup();
+#else
+		close(link->fd);
+#endif
+		link->fd = BOT_NO_SOCKET;
+	}
+	link->kind = BOT_LINK_NONE;
+}
+
+#ifdef __linux__
+/**
+ * Sleeps until the 32-bit word at `addr` no longer holds `val`, the
+ * timeout passes or a spurious wakeup occurs. Uses a shared futex so it
+ * works across processes.
+ *
+ * @param addr       Futex word inside the shared region.
+ * @param val        Value the caller last observed.
+ * @param timeout_ms Longest sleep in milliseconds.
+ * @return void
+ */
+void futexWait(uint32_t *addr, uint32_t val, int timeout_ms) {
+	struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000 };
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, &timeout, NULL, 0);
+}
+
+/**
+ * Wakes every process sleeping on the futex word at `addr`.
+ *
+ * @param addr Futex word inside the shared region.
+ * @return void
+ */
+void futexWake(uint32_t *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+#endif
+
+/**
+ * Creates and maps the shared-memory region for `games` games. The bot may
+ * attach at any time; requests published before it does simply wait.
+ *
+ * @param link  Link to initialize.
+ * @param name  Region name; the object is created as /puyo-NAME.
+ * @param games Number of slots to allocate.
+ * @return 0 on success, -1 on failure (reason printed to stderr).
+ */
+int shmCreate(BotLink *link, const char *name, int games) {
+#ifdef __linux__
+	snprintf(link->shm_name, sizeof(link->shm_name), "/puyo-%s", name);
+	link->shm_size = sizeof(ShmRegion) + sizeof(ShmSlot) * games;
+	int fd = shm_open(link->shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || ftruncate(fd, link->shm_size) != 0) {
+		fprintf(stderr, "cannot create shared memory %s: %s\n", link->shm_name, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			shm_unlink(link->shm_name);
+		}
+		return -1;
+	}
+	link->shm = mmap(NULL, link->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	link->shm_batch = malloc(sizeof(int) * games);
+	if (link->shm == MAP_FAILED || !link->shm_batch) {
+		fprintf(stderr, "cannot map shared memory %s: %s\n", link->shm_name, strerror(errno));
+		if (link->shm == MAP_FAILED) link->shm = NULL;
+		else munmap(link->shm, link->shm_size);
+		free(link->shm_batch);
+		link->shm_batch = NULL;
+		shm_unlink(link->shm_name);
+		return -1;
+	}
+	link->kind = BOT_LINK_SHM;
+	// ftruncate zero-fills, so only the header needs setting up; magic goes last
+	link->shm->version = SHM_VERSION;
+	link->shm->games = games;
+	link->shm->ring_slots = SHM_RING_SLOTS;
+	for (int i = 0; i < games; i++) link->shm_batch[i] = -1;
+	__atomic_store_n(&link->shm->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	fprintf(stderr, "bot shared memory ready at %s (%d games)\n", link->shm_name, games);
+	return 0;
+#else
+	(void)link;
+	(void)name;
+	(void)games;
+	fprintf(stderr, "shared-memory bots need Linux (futex); use a socket path instead\n");
+	return -1;
+#endif
+}
+
+/**
+ * Publishes a batch of states through the shared-memory region and waits
+ * until the bot has answered every one of them, or has gone away (see
+ * the bot_pid check in the transport notes).
+ *
+ * @param link   Link opened with "shm:NAME".
+ * @param states Game states to publish; `game` must be below the region's game count.
+ * @param moves  Output placements, one per state, in the same order.
+ * @param count  Number of games in the batch.
+ * @return 0 on success, -1 on protocol error (reason printed to stderr).
+ */
+int shmExchange(BotLink *link, const BotState *states, BotMove *moves, int count) {
+#ifdef __linux__
+	ShmRegion *r = link->shm;
+	for (int i = 0; i < count; i++) {
+		ShmSlot *slot = &r->slots[states[i].game];
+		uint32_t seq = slot->seq;
+		__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		slot->state = states[i];
+		__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+		__atomic_store_n(&slot->request, slot->request + 1, __ATOMIC_RELEASE);
+		link->shm_batch[states[i].game] = i;
+	}
+	__atomic_add_fetch(&r->requests, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->bot_sleeping, __ATOMIC_SEQ_CST)) futexWake(&r->requests);
+
+	int received = 0, status = 0;
+	uint32_t tail = r->ring_tail;
+	while (received < count) {
+		uint32_t head = __atomic_load_n(&r->ring_head, __ATOMIC_ACQUIRE);
+		for (int spin = 0; head == tail && spin < SHM_SPIN; spin++) {
+			head = __atomic_load_n(&r->ring_head, __ATOMIC_ACQUIRE);
+		}
+		if (head == tail) {
+			__atomic_store_n(&r->engine_sleeping, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&r->ring_head, __ATOMIC_SEQ_CST) == tail) futexWait(&r->ring_head, tail, SHM_WAIT_MS);
+			__atomic_store_n(&r->engine_sleeping, 0, __ATOMIC_RELAXED);
+
+			// A bot that has not attached yet is waited for; one that went away fails the batch
+			uint32_t pid = __atomic_load_n(&r->bot_pid, __ATOMIC_ACQUIRE);
+			int gone = pid ? kill((pid_t)pid, 0) != 0 && errno == ESRCH : link->shm_pid != 0;
+			if (pid) link->shm_pid = pid;
+			if (gone) {
+				fprintf(stderr, "bot detached from %s with %d moves outstanding\n", link->shm_name, count - received);
+				status = -1;
+				break;
+			}
+			continue;
+		}
+		for (; tail != head; tail++) {
+			BotMove m = r->ring[tail % SHM_RING_SLOTS];
+			int idx = m.game < r->games ? link->shm_batch[m.game] : -1;
+			if (idx < 0) {
+				fprintf(stderr, "bot answered game %u, which is not waiting for a move\n", m.game);
+				status = -1;
+				continue;
+			}
+			moves[idx] = m;
+			link->shm_batch[m.game] = -1;
+			received++;
+		}
+		__atomic_store_n(&r->ring_tail, tail, __ATOMIC_RELEASE);
+		if (status != 0) break;
+	}
+	for (int i = 0; i < count; i++) link->shm_batch[states[i].game] = -1;
+	return status;
+#else
+	(void)link;
+	(void)states;
+	(void)moves;
+	(void)count;
+	return -1;
+#endif
+}
+
+/**
+ * Sends a batch of game states to the bot as one message (or one
+ * shared-memory publication) and waits for the matching batch of placements.
+ *
+ * @param link   Connected bot link.
+ * @param states Game states to send.
+ * @param moves  Output placements, one per state, in the same order.
+ * @param count  Number of games in the batch (1..BOT_MAX_BATCH).
+ * @return 0 on success, -1 on I/O or protocol error (reason printed to stderr).
+ */
+int botExchange(BotLink *link, const BotState *states, BotMove *moves, int count) {
+	if (link->kind == BOT_LINK_SHM) return shmExchange(link, states, moves, count);
+	BotHeader h = { BOT_MAGIC, BOT_VERSION, BOT_STATE, (uint32_t)count, sizeof(BotState) };
+	if (sendAll(link->fd, &h, sizeof(h)) != 0 || sendAll(link->fd, states, sizeof(BotState) * count) != 0) {
+		fprintf(stderr, "bot connection lost while sending\n");
+		return -1;
+	}
+	if (recvAll(link->fd, &h, sizeof(h)) != 0) {
+		fprintf(stderr, "bot connection lost while waiting for moves\n");
+		return -1;
+	}
+	if (h.magic != BOT_MAGIC || h.version != BOT_VERSION || h.kind != BOT_MOVE
+			|| h.count != (uint32_t)count || h.size != sizeof(BotMove)) {
+		fprintf(stderr, "bad reply header from bot (kind %u, count %u)\n", h.kind, h.count);
+		return -1;
+	}
+	if (recvAll(link->fd, moves, sizeof(BotMove) * count) != 0) {
+		fprintf(stderr, "bot connection lost while reading moves\n");
+		return -1;
+	}
+	for (int i = 0; i < count; i++) {
+		if (moves[i].game != states[i].game) {
+			fprintf(stderr, "bot answered game %u where %u was expected\n", moves[i].game, states[i].game);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Plays several headless games against a connected bot until each game
+ * is over or has placed `max_pieces` pieces. Every round batches all
+ * unfinished games into a single request.
+ *
+ * @param link       Connected bot link.
+ * @param rules      Board size and colors of every game.
+ * @param count      Number of games to run (1..BOT_MAX_BATCH).
+ * @param max_pieces Piece limit per game.
+ * @param seed       Seed of game 0; game i uses seed + i.
+ * @return 0 on success, -1 if the bot connection failed.
+ */
+int runBotGames(BotLink *link, const Rules *rules, int count, int max_pieces, uint32_t seed) {
+	Game *games = malloc(sizeof(Game) * count);
+	BotState *states = malloc(sizeof(BotState) * count);
+	BotMove *moves = malloc(sizeof(BotMove) * count);
+	int *ids = malloc(sizeof(int) * count);
+	int status = 0;
+	if (!games || !states || !moves || !ids) {
+		fprintf(stderr, "out of memory for %d games\n", count);
+		status = -1;
+	}
+	for (int i = 0; status == 0 && i < count; i++) {
+		resetGame(&games[i], rules, seed + i);
+		metricsGameStarted(&games[i]);
+	}
+
+	while (status == 0) {
+		// Collect every game still waiting for a move into one batch
+		int n = 0;
+		for (int i = 0; i < count; i++) {
+			if (games[i].over || games[i].pieces >= max_pieces) continue;
+			botFillState(&games[i], i, &states[n]);
+			ids[n++] = i;
+		}
+		if (n == 0) break;
+		if (botExchange(link, states, moves, n) != 0) {
+			status = -1;
+			break;
+		}
+		for (int k = 0; k < n; k++) {
+			Game *g = &games[ids[k]];
+			Placement p = { moves[k].column, moves[k].rotation };
+			if (!applyPlacement(g, p)) hardDrop(g);
+			simStep(g, NULL, NULL);
+			if (!g->over && g->pieces >= max_pieces) metricsGameFinished(g);
+		}
+	}
+
+	if (status == 0) {
+		long total = 0;
+		for (int i = 0; i < count; i++) {
+			printf("game %d: score %d, pieces %d, clears %d%s\n", i, games[i].score,
+				games[i].pieces, games[i].clears, games[i].over ? " (topped out)" : "");
+			total += games[i].score;
+		}
+		printf("%d games, average score %.1f\n", count, (double)total / count);
+	}
+	free(games);
+	free(states);
+	free(moves);
+	free(ids);
+	return status;
+}
+
+/**
+ * Scores a settled board for the built-in bots (see evaluateBits) with the
+ * selected CPU level's instance.
+ *
+ * @param g Game to evaluate.
+ * @return Heuristic value; higher is better.
+ */
+int evaluateBoard(Game *g) {
+	return cpu->evaluate(g);
+}
+
+/**
+ * Built-in bot that drops each pair at a random reachable placement.
+ * Its choices are derived from the game state, so it is deterministic
+ * and safe to run on any thread.
+ *
+ * @param g Game with a freshly spawned pair.
+ * @return Chosen placement.
+ */
+Placement thinkRandom(Game *g) {
+	uint32_t r = g->rng ^ (uint32_t)g->pieces * 0x9e3779b9u;
+	if (r == 0) r = 1;
+	for (int tries = 0; tries < 16; tries++) {
+		Placement p = { (int)(nextRandom(&r) % g->rules.width), (int)(nextRandom(&r) % 4) };
+		Game copy = *g;
+		if (applyPlacement(&copy, p)) return p;
+	}
+	Placement spawn = { g->rules.width / 2, 0 };
+	return spawn;
+}
+
+/**
+ * Allocates search scratch memory from an arena, reserving the arena on
+ * first use. The memory stays valid until the arena is rewound past it.
+ * Failures are printed only once per process: a search that runs out
+ * fails every later allocation the same way, on every thread.
+ *
+ * @param a    Arena (normally this thread's search_arena).
+ * @param size Bytes needed.
+ * @return Memory aligned to ARENA_ALIGN, or NULL if the arena is exhausted
+ *         or cannot be reserved (reason printed to stderr the first time).
+ */
+void *arenaAlloc(Arena *a, size_t size) {
+	if (!a->base) {
+#ifdef _WIN32
+		a->size = ARENA_RESERVE;
+		a->base = VirtualAlloc(NULL, a->size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+		// Explicit huge pages must exist when mapped, so they are never overcommitted
+		void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		if (arena_huge_pages) p = mmap(NULL, ARENA_HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		a->size = ARENA_HUGE_SIZE;
+#endif
+		if (p == MAP_FAILED) {
+			a->size = ARENA_RESERVE;
+			p = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#ifdef MADV_HUGEPAGE
+			if (p != MAP_FAILED && arena_huge_pages) madvise(p, a->size, MADV_HUGEPAGE);
+#endif
+		}
+		a->base = p == MAP_FAILED ? NULL : p;
+#endif
+		if (!a->base) {
+			if (!__atomic_exchange_n(&arena_failed, 1, __ATOMIC_RELAXED)) fprintf(stderr, "cannot reserve a search arena\n");
+			return NULL;
+		}
+	}
+	size_t offset = (a->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (offset + size > a->size) {
+		if (!__atomic_exchange_n(&arena_failed, 1, __ATOMIC_RELAXED)) fprintf(stderr, "search arena exhausted (%zu bytes)\n", a->size);
+		return NULL;
+	}
+#ifdef _WIN32
+	if (offset + size > a->committed) {
+		size_t end = (offset + size + ARENA_COMMIT - 1) & ~(ARENA_COMMIT - 1);
+		if (!VirtualAlloc(a->base + a->committed, end - a->committed, MEM_COMMIT, PAGE_READWRITE)) {
+			if (!__atomic_exchange_n(&arena_failed, 1, __ATOMIC_RELAXED)) fprintf(stderr, "cannot commit search arena memory\n");
+			return NULL;
+		}
+		a->committed = end;
+	}
+#endif
+	a->used = offset + size;
+	return a->base + offset;
+}
+
+/**
+ * Rewinds an arena to a mark taken from its `used` field, giving back
+ * everything allocated since. Resetting after a decision is rewinding to 0.
+ *
+ * @param a    Arena to rewind.
+ * @param mark Earlier value of a->used.
+ * @return void
+ */
+void arenaRewind(Arena *a, size_t mark) {
+	a->used = mark;
+}
+
+/**
+ * Returns an arena's reservation to the system, e.g. when its thread
+ * exits.
+ *
+ * @param a Arena to free (may never have been used).
+ * @return void
+ */
+void arenaFree(Arena *a) {
+	if (a->base) {
+#ifdef _WIN32
+		VirtualFree(a->base, 0, MEM_RELEASE);
+#else
+		munmap(a->base, a->size);
+#endif
+	}
+	memset(a, 0, sizeof(*a));
+}
+
+/**
+ * Parses a kernel CPU or node list such as "0-3,8-11".
+ *
+ * @param list Text to parse.
+ * @param cpus Output numbers in list order.
+ * @param max  Most numbers to store.
+ * @return How many were stored.
+ */
+int parseCpuList(const char *list, int *cpus, int max) {
+	int count = 0;
+	while (*list >= '0' && *list <= '9') {
+		char *end;
+		long low = strtol(list, &end, 10), high = low;
+		if (*end == '-') high = strtol(end + 1, &end, 10);
+		for (long cpu = low; cpu <= high && count < max; cpu++) cpus[count++] = (int)cpu;
+		list = *end == ',' ? end + 1 : end;
+	}
+	return count;
+}
+
+/**
+ * Finds the CPUs this process may run on and groups them by NUMA node.
+ *
+ * @param t Output topology; always has at least one node and one CPU.
+ * @return void
+ */
+void readTopology(Topology *t) {
+	memset(t, 0, sizeof(*t));
+	int count = 0;
+#ifdef __linux__
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		CPU_ZERO(&allowed);
+		for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &allowed);
+	}
+	int nodes[TOPOLOGY_MAX_CPUS], listed[TOPOLOGY_MAX_CPUS], node_count = 0;
+	char list[4096];
+	FILE *f = fopen("/sys/devices/system/node/possible", "r");
+	if (f) {
+		if (fgets(list, sizeof(list), f)) node_count = parseCpuList(list, nodes, TOPOLOGY_MAX_CPUS);
+		fclose(f);
+	}
+	for (int k = 0; k < node_count; k++) {
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[k]);
+		if (!(f = fopen(path, "r"))) continue;
+		int n = fgets(list, sizeof(list), f) ? parseCpuList(list, listed, TOPOLOGY_MAX_CPUS) : 0;
+		fclose(f);
+		int group = t->nodes < TOPOLOGY_MAX_NODES ? t->nodes : TOPOLOGY_MAX_NODES - 1, before = count;
+		for (int i = 0; i < n && count < TOPOLOGY_MAX_CPUS; i++) {
+			if (listed[i] < CPU_SETSIZE && CPU_ISSET(listed[i], &allowed)) t->cpus[count++] = listed[i];
+		}
+		if (count == before) continue;
+		if (group == t->nodes) t->nodes++;
+		t->first[group + 1] = count;
+	}
+	if (count == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE && count < TOPOLOGY_MAX_CPUS; cpu++) {
+			if (CPU_ISSET(cpu, &allowed)) t->cpus[count++] = cpu;
+		}
+	}
+#endif
+	if (count == 0) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		for (long cpu = 0; cpu < online && count < TOPOLOGY_MAX_CPUS; cpu++) t->cpus[count++] = (int)cpu;
+		if (count == 0) t->cpus[count++] = 0;
+	}
+	if (t->nodes == 0) {
+		t->nodes = 1;
+		t->first[1] = count;
+	}
+}
+
+/**
+ * CPU a worker runs on: the workers are split over the nodes in
+ * proportion to each node's usable CPUs, in consecutive blocks, and
+ * each block goes round the CPUs of its node.
+ *
+ * @param t       Topology to place on.
+ * @param worker  Worker index, 0..workers-1.
+ * @param workers Workers started together.
+ * @return CPU number.
+ */
+int workerCpu(const Topology *t, int worker, int workers) {
+	int total = t->first[t->nodes], node = 0;
+#define NODE_START(n) (int)(((long)workers * t->first[n] + total / 2) / total)	// first worker of node n
+	while (node + 1 < t->nodes && worker >= NODE_START(node + 1)) node++;
+	int start = NODE_START(node);
+#undef NODE_START
+	int cpus = t->first[node + 1] - t->first[node];
+	return t->cpus[t->first[node] + (worker - start) % cpus];
+}
+
+/**
+ * NUMA node the calling thread runs on, looked up once per thread. A
+ * pinned worker never moves; other threads keep the node they were on
+ * when first asked.
+ *
+ * @return Node index into topology, 0..topology.nodes-1.
+ */
+int workerNode(void) {
+	if (worker_node >= 0) return worker_node;
+	worker_node = 0;
+#ifdef __linux__
+	int cpu = sched_getcpu();
+	for (int node = 0; node < topology.nodes; node++) {
+		for (int i = topology.first[node]; i < topology.first[node + 1]; i++) {
+			if (topology.cpus[i] == cpu) worker_node = node;
+		}
+	}
+#endif
+	return worker_node;
+}
+
+/**
+ * Starts one of a group of worker threads, bound to its CPU (see
+ * workerCpu) before it runs when --pin was given.
+ *
+ * @param thread  Output thread handle.
+ * @param body    Thread function.
+ * @param arg     Argument passed to body.
+ * @param worker  Worker index, 0..workers-1.
+ * @param workers Workers in the group.
+ * @return 0 on success, an error number otherwise (see pthread_create).
+ */
+int startWorker(pthread_t *thread, void *(*body)(void *), void *arg, int worker, int workers) {
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+#ifdef __linux__
+	if (pin_workers) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(workerCpu(&topology, worker, workers), &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+#endif
+	int status = pthread_create(thread, &attr, body, arg);
+	pthread_attr_destroy(&attr);
+	return status;
+}
+
+/**
+ * With --pin, splits the CPUs between the UI thread and a background
+ * search thread about to start: the calling (UI) thread is pinned to the
+ * CPU it runs on, and the new thread's attributes get every other usable
+ * CPU, so the search never runs on the UI's CPU, not even before it first
+ * yields. Without --pin, or with a single usable CPU, nothing is pinned
+ * and the scheduler stays free to move the UI off a busy core.
+ *
+ * @param attr Attributes the background thread will be created with.
+ * @return void
+ */
+void keepOffUiCpu(pthread_attr_t *attr) {
+#ifdef __linux__
+	if (!pin_workers) return;
+	int ui_cpu = sched_getcpu();
+	if (ui_cpu < 0 || topology.first[topology.nodes] < 2) return;
+	cpu_set_t ui, others;
+	CPU_ZERO(&ui);
+	CPU_ZERO(&others);
+	CPU_SET(ui_cpu, &ui);
+	for (int i = 0; i < topology.first[topology.nodes]; i++) {
+		if (topology.cpus[i] != ui_cpu) CPU_SET(topology.cpus[i], &others);
+	}
+	if (CPU_COUNT(&others) == 0) return;
+	pthread_setaffinity_np(pthread_self(), sizeof(ui), &ui);
+	pthread_attr_setaffinity_np(attr, sizeof(others), &others);
+#else
+	(void)attr;
+#endif
+}
+
+/**
+ * Best value of any placement of a game's current pair: the board
+ * heuristic after the lock plus the score gained since `base`.
+ *
+ * @param g    Game with a freshly spawned pair (left untouched).
+ * @param base Score the gain is measured from.
+ * @return Best value, or LONG_MIN if no placement is reachable.
+ */
+long bestReply(Game *g, long base) {
+	long best = LONG_MIN;
+	for (int r = 0; r < 4; r++) {
+		for (int c = 0; c < g->rules.width; c++) {
+			Placement p = { c, r };
+			Game b = *g;
+			if (!applyPlacement(&b, p)) continue;
+			lockPiece(&b, NULL);
+			long v = (long)evaluateBoard(&b) + (b.score - base);
+			if (v > best) best = v;
+		}
+	}
+	return best;
+}
+
+/**
+ * Built-in bot that tries every placement of the current pair and, for
+ * each, every placement of the next pair, keeping the first move of the
+ * best two-piece sequence (score gained plus board heuristic).
+ *
+ * @param g Game with a freshly spawned pair.
+ * @return Chosen placement.
+ */
+Placement thinkGreedy(Game *g) {
+	Placement best = { g->rules.width / 2, 0 };
+	long best_value = LONG_MIN;
+	for (int r1 = 0; r1 < 4; r1++) {
+		for (int c1 = 0; c1 < g->rules.width; c1++) {
+			Placement p1 = { c1, r1 };
+			Game a = *g;
+			if (!applyPlacement(&a, p1)) continue;
+			lockPiece(&a, NULL);
+			long value = (long)evaluateBoard(&a) + (a.score - g->score);
+			if (!a.over) {
+				long best_reply = bestReply(&a, g->score);
+				if (best_reply != LONG_MIN) value = best_reply;
+			}
+			if (value > best_value) {
+				best_value = value;
+				best = p1;
+			}
+		}
+	}
+	return best;
+}
+
+/**
+ * Hashes a position up to a relabeling of the colors: colors are renamed
+ * in order of first appearance in the current pair, the preview pairs and
+ * then the board (column by column from the floor), so positions that
+ * differ only by which colors were dealt share a key. The low byte is left
+ * clear for the book move and the key is never 0.
+ *
+ * @param g     Game whose position is hashed.
+ * @param pairs Known pairs in the key: the current one and pairs - 1 from the preview.
+ * @return Position key.
+ */
+uint64_t positionKey(const Game *g, int pairs) {
+	uint8_t map[NUISANCE + 1] = {0}, next = 1;
+	uint64_t h = 0xcbf29ce484222325ull;
+#define KEY_MIX(v) (h = (h ^ (uint64_t)(v)) * 0x100000001b3ull)
+#define KEY_COLOR(c) (map[c] ? map[c] : (map[c] = next++))
+	KEY_MIX(KEY_COLOR(g->current.color[1][1]));
+	KEY_MIX(KEY_COLOR(g->current.color[0][1]));
+	for (int i = 0, slot = g->queue_head; i < pairs - 1; i++) {
+		KEY_MIX(KEY_COLOR(g->queue[slot][0]));
+		KEY_MIX(KEY_COLOR(g->queue[slot][1]));
+		if (++slot == g->rules.preview) slot = 0;
+	}
+	if (g->garbage || g->garbage_turn) {
+		KEY_MIX(0x100 | g->garbage);
+		KEY_MIX(g->garbage_turn);
+	}
+	map[NUISANCE] = NUISANCE;
+	for (int x = 0; x < g->rules.width; x++) {
+		uint64_t occupied = g->planes[0][x];
+		KEY_MIX(0x80 | __builtin_popcountll(occupied));
+		for (int y = g->rules.height - 1; y >= 0 && occupied >> y & 1; y--) KEY_MIX(KEY_COLOR(cellColor((Game *)g, x, y)));
+	}
+#undef KEY_COLOR
+#undef KEY_MIX
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 32;
+	return (h & BOOK_KEY_MASK) ? h & BOOK_KEY_MASK : 0x100;
+}
+
+/**
+ * Finds a key's slot in a book hash table by linear probing. Probing
+ * stops after every slot has been tried, so a damaged book file with no
+ * empty slot cannot hang a lookup.
+ *
+ * @param slots Hash table.
+ * @param count Slots, a power of two.
+ * @param key   Position key (see positionKey).
+ * @return The slot holding the key, the empty slot where it would go, or NULL if the table is full without it.
+ */
+uint64_t *bookSlot(const uint64_t *slots, uint32_t count, uint64_t key) {
+	uint32_t i = (uint32_t)(key >> 8) & (count - 1);
+	for (uint32_t probes = 0; probes < count; probes++, i = (i + 1) & (count - 1)) {
+		if (!slots[i] || (slots[i] & BOOK_KEY_MASK) == key) return (uint64_t *)&slots[i];
+	}
+	return NULL;
+}
+
+/**
+ * Tells whether a book was searched under the rules a game is played
+ * with.
+ *
+ * @param h     Book header.
+ * @param rules Game rules.
+ * @return 1 if the book applies, 0 otherwise.
+ */
+int bookRulesMatch(const BookHeader *h, const Rules *rules) {
+	return h->width == rules->width && h->height == rules->height && h->hidden == rules->hidden
+		&& h->colors == rules->colors && h->threshold == rules->threshold && h->preview == rules->preview
+		&& h->scoring == rules->scoring && h->all_clear == rules->all_clear && h->garbage_rate == rules->garbage_rate;
+}
+
+/**
+ * Maps an opening book file read-only (read into memory where mmap is
+ * not available), so every thread shares one copy.
+ *
+ * @param b    Book to fill; close it with closeBook.
+ * @param path Book file.
+ * @return 0 on success, -1 on failure (reason printed to stderr).
+ */
+int loadBook(Book *b, const char *path) {
+	memset(b, 0, sizeof(*b));
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "cannot open book %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	BookHeader h;
+	int ok = fread(&h, sizeof(h), 1, f) == 1 && h.magic == BOOK_MAGIC;
+	if (!ok) fprintf(stderr, "%s is not an opening book\n", path);
+	else if (h.version != BOOK_VERSION) {
+		fprintf(stderr, "%s was built with an incompatible version\n", path);
+		ok = 0;
+	} else if (h.slots == 0 || (h.slots & (h.slots - 1)) || h.entries >= h.slots) {
+		fprintf(stderr, "%s is corrupt\n", path);
+		ok = 0;
+	}
+	b->size = sizeof(h) + sizeof(uint64_t) * (size_t)(ok ? h.slots : 0);
+	if (ok && (fseek(f, 0, SEEK_END) != 0 || ftell(f) != (long)b->size)) {
+		fprintf(stderr, "%s is truncated\n", path);
+		ok = 0;
+	}
+#ifdef _WIN32
+	b->map = ok ? malloc(b->size) : NULL;
+	if (ok && (!b->map || fseek(f, 0, SEEK_SET) != 0 || fread(b->map, b->size, 1, f) != 1)) {
+		fprintf(stderr, "cannot read book %s\n", path);
+		free(b->map);
+		b->map = NULL;
+		ok = 0;
+	}
+#else
+	if (ok) {
+		b->map = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fileno(f), 0);
+		if (b->map == MAP_FAILED) {
+			fprintf(stderr, "cannot map book %s: %s\n", path, strerror(errno));
+			b->map = NULL;
+			ok = 0;
+		}
+	}
+#endif
+	fclose(f);
+	if (!ok) return -1;
+	b->header = h;
+	b->slots = (const uint64_t *)((const char *)b->map + sizeof(h));
+	return 0;
+}
+
+/**
+ * Unmaps an opening book.
+ *
+ * @param b Book to close (may be one that never loaded).
+ * @return void
+ */
+void closeBook(Book *b) {
+	if (b->map) {
+#ifdef _WIN32
+		free(b->map);
+#else
+		munmap(b->map, b->size);
+#endif
+	}
+	memset(b, 0, sizeof(*b));
+}
+
+/**
+ * Looks a game's position up in an opening book.
+ *
+ * @param b Book (may be empty).
+ * @param g Game with a freshly spawned pair.
+ * @param p Output book move.
+ * @return 1 if the book has a move for the position, 0 otherwise.
+ */
+int bookMove(const Book *b, const Game *g, Placement *p) {
+	if (!b->slots || (int)g->pieces >= b->header.depth || !bookRulesMatch(&b->header, &g->rules)) return 0;
+	const uint64_t *found = bookSlot(b->slots, b->header.slots, positionKey(g, 1 + g->rules.preview));
+	uint64_t slot = found ? *found : 0;
+	int move = (int)(slot & 0xff);
+	if (!slot || move == BOOK_PENDING) return 0;
+	p->column = move >> 2;
+	p->rotation = move & 3;
+	return 1;
+}
+
+/**
+ * Built-in bot that plays the loaded opening book (--book) and the greedy
+ * search once the game leaves it.
+ *
+ * @param g Game with a freshly spawned pair.
+ * @return Chosen placement.
+ */
+Placement thinkBook(Game *g) {
+	Placement p;
+	if (bookMove(&opening_book, g, &p)) return p;
+	return thinkGreedy(g);
+}
+
+/**
+ * Book worker thread: claims positions of the current level until none
+ * are left and searches each.
+ *
+ * @param arg The shared BookLevel.
+ * @return NULL
+ */
+void *bookWorker(void *arg) {
+	BookLevel *l = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED)) < l->count) {
+		l->found[i] = searchExpectimax(&l->positions[i], l->beam, 0, &l->moves[i]);
+		arenaRewind(&search_arena, 0);
+	}
+	arenaFree(&search_arena);
+	return NULL;
+}
+
+/**
+ * Adds a position key to a book table under construction, doubling the
+ * table when it gets half full.
+ *
+ * @param t    Table to update.
+ * @param key  Position key (see positionKey).
+ * @param move Move byte to store (or BOOK_PENDING); an existing key keeps its move.
+ * @return 1 if the key was added, 0 if it was already present, -1 if out of memory.
+ */
+int bookInsert(BookTable *t, uint64_t key, int move) {
+	if (2 * (t->used + 1) > t->count) {
+		uint32_t count = t->count ? t->count * 2 : 4096;
+		uint64_t *slots = calloc(count, sizeof(uint64_t));
+		if (!slots) return -1;
+		for (uint32_t i = 0; i < t->count; i++) {
+			if (t->slots[i]) *bookSlot(slots, count, t->slots[i] & BOOK_KEY_MASK) = t->slots[i];
+		}
+		free(t->slots);
+		t->slots = slots;
+		t->count = count;
+	}
+	uint64_t *slot = bookSlot(t->slots, t->count, key);
+	if (*slot) return 0;
+	*slot = key | (uint64_t)move;
+	t->used++;
+	return 1;
+}
+
+/**
+ * Steps to the next canonical color sequence: every color is at most one
+ * more than the largest color before it, so each way of dealing colors is
+ * enumerated once up to relabeling. Start from all ones.
+ *
+ * @param colors     Sequence to advance.
+ * @param n          Sequence length.
+ * @param max_colors Colors in play.
+ * @return 1 if advanced, 0 after the last sequence.
+ */
+int nextCanonical(uint8_t *colors, int n, int max_colors) {
+	for (int i = n - 1; i >= 0; i--) {
+		int largest = 0;
+		for (int j = 0; j < i; j++) if (colors[j] > largest) largest = colors[j];
+		if (colors[i] <= largest && colors[i] < max_colors) {
+			colors[i]++;
+			for (int j = i + 1; j < n; j++) colors[j] = 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Queues a position for the next search level unless the book already
+ * holds it (or another sequence reached it first).
+ *
+ * @param t        Book table; the key is added as BOOK_PENDING.
+ * @param g        Position with a freshly spawned pair.
+ * @param level    Growing array of queued positions.
+ * @param count    Positions queued.
+ * @param capacity Positions allocated.
+ * @return 0 on success, -1 if out of memory.
+ */
+int queuePosition(BookTable *t, Game *g, Game **level, int *count, int *capacity) {
+	int added = bookInsert(t, positionKey(g, 1 + g->rules.preview), BOOK_PENDING);
+	if (added <= 0) return added;
+	if (*count == *capacity) {
+		int grown = *capacity ? *capacity * 2 : 256;
+		Game *positions = realloc(*level, sizeof(Game) * grown);
+		if (!positions) return -1;
+		*level = positions;
+		*capacity = grown;
+	}
+	(*level)[(*count)++] = *g;
+	return 0;
+}
+
+/**
+ * Runs the "book" command: searches every early position offline and
+ * writes an opening book for the book bot (tournament --book).
+ *
+ * Options:
+ *   --out FILE    book file to write (required)
+ *   --depth N     pairs placed from the empty board, 1..8 (default 2)
+ *   --beam K      first moves searched a ply deeper per position (default 12)
+ *   --board SPEC  board size, see parseBoard (default wide, 10x20)
+ *   --colors N    colors in play, 3..14 (default 4)
+ *   --threshold N puyos a group needs to pop, 2..8 (default 4)
+ *   --scoring NAME  score table: tsu (default) or classic
+ *   --all-clear N bonus for emptying the board (default 2100)
+ *   --garbage N   nuisance puyos dropped after every lock (default 0)
+ *   --preview N   pairs dealt ahead, 1..5 (default 1)
+ *   --threads N   worker threads (default: CPUs this process may use)
+ *   --pin         bind each worker to one CPU, spread over the NUMA nodes (see startWorker)
+ *   --cpu NAME    kernel level (see selectCpu; default auto)
+ *   --huge-pages  back the search arenas with huge pages
+ *
+ * @param argc Argument count after the command name.
+ * @param argv Arguments after the command name.
+ * @return Exit status code.
+ */
+int runBook(int argc, char **argv) {
+	Rules rules = { 10, 20, 0, 4, 4, 1, 0, 2100, 0 };
+	int depth = 2, beam = 12, threads = topology.first[topology.nodes];
+	const char *out_path = NULL;
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) out_path = argv[++i];
+		else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) depth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--beam") == 0 && i + 1 < argc) beam = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--board") == 0 && i + 1 < argc) {
+			if (parseBoard(argv[++i], &rules, rulesError) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--colors") == 0 && i + 1 < argc) rules.colors = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) rules.threshold = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--scoring") == 0 && i + 1 < argc) {
+			if (parseScoring(argv[++i], &rules) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--all-clear") == 0 && i + 1 < argc) rules.all_clear = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--garbage") == 0 && i + 1 < argc) rules.garbage_rate = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc) rules.preview = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+			if (selectCpu(argv[++i]) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--huge-pages") == 0) arena_huge_pages = 1;
+		else if (strcmp(argv[i], "--pin") == 0) pin_workers = 1;
+		else {
+			fprintf(stderr, "usage: book --out FILE [--depth N] [--beam K] [--board SPEC] [--colors N] [--threshold N] "
+				"[--scoring NAME] [--all-clear N] [--garbage N] [--preview N] [--threads N] [--pin] [--cpu NAME] [--huge-pages]\n");
+			return 1;
+		}
+	}
+	const char *rules_error = rulesError(&rules);
+	if (!out_path || depth < 1 || depth > BOOK_MAX_DEPTH || beam < 1 || rules.colors < 3 || rules_error) {
+		fprintf(stderr, "book needs --out, a 1..%d depth, a positive beam and 3..14 colors%s%s\n", BOOK_MAX_DEPTH,
+			rules_error ? "; " : "", rules_error ? rules_error : "");
+		return 1;
+	}
+	if (threads < 1) threads = 1;
+	if (threads > TOURNAMENT_MAX_THREADS) threads = TOURNAMENT_MAX_THREADS;
+
+	// Level 0: the empty board with every canonical deal of the current and preview pairs
+	BookTable table = { NULL, 0, 0 };
+	Game *level = NULL, *next_level = NULL;
+	int count = 0, capacity = 0, next_count = 0, next_capacity = 0, status = 0;
+	uint8_t deal[2 * (1 + MAX_PREVIEW)];
+	int deal_len = 2 * (1 + rules.preview);
+	memset(deal, 1, sizeof(deal));
+	do {
+		Game g;
+		resetGame(&g, &rules, 1);
+		pairBlock(deal, &g.current);
+		for (int i = 0; i < rules.preview; i++) memcpy(g.queue[i], &deal[2 * (i + 1)], 2);
+		if (queuePosition(&table, &g, &level, &count, &capacity) != 0) status = -1;
+	} while (status == 0 && nextCanonical(deal, deal_len, rules.colors));
+
+	uint64_t start = monotonicNs();
+	pthread_t workers[TOURNAMENT_MAX_THREADS];
+	for (int d = 0; d < depth && status == 0 && count > 0; d++) {
+		BookLevel l = { level, malloc(sizeof(Placement) * count), calloc(count, sizeof(int)), count, 0, beam };
+		if (!l.moves || !l.found) {
+			free(l.moves);
+			free(l.found);
+			status = -1;
+			break;
+		}
+		int n = threads < count ? threads : count;
+		for (int i = 0; i < n; i++) startWorker(&workers[i], bookWorker, &l, i, n);
+		for (int i = 0; i < n; i++) pthread_join(workers[i], NULL);
+
+		// Store the moves and deal every possible new pair behind each resulting position
+		next_count = 0;
+		for (int i = 0; i < count && status == 0; i++) {
+			if (!l.found[i]) continue;
+			uint64_t key = positionKey(&level[i], 1 + rules.preview);
+			*bookSlot(table.slots, table.count, key) = key | (uint64_t)(l.moves[i].column << 2 | l.moves[i].rotation);
+			if (d + 1 == depth) continue;
+			Game after = level[i];
+			applyPlacement(&after, l.moves[i]);
+			lockPiece(&after, NULL);
+			if (after.over) continue;
+			int dealt = after.queue_head ? after.queue_head - 1 : rules.preview - 1;
+			for (int x = 1; x <= rules.colors && status == 0; x++) {
+				for (int y = 1; y <= rules.colors && status == 0; y++) {
+					after.queue[dealt][0] = (uint8_t)x;
+					after.queue[dealt][1] = (uint8_t)y;
+					if (queuePosition(&table, &after, &next_level, &next_count, &next_capacity) != 0) status = -1;
+				}
+			}
+		}
+		printf("depth %d: %d positions searched (%.1f s)\n", d + 1, count, (monotonicNs() - start) / 1e9);
+		fflush(stdout);
+		free(l.moves);
+		free(l.found);
+		Game *swap = level;
+		level = next_level;
+		next_level = swap;
+		int swap_capacity = capacity;
+		capacity = next_capacity;
+		next_capacity = swap_capacity;
+		count = next_count;
+	}
+	if (status != 0) fprintf(stderr, "out of memory building the book\n");
+
+	if (status == 0) {
+		BookHeader h = { BOOK_MAGIC, BOOK_VERSION, (uint8_t)rules.width, (uint8_t)rules.height, (uint8_t)rules.hidden,
+			(uint8_t)rules.colors, (uint8_t)rules.threshold, (uint8_t)rules.preview, (uint8_t)rules.scoring,
+			(uint8_t)depth, (uint16_t)rules.all_clear, table.count, table.used, (uint8_t)rules.garbage_rate, {0} };
+		FILE *f = fopen(out_path, "wb");
+		int ok = f && fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(table.slots, sizeof(uint64_t), table.count, f) == table.count;
+		if (f && fclose(f) != 0) ok = 0;
+		if (!ok) {
+			fprintf(stderr, "cannot write book %s\n", out_path);
+			status = -1;
+		} else {
+			printf("%u positions, %u slots, %s\n", table.used, table.count, out_path);
+		}
+	}
+	free(table.slots);
+	free(level);
+	free(next_level);
+	return status == 0 ? 0 : 1;
+}
+
+/**
+ * Value of an expectimax leaf: the best placement of the game's current
+ * pair (board heuristic plus score gained), memoized in this thread's
+ * transposition table.
+ *
+ * @param g Game with a freshly spawned pair (left untouched).
+ * @return Leaf value, measured from the game's own score.
+ */
+long leafValue(Game *g) {
+	static __thread ExpectiEntry table[EXPECTI_TABLE_SIZE];
+	uint64_t key = positionKey(g, 1);
+	ExpectiEntry *e = &table[(key >> 8) & (EXPECTI_TABLE_SIZE - 1)];
+	if (e->key != key) {
+		long value = bestReply(g, g->score);
+		e->key = key;
+		e->value = value == LONG_MIN ? -1000000 : value;
+	}
+	return e->value;
+}
+
+/**
+ * Groups the pairs the next spawn could reveal into classes of equal
+ * value. Colors on neither the board nor the current pair are
+ * interchangeable, and {x, y} reaches the same boards as {y, x}, so a
+ * class stands for every deal that only renames fresh colors or swaps
+ * the pair.
+ *
+ * @param g       Game whose board and current pair are known.
+ * @param pairs   Output representative pair per class.
+ * @param weights Output deals per class; they sum to colors^2.
+ * @return Number of classes.
+ */
+int chanceClasses(Game *g, uint8_t pairs[][2], int *weights) {
+	uint8_t seen[NUISANCE + 1] = {0}, known[MAX_COLORS], fresh[2];
+	int colors = g->rules.colors, n = 0, fresh_count = 0, classes = 0;
+	seen[g->current.color[1][1]] = seen[g->current.color[0][1]] = 1;
+	for (int x = 0; x < g->rules.width; x++) {
+		for (uint64_t occupied = g->planes[0][x]; occupied; occupied &= occupied - 1) {
+			seen[cellColor(g, x, __builtin_ctzll(occupied))] = 1;
+		}
+	}
+	for (int c = 1; c <= colors; c++) {
+		if (seen[c]) known[n++] = (uint8_t)c;
+		else if (fresh_count++ < 2) fresh[fresh_count - 1] = (uint8_t)c;
+	}
+	for (int i = 0; i < n; i++) {
+		for (int j = i; j < n; j++) {
+			pairs[classes][0] = known[i];
+			pairs[classes][1] = known[j];
+			weights[classes++] = i == j ? 1 : 2;
+		}
+		if (fresh_count > 0) {
+			pairs[classes][0] = known[i];
+			pairs[classes][1] = fresh[0];
+			weights[classes++] = 2 * fresh_count;
+		}
+	}
+	if (fresh_count > 0) {
+		pairs[classes][0] = pairs[classes][1] = fresh[0];
+		weights[classes++] = fresh_count;
+	}
+	if (fresh_count > 1) {
+		pairs[classes][0] = fresh[0];
+		pairs[classes][1] = fresh[1];
+		weights[classes++] = fresh_count * (fresh_count - 1);
+	}
+	return classes;
+}
+
+/**
+ * Chance node of the expectimax bot: the expected value, over every pair
+ * the next spawn could reveal, of the best placement of the known next
+ * pair followed by the revealed one. With two or more preview pairs the
+ * revealed pair is already known and the average has a single term.
+ *
+ * @param a    Game right after the root placement locked.
+ * @param base Score the gain is measured from.
+ * @return Expected value, or LONG_MIN / 2 (a lost position) if the search
+ *         arena is exhausted; arenaAlloc reports that once.
+ */
+long expectiReply(Game *a, long base) {
+	size_t mark = search_arena.used;
+	Game *after = arenaAlloc(&search_arena, sizeof(Game) * 4 * a->rules.width);
+	int n = 0;
+	if (!after) return LONG_MIN / 2;
+	for (int r = 0; r < 4; r++) {
+		for (int c = 0; c < a->rules.width; c++) {
+			Placement p = { c, r };
+			after[n] = *a;
+			if (!applyPlacement(&after[n], p)) continue;
+			lockPiece(&after[n], NULL);
+			n++;
+		}
+	}
+	uint8_t pairs[EXPECTI_CLASSES][2];
+	int weights[EXPECTI_CLASSES], classes = 1, total_weight = 0;
+	if (a->rules.preview > 1) {
+		memcpy(pairs[0], a->queue[a->queue_head], 2);
+		weights[0] = 1;
+	} else {
+		classes = chanceClasses(a, pairs, weights);
+	}
+	long total = 0;
+	for (int k = 0; k < classes; k++) {
+		long best = -1000000;
+		for (int i = 0; i < n; i++) {
+			Game *b = &after[i];
+			long v;
+			if (b->over) v = (long)evaluateBoard(b) + (b->score - base);
+			else {
+				pairBlock(pairs[k], &b->current);
+				v = leafValue(b) + (b->score - base);
+			}
+			if (v > best) best = v;
+		}
+		total += weights[k] * best;
+		total_weight += weights[k];
+	}
+	arenaRewind(&search_arena, mark);
+	return total / total_weight;
+}
+
+/**
+ * Expectimax search three pairs deep: ranks every placement of the
+ * current pair by the greedy two-pair lookahead, then re-scores the `beam`
+ * best by their expected continuation (see expectiReply). The beam bounds
+ * the cost per move; the book command searches with a wider one. Past the
+ * deadline no further first move is re-scored, so the result degrades
+ * toward the greedy choice instead of arriving late.
+ *
+ * @param g        Game with a freshly spawned pair.
+ * @param beam     First moves searched a ply deeper.
+ * @param deadline monotonicNs to stop re-scoring at, 0 = none.
+ * @param best     Output best placement.
+ * @return 1 if any placement is reachable, 0 otherwise.
+ */
+int searchExpectimax(Game *g, int beam, uint64_t deadline, Placement *best) {
+	Placement moves[4 * MAX_WIDTH];
+	long values[4 * MAX_WIDTH];
+	int n = 0;
+	for (int r = 0; r < 4; r++) {
+		for (int c = 0; c < g->rules.width; c++) {
+			Placement p = { c, r };
+			Game a = *g;
+			if (!applyPlacement(&a, p)) continue;
+			lockPiece(&a, NULL);
+			long value = a.over ? LONG_MIN / 2 : bestReply(&a, g->score);
+			if (value == LONG_MIN) value = (long)evaluateBoard(&a) + (a.score - g->score);
+			// Insertion keeps the candidates sorted, best first
+			int i = n++;
+			for (; i > 0 && values[i - 1] < value; i--) {
+				values[i] = values[i - 1];
+				moves[i] = moves[i - 1];
+			}
+			values[i] = value;
+			moves[i] = p;
+		}
+	}
+	if (n == 0) return 0;
+	*best = moves[0];
+	long best_value = LONG_MIN;
+	for (int i = 0; i < n && i < beam && (!deadline || monotonicNs() < deadline); i++) {
+		Game a = *g;
+		applyPlacement(&a, moves[i]);
+		lockPiece(&a, NULL);
+		if (a.over) continue;
+		long value = expectiReply(&a, g->score);
+		if (value > best_value) {
+			best_value = value;
+			*best = moves[i];
+		}
+	}
+	return 1;
+}
+
+/**
+ * Built-in bot that plays the expectimax search (see searchExpectimax)
+ * with a beam of EXPECTI_BEAM first moves.
+ *
+ * @param g Game with a freshly spawned pair.
+ * @return Chosen placement.
+ */
+Placement thinkExpectimax(Game *g) {
+	Placement best = { g->rules.width / 2, 0 };
+	searchExpectimax(g, EXPECTI_BEAM, 0, &best);
+	return best;
+}
+
+// Bots compiled into the engine, selectable by name
+BuiltinBot builtin_bots[] = {
+	{ "random", thinkRandom },		// random reachable placement
+	{ "greedy", thinkGreedy },		// two-piece lookahead over current + next
+	{ "book", thinkBook },			// opening book (--book), then greedy
+	{ "expectimax", thinkExpectimax },	// three pairs deep, averaging over unseen pairs
+};
+
+/**
+ * Resolves a bot spec for the tournament: a built-in bot name, a socket
+ * path prefixed with "sock:", or a shared-memory region "shm:NAME".
+ *
+ * @param e       Entrant to initialize.
+ * @param spec    Bot spec from the command line.
+ * @param workers Worker threads that may ask it for moves at once.
+ * @return 0 on success, -1 if the spec is unknown or the bot is unreachable.
+ */
+int entrantOpen(Entrant *e, const char *spec, int workers) {
+	memset(e, 0, sizeof(*e));
+	e->name = spec;
+	e->link.kind = BOT_LINK_NONE;
+	e->link.fd = BOT_NO_SOCKET;
+	for (size_t i = 0; i < sizeof(builtin_bots) / sizeof(builtin_bots[0]); i++) {
+		if (strcmp(spec, builtin_bots[i].name) == 0) {
+			e->think = builtin_bots[i].think;
+			return 0;
+		}
+	}
+	if (strncmp(spec, "sock:", 5) == 0) spec += 5;
+	else if (strncmp(spec, "shm:", 4) != 0) {
+		fprintf(stderr, "unknown bot '%s' (built-ins: random, greedy, book, expectimax; or sock:PATH, shm:NAME)\n", spec);
+		return -1;
+	}
+	if (botConnect(&e->link, spec, workers) != 0) return -1;
+	e->queue = malloc(sizeof(BotState) * workers);
+	e->sending = malloc(sizeof(BotState) * workers);
+	e->queue_requests = malloc(sizeof(EntrantRequest *) * workers);
+	e->sending_requests = malloc(sizeof(EntrantRequest *) * workers);
+	e->moves = malloc(sizeof(BotMove) * workers);
+	if (!e->queue || !e->sending || !e->queue_requests || !e->sending_requests || !e->moves) {
+		fprintf(stderr, "out of memory for bot '%s'\n", e->name);
+		entrantClose(e);
+		return -1;
+	}
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->answered, NULL);
+	return 0;
+}
+
+/**
+ * Closes an external entrant's connection and frees its request queues.
+ * Built-in entrants hold nothing to release.
+ *
+ * @param e Entrant opened by entrantOpen.
+ * @return void
+ */
+void entrantClose(Entrant *e) {
+	if (e->think) return;
+	botClose(&e->link);
+	free(e->queue);
+	free(e->sending);
+	free(e->queue_requests);
+	free(e->sending_requests);
+	free(e->moves);
+	e->queue = e->sending = NULL;
+	e->queue_requests = e->sending_requests = NULL;
+	e->moves = NULL;
+}
+
+/**
+ * Asks an entrant for the placement of a game's freshly spawned pair.
+ *
+ * An external bot is shared by all worker threads, and their requests are
+ * batched: a worker queues its state and, if no exchange is in flight,
+ * sends everything queued so far as one botExchange, then hands every
+ * waiting worker its answer. Requests queued during an exchange go out
+ * together in the next one, so with N workers a bot sees batches of up to
+ * N games.
+ *
+ * @param e Entrant to ask.
+ * @param g Game waiting for a move.
+ * @param p Output placement.
+ * @return 0 on success, -1 if an external bot failed.
+ */
+int entrantMove(Entrant *e, Game *g, Placement *p) {
+	if (e->think) {
+		*p = e->think(g);
+		arenaRewind(&search_arena, 0);
+		return 0;
+	}
+	EntrantRequest request = { { 0, 0, 0, 0 }, 0, 0 };
+	pthread_mutex_lock(&e->lock);
+	int slot = e->pending++;
+	botFillState(g, (uint32_t)slot, &e->queue[slot]);
+	e->queue_requests[slot] = &request;
+	while (!request.done && e->exchanging) pthread_cond_wait(&e->answered, &e->lock);
+	if (!request.done) {
+		// Nobody is talking to the bot: send the whole queue, ours included
+		int count = e->pending;
+		BotState *states = e->queue;
+		EntrantRequest **requests = e->queue_requests;
+		e->queue = e->sending;
+		e->queue_requests = e->sending_requests;
+		e->sending = states;
+		e->sending_requests = requests;
+		e->pending = 0;
+		e->exchanging = 1;
+		pthread_mutex_unlock(&e->lock);
+
+		int status = botExchange(&e->link, states, e->moves, count);
+
+		pthread_mutex_lock(&e->lock);
+		for (int i = 0; i < count; i++) {
+			requests[i]->move = e->moves[i];
+			requests[i]->status = status;
+			requests[i]->done = 1;
+		}
+		e->exchanging = 0;
+		pthread_cond_broadcast(&e->answered);
+	}
+	pthread_mutex_unlock(&e->lock);
+	p->column = request.move.column;
+	p->rotation = request.move.rotation;
+	return request.status;
+}
+
+/**
+ * Plays one versus match: both entrants receive the same seeded piece
+ * sequence and place their pairs in lockstep, a then b (b then a in the
+ * mirrored game of a pair, see queuePairing). Chains send
+ * nuisance to the other side exactly as in the live versus mode (see
+ * lockVersusPiece). The match ends when a player tops out, and the other
+ * player wins. If both reach the piece limit, the higher score wins.
+ *
+ * @param t Tournament settings and entrants.
+ * @param m Match to play; its result fields are filled in.
+ * @return void
+ */
+void playMatch(Tournament *t, Match *m) {
+	Game games[2];
+	int carry[2] = { 0, 0 };
+	Entrant *players[2] = { &t->entrants[m->a], &t->entrants[m->b] };
+	for (int i = 0; i < 2; i++) {
+		resetGame(&games[i], &t->rules, m->seed);
+		metricsGameStarted(&games[i]);
+	}
+	while (!games[0].over && !games[1].over && games[1].pieces < t->max_pieces) {
+		for (int turn = 0; turn < 2 && !games[0].over && !games[1].over; turn++) {
+			int i = turn ^ m->b_first;
+			Placement p;
+			if (entrantMove(players[i], &games[i], &p) != 0) {
+				__atomic_store_n(&t->failed, 1, __ATOMIC_RELAXED);
+				games[i].over = 1;
+				break;
+			}
+			if (!applyPlacement(&games[i], p)) hardDrop(&games[i]);
+			simStep(&games[i], &carry[i], &games[1 - i]);
+		}
+	}
+	for (int i = 0; i < 2; i++) {
+		if (!games[i].over) metricsGameFinished(&games[i]);
+		m->score[i] = games[i].score;
+	}
+	if (games[0].over != games[1].over) m->result = games[0].over ? -1 : 1;
+	else m->result = (games[0].score > games[1].score) - (games[0].score < games[1].score);
+}
+
+/**
+ * Worker thread body: claims matches from the shared queue until none
+ * remain.
+ *
+ * @param arg Tournament being played.
+ * @return NULL
+ */
+void *tournamentWorker(void *arg) {
+	Tournament *t = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&t->next_match, 1, __ATOMIC_RELAXED)) < t->match_count) {
+		playMatch(t, &t->matches[i]);
+	}
+	arenaFree(&search_arena);
+	return NULL;
+}
+
+/**
+ * Plays matches [first, match_count) on the tournament's worker threads
+ * and waits for all of them.
+ *
+ * @param t     Tournament with matches queued.
+ * @param first Index of the first match to play.
+ * @return void
+ */
+void runMatches(Tournament *t, int first) {
+	pthread_t threads[TOURNAMENT_MAX_THREADS];
+	int n = t->threads;
+	t->next_match = first;
+	if (n > t->match_count - first) n = t->match_count - first;
+	for (int i = 0; i < n; i++) startWorker(&threads[i], tournamentWorker, t, i, n);
+	for (int i = 0; i < n; i++) pthread_join(threads[i], NULL);
+}
+
+/**
+ * Queues `games_per_pair` matches between entrants a and b in mirrored
+ * pairs: each seed is played twice, once with a placing first in every
+ * round and once with b, so whoever sends nuisance first does not bias
+ * the pairing. An odd game count leaves the last seed unmirrored.
+ *
+ * @param t Tournament to extend.
+ * @param a First entrant index.
+ * @param b Second entrant index.
+ * @return void
+ */
+void queuePairing(Tournament *t, int a, int b) {
+	for (int k = 0; k < t->games_per_pair; k++) {
+		Match *m = &t->matches[t->match_count++];
+		memset(m, 0, sizeof(*m));
+		m->a = a;
+		m->b = b;
+		m->seed = k & 1 ? m[-1].seed : t->seed + (uint32_t)t->match_count * 7919u;
+		m->b_first = k & 1;
+	}
+}
+
+/**
+ * Builds the next Swiss round: entrants are ranked by points and each is
+ * paired with the closest-ranked opponent it has not met yet (or the
+ * closest one at all once everyone has met). With an odd field the last
+ * unpaired entrant sits the round out.
+ *
+ * @param t      Tournament to extend.
+ * @param points Current points per entrant (win = 2, draw = 1).
+ * @param met    met[a * n + b] is nonzero once a and b have played.
+ * @return void
+ */
+void queueSwissRound(Tournament *t, const int *points, char *met) {
+	int n = t->entrant_count;
+	int order[TOURNAMENT_MAX_BOTS], paired[TOURNAMENT_MAX_BOTS] = {0};
+	for (int i = 0; i < n; i++) order[i] = i;
+	// Insertion sort by points, stable so ties keep registration order
+	for (int i = 1; i < n; i++) {
+		int v = order[i], j = i - 1;
+		while (j >= 0 && points[order[j]] < points[v]) {
+			order[j + 1] = order[j];
+			j--;
+		}
+		order[j + 1] = v;
+	}
+	for (int i = 0; i < n; i++) {
+		int a = order[i];
+		if (paired[a]) continue;
+		int b = -1;
+		for (int j = i + 1; j < n && b < 0; j++) {
+			if (!paired[order[j]] && !met[a * n + order[j]]) b = order[j];
+		}
+		for (int j = i + 1; j < n && b < 0; j++) {
+			if (!paired[order[j]]) b = order[j];
+		}
+		if (b < 0) break;
+		paired[a] = paired[b] = 1;
+		met[a * n + b] = met[b * n + a] = 1;
+		queuePairing(t, a, b);
+	}
+}
+
+/**
+ * Fits Elo ratings to the match results with a Bradley-Terry model
+ * (draws count half a win for each side). Every entrant also gets one
+ * virtual draw against a 1500-rated anchor so unbeaten or winless bots
+ * stay finite. The 95% interval comes from the Fisher information.
+ *
+ * @param t      Finished tournament.
+ * @param elo    Output rating per entrant.
+ * @param margin Output 95% confidence half-width per entrant.
+ * @return void
+ */
+void computeRatings(Tournament *t, double *elo, double *margin) {
+	int n = t->entrant_count;
+	double *wins = calloc((size_t)n * n, sizeof(double));
+	double *games = calloc((size_t)n * n, sizeof(double));
+	double gamma[TOURNAMENT_MAX_BOTS];
+	for (int i = 0; i < t->match_count; i++) {
+		Match *m = &t->matches[i];
+		double s = m->result > 0 ? 1.0 : m->result == 0 ? 0.5 : 0.0;
+		wins[m->a * n + m->b] += s;
+		wins[m->b * n + m->a] += 1.0 - s;
+		games[m->a * n + m->b] += 1.0;
+		games[m->b * n + m->a] += 1.0;
+	}
+	for (int i = 0; i < n; i++) gamma[i] = 1.0;
+	// Minorization-maximization updates (Hunter 2004); converges monotonically
+	for (int iter = 0; iter < 1000; iter++) {
+		double change = 0.0;
+		for (int i = 0; i < n; i++) {
+			double w = 0.5, d = 1.0 / (gamma[i] + 1.0);	// virtual draw vs anchor
+			for (int j = 0; j < n; j++) {
+				if (j == i || games[i * n + j] == 0.0) continue;
+				w += wins[i * n + j];
+				d += games[i * n + j] / (gamma[i] + gamma[j]);
+			}
+			double updated = w / d;
+			change = fmax(change, fabs(log(updated / gamma[i])));
+			gamma[i] = updated;
+		}
+		if (change < 1e-9) break;
+	}
+	double scale = 400.0 / log(10.0), mean = 0.0;
+	for (int i = 0; i < n; i++) mean += log(gamma[i]) / n;
+	for (int i = 0; i < n; i++) {
+		double info = gamma[i] / ((gamma[i] + 1.0) * (gamma[i] + 1.0));
+		for (int j = 0; j < n; j++) {
+			if (j == i) continue;
+			double p = gamma[i] / (gamma[i] + gamma[j]);
+			info += games[i * n + j] * p * (1.0 - p);
+		}
+		elo[i] = 1500.0 + scale * (log(gamma[i]) - mean);
+		margin[i] = 1.96 * scale / sqrt(info);
+	}
+	free(wins);
+	free(games);
+}
+
+/**
+ * Writes the ranked results table: record, score percentage, rating with
+ * its 95% interval and average game score for every entrant.
+ *
+ * @param t   Finished tournament.
+ * @param out Destination stream.
+ * @return void
+ */
+void writeResults(Tournament *t, FILE *out) {
+	int n = t->entrant_count;
+	int w[TOURNAMENT_MAX_BOTS] = {0}, d[TOURNAMENT_MAX_BOTS] = {0}, l[TOURNAMENT_MAX_BOTS] = {0};
+	double total[TOURNAMENT_MAX_BOTS] = {0}, elo[TOURNAMENT_MAX_BOTS], margin[TOURNAMENT_MAX_BOTS];
+	int order[TOURNAMENT_MAX_BOTS];
+	for (int i = 0; i < t->match_count; i++) {
+		Match *m = &t->matches[i];
+		if (m->result > 0) { w[m->a]++; l[m->b]++; }
+		else if (m->result < 0) { l[m->a]++; w[m->b]++; }
+		else { d[m->a]++; d[m->b]++; }
+		total[m->a] += m->score[0];
+		total[m->b] += m->score[1];
+	}
+	computeRatings(t, elo, margin);
+	for (int i = 0; i < n; i++) order[i] = i;
+	for (int i = 1; i < n; i++) {
+		int v = order[i], j = i - 1;
+		while (j >= 0 && elo[order[j]] < elo[v]) {
+			order[j + 1] = order[j];
+			j--;
+		}
+		order[j + 1] = v;
+	}
+	fprintf(out, "%-4s %-24s %6s %6s %6s %6s %7s %13s %11s\n",
+		"rank", "bot", "games", "wins", "draws", "losses", "score%", "elo (95%)", "avg score");
+	for (int r = 0; r < n; r++) {
+		int i = order[r], played = w[i] + d[i] + l[i];
+		fprintf(out, "%-4d %-24s %6d %6d %6d %6d %6.1f%% %6.0f +/-%-4.0f %11.0f\n", r + 1, t->entrants[i].name,
+			played, w[i], d[i], l[i], played ? 100.0 * (w[i] + 0.5 * d[i]) / played : 0.0,
+			elo[i], margin[i], played ? total[i] / played : 0.0);
+	}
+}
+
+/**
+ * Runs the "tournament" command: registers the bots named on the command
+ * line, schedules round-robin or Swiss matches, plays them in parallel and
+ * writes the ratings table.
+ *
+ * Options:
+ *   --swiss R     play R Swiss rounds instead of a full round robin
+ *   --games N     matches per pairing (default 10)
+ *   --pieces N    piece limit per game (default 300)
+ *   --colors N    colors in play, 1..14 (default 4)
+ *   --threshold N puyos a group needs to pop, 2..8 (default 4)
+ *   --scoring NAME  score table: tsu (default) or classic
+ *   --all-clear N bonus for emptying the board (default 2100)
+ *   --garbage N   nuisance puyos dropped on each game after every lock (default 0)
+ *   --preview N   pairs dealt ahead and sent to bots, 1..5 (default 1)
+ *   --board SPEC  board size, see parseBoard (default wide, 10x20)
+ *   --threads N   worker threads (default: CPUs this process may use)
+ *   --pin         bind each worker to one CPU, spread over the NUMA nodes (see startWorker)
+ *   --seed S      base seed for the piece sequences
+ *   --out FILE    write the results table to FILE instead of stdout
+ *   --metrics SPEC  expose metrics while running (see metricsStart)
+ *   --cpu NAME    kernel level (see selectCpu; default auto)
+ *   --book FILE   opening book for the book bot (see runBook)
+ *   --huge-pages  back the bots' search arenas with huge pages
+ *
+ * @param argc Argument count after the command name.
+ * @param argv Arguments after the command name.
+ * @return Exit status code.
+ */
+int runTournament(int argc, char **argv) {
+	Tournament t;
+	memset(&t, 0, sizeof(t));
+	t.games_per_pair = 10;
+	t.max_pieces = 300;
+	Rules wide = { 10, 20, 0, 4, 4, 1, 0, 2100, 0 };
+	t.rules = wide;
+	t.threads = topology.first[topology.nodes];
+	t.seed = (uint32_t)time(NULL);
+	int swiss_rounds = 0;
+	const char *out_path = NULL, *book_path = NULL;
+	const char *specs[TOURNAMENT_MAX_BOTS];
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "--swiss") == 0 && i + 1 < argc) swiss_rounds = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--games") == 0 && i + 1 < argc) t.games_per_pair = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--pieces") == 0 && i + 1 < argc) t.max_pieces = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--colors") == 0 && i + 1 < argc) t.rules.colors = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) t.rules.threshold = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--scoring") == 0 && i + 1 < argc) {
+			if (parseScoring(argv[++i], &t.rules) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--all-clear") == 0 && i + 1 < argc) t.rules.all_clear = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--garbage") == 0 && i + 1 < argc) t.rules.garbage_rate = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc) t.rules.preview = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--board") == 0 && i + 1 < argc) {
+			if (parseBoard(argv[++i], &t.rules, rulesError) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) t.threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) t.seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) out_path = argv[++i];
+		else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+			if (metricsStart(argv[++i]) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+			if (selectCpu(argv[++i]) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--book") == 0 && i + 1 < argc) book_path = argv[++i];
+		else if (strcmp(argv[i], "--huge-pages") == 0) arena_huge_pages = 1;
+		else if (strcmp(argv[i], "--pin") == 0) pin_workers = 1;
+		else if (argv[i][0] != '-' && t.entrant_count < TOURNAMENT_MAX_BOTS) specs[t.entrant_count++] = argv[i];
+		else {
+			fprintf(stderr, "usage: tournament [--swiss R] [--games N] [--pieces N] [--colors N] [--threshold N] [--scoring NAME] "
+				"[--all-clear N] [--garbage N] [--preview N] [--board SPEC] [--threads N] [--pin] [--seed S] [--out FILE] [--metrics SPEC] [--cpu NAME] "
+				"[--book FILE] [--huge-pages] BOT BOT...\n");
+			return 1;
+		}
+	}
+	const char *rules_error = rulesError(&t.rules);
+	if (t.entrant_count < 2 || t.games_per_pair < 1 || t.max_pieces < 1 || t.rules.colors < 3 || rules_error) {
+		fprintf(stderr, "tournament needs at least two bots, positive --games/--pieces and 3..14 colors%s%s\n",
+			rules_error ? "; " : "", rules_error ? rules_error : "");
+		return 1;
+	}
+	if (t.threads < 1) t.threads = 1;
+	if (t.threads > TOURNAMENT_MAX_THREADS) t.threads = TOURNAMENT_MAX_THREADS;
+	if (book_path) {
+		if (loadBook(&opening_book, book_path) != 0) return 1;
+		if (!bookRulesMatch(&opening_book.header, &t.rules)) fprintf(stderr, "warning: %s was built for other rules and will not be used\n", book_path);
+	}
+
+	int n = t.entrant_count, status = 0;
+	for (int i = 0; i < n; i++) {
+		if (entrantOpen(&t.entrants[i], specs[i], t.threads) != 0) {
+			t.entrant_count = i;
+			status = 1;
+			break;
+		}
+		if (!t.entrants[i].think && t.rules.height > BOT_ROWS) {
+			fprintf(stderr, "external bots can play boards up to %d rows\n", BOT_ROWS);
+			t.entrant_count = i + 1;
+			status = 1;
+			break;
+		}
+	}
+	int rounds = swiss_rounds > 0 ? swiss_rounds : 1;
+	int pairs = swiss_rounds > 0 ? n / 2 : n * (n - 1) / 2;
+	t.matches = malloc(sizeof(Match) * (size_t)rounds * pairs * t.games_per_pair);
+	char *met = calloc((size_t)n * n, 1);
+	if (status == 0 && (!t.matches || !met)) {
+		fprintf(stderr, "out of memory for the match schedule\n");
+		status = 1;
+	}
+
+	if (status == 0 && swiss_rounds == 0) {
+		for (int a = 0; a < n; a++) {
+			for (int b = a + 1; b < n; b++) queuePairing(&t, a, b);
+		}
+		runMatches(&t, 0);
+	}
+	for (int round = 0; status == 0 && round < swiss_rounds; round++) {
+		int points[TOURNAMENT_MAX_BOTS] = {0};
+		for (int i = 0; i < t.match_count; i++) {
+			Match *m = &t.matches[i];
+			points[m->a] += 1 + m->result;
+			points[m->b] += 1 - m->result;
+		}
+		int first = t.match_count;
+		queueSwissRound(&t, points, met);
+		runMatches(&t, first);
+	}
+	if (status == 0 && t.failed) {
+		fprintf(stderr, "an external bot failed; its unfinished games count as top-outs\n");
+	}
+
+	if (status == 0) {
+		FILE *out = out_path ? fopen(out_path, "w") : stdout;
+		if (!out) {
+			fprintf(stderr, "cannot write %s: %s\n", out_path, strerror(errno));
+			status = 1;
+		} else {
+			writeResults(&t, out);
+			if (out != stdout) fclose(out);
+		}
+	}
+	for (int i = 0; i < t.entrant_count; i++) {
+		if (!t.entrants[i].think) {
+			entrantClose(&t.entrants[i]);
+			pthread_mutex_destroy(&t.entrants[i].lock);
+			pthread_cond_destroy(&t.entrants[i].answered);
+		}
+	}
+	free(t.matches);
+	free(met);
+	closeBook(&opening_book);
+	return status;
+}
+
+/**
+ * Runs the mega mode: random pairs rain onto a huge field until it tops
+ * out or the piece limit is reached, then prints the run's statistics.
+ * Drops are random, so the run mostly stresses gravity and clearing on a
+ * crowded board.
+ *
+ * Options:
+ *   --board WxH[+HIDDEN]  field size (default 64x256)
+ *   --colors N    colors in play, 1..14 (default 4)
+ *   --threshold N puyos a group needs to pop, 2..8 (default 4)
+ *   --scoring NAME  score table: tsu (default) or classic
+ *   --pieces N    piece limit (default 100000)
+ *   --seed S      pair sequence seed (default: current time)
+ *   --cpu NAME    kernel level (see selectCpu; default auto)
+ *
+ * @param argc Argument count after the command name.
+ * @param argv Arguments after the command name.
+ * @return Exit status code.
+ */
+int runMega(int argc, char **argv) {
+	Rules rules = { 64, 256, 0, 4, 4, 1, 0, 2100, 0 };
+	long max_pieces = 100000;
+	uint32_t seed = (uint32_t)time(NULL);
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "--board") == 0 && i + 1 < argc) {
+			if (parseBoard(argv[++i], &rules, fieldRulesError) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--colors") == 0 && i + 1 < argc) rules.colors = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) rules.threshold = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--scoring") == 0 && i + 1 < argc) {
+			if (parseScoring(argv[++i], &rules) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--pieces") == 0 && i + 1 < argc) max_pieces = atol(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+			if (selectCpu(argv[++i]) != 0) return 1;
+		}
+		else {
+			fprintf(stderr, "usage: mega [--board WxH[+HIDDEN]] [--colors N] [--threshold N] [--scoring NAME] [--pieces N] [--seed S] [--cpu NAME]\n");
+			return 1;
+		}
+	}
+	const char *error = fieldRulesError(&rules);
+	if (error || max_pieces < 1) {
+		fprintf(stderr, "mega: %s\n", error ? error : "--pieces must be positive");
+		return 1;
+	}
+	Field f;
+	if (initField(&f, &rules, seed) != 0) {
+		fprintf(stderr, "out of memory for a %dx%d field\n", rules.width, rules.height);
+		return 1;
+	}
+	long chains = 0;
+	int topped_out = 0;
+	uint64_t start = monotonicNs();
+	while (f.pieces < max_pieces) {
+		if (!fieldDrop(&f)) {
+			topped_out = 1;
+			break;
+		}
+		if (fieldSettle(&f) > 0) chains++;
+	}
+	double seconds = (monotonicNs() - start) / 1e9;
+	printf("%dx%d field, %d colors, groups of %d, seed %u, %s kernels\n", rules.width, rules.height, rules.colors,
+		rules.threshold, seed, cpu->name);
+	printf("pieces %ld%s, score %ld, clears %ld, chains %ld, longest chain %d\n", f.pieces,
+		topped_out ? " (topped out)" : "", f.score, f.clears, chains, f.max_chain);
+	printf("%.3f s, %.1f us/piece (gravity %.1f us, clear %.1f us)\n", seconds,
+		f.pieces ? seconds * 1e6 / f.pieces : 0.0, f.pieces ? f.gravity_ns / 1e3 / f.pieces : 0.0,
+		f.pieces ? f.clear_ns / 1e3 / f.pieces : 0.0);
+	freeField(&f);
+	return 0;
+}
+
+/**
+ * Times one field kernel on a fixed input, net of restoring the input
+ * before every call.
+ *
+ * @param f     Field whose planes are overwritten.
+ * @param input Planes to restore before each call.
+ * @param clear 0 to time gravity, 1 to time a clear pass.
+ * @param reps  Calls to average over.
+ * @return Nanoseconds per call.
+ */
+double benchField(Field *f, const uint64_t *input, int clear, int reps) {
+	int W = f->rules.width;
+	size_t bytes = sizeof(uint64_t) * W * f->words * PLANES;
+	uint64_t restore = 0, total = 0;
+	for (int pass = 0; pass < 2; pass++) {
+		uint64_t start = monotonicNs();
+		for (int i = 0; i < reps; i++) {
+			memcpy(f->bits, input, bytes);
+			if (pass == 0) continue;
+			if (clear) {
+				ClearResult r;
+				cpu->field_clear(f, &r);
+			} else {
+				cpu->field_gravity(f);
+			}
+		}
+		if (pass == 0) restore = monotonicNs() - start;
+		else total = monotonicNs() - start;
+	}
+	return total > restore ? (double)(total - restore) / reps : 0.0;
+}
+
+/**
+ * Times one game kernel (the instance resetGame picked) on a fixed board,
+ * net of restoring the board before every call.
+ *
+ * @param input Game holding the input board.
+ * @param clear 0 to time gravity, 1 to time a clear pass.
+ * @param reps  Calls to average over.
+ * @return Nanoseconds per call.
+ */
+double benchGame(const Game *input, int clear, int reps) {
+	Game g = *input;					// the clear pass also updates score, clears and level
+	uint64_t restore = 0, total = 0;
+	for (int pass = 0; pass < 2; pass++) {
+		uint64_t start = monotonicNs();
+		for (int i = 0; i < reps; i++) {
+			memcpy(g.planes, input->planes, sizeof(g.planes));
+			if (pass == 0) continue;
+			if (clear) clearGroups(&g, 1, NULL);
+			else gravity(&g);
+		}
+		if (pass == 0) restore = monotonicNs() - start;
+		else total = monotonicNs() - start;
+	}
+	return total > restore ? (double)(total - restore) / reps : 0.0;
+}
+
+/**
+ * Benchmarks gravity and clearing on random boards of growing area and
+ * prints the cost per call and per cell. Boards a Game can hold are also
+ * timed through the game kernels (specialized where available). Gravity
+ * runs on a half-filled unsettled board; clearing on the same board
+ * after gravity.
+ *
+ * Options:
+ *   --colors N    colors in play, 1..14 (default 4)
+ *   --threshold N puyos a group needs to pop, 2..8 (default 4)
+ *   --seed S      board seed (default 1)
+ *   --scale X     multiply the repetitions (default 1)
+ *   --cpu NAME    kernel level (see selectCpu; default auto)
+ *
+ * @param argc Argument count after the command name.
+ * @param argv Arguments after the command name.
+ * @return Exit status code.
+ */
+int runBench(int argc, char **argv) {
+	static const int sizes[][2] = { {6, 13}, {10, 20}, {16, 64}, {32, 128}, {64, 256}, {128, 512}, {256, 1024}, {512, 2048} };
+	int colors = 4, threshold = 4;
+	uint32_t seed = 1;
+	double scale = 1.0;
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "--colors") == 0 && i + 1 < argc) colors = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) threshold = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) scale = atof(argv[++i]);
+		else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+			if (selectCpu(argv[++i]) != 0) return 1;
+		}
+		else {
+			fprintf(stderr, "usage: bench [--colors N] [--threshold N] [--seed S] [--scale X] [--cpu NAME]\n");
+			return 1;
+		}
+	}
+	Rules base = { 6, 13, 0, colors, threshold, 1, 0, 2100, 0 };
+	if (rulesError(&base) || seed == 0 || scale <= 0) {
+		fprintf(stderr, "bench needs 1..14 colors, a 2..8 threshold, a nonzero seed and a positive scale\n");
+		return 1;
+	}
+	printf("%s kernels\n", cpu->name);
+	printf("%-10s %9s %7s %12s %12s %10s %10s  %s\n", "board", "cells", "reps", "gravity ns", "clear ns",
+		"grav/cell", "clear/cell", "game kernels (gravity / clear ns)");
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		Rules rules = { sizes[s][0], sizes[s][1], 0, colors, threshold, 1, 0, 2100, 0 };
+		long cells = (long)rules.width * rules.height;
+		int reps = (int)(scale * 4e7 / cells / 16) + 1;
+		Field f;
+		if (initField(&f, &rules, seed) != 0) {
+			fprintf(stderr, "out of memory for a %dx%d field\n", rules.width, rules.height);
+			return 1;
+		}
+		size_t words = (size_t)rules.width * f.words * PLANES;
+		uint64_t *unsettled = malloc(words * sizeof(uint64_t)), *settled = malloc(words * sizeof(uint64_t));
+		if (!unsettled || !settled) {
+			fprintf(stderr, "out of memory for a %dx%d field\n", rules.width, rules.height);
+			free(unsettled);
+			free(settled);
+			freeField(&f);
+			return 1;
+		}
+		uint32_t rng = seed;
+		fillRandom(f.bits, rules.width, rules.height, f.words, rules.width, colors, &rng);
+		memcpy(unsettled, f.bits, words * sizeof(uint64_t));
+		cpu->field_gravity(&f);
+		memcpy(settled, f.bits, words * sizeof(uint64_t));
+		double gravity_ns = benchField(&f, unsettled, 0, reps);
+		double clear_ns = benchField(&f, settled, 1, reps);
+
+		char name[32], game_times[64] = "-";
+		snprintf(name, sizeof(name), "%dx%d", rules.width, rules.height);
+		if (!rulesError(&rules)) {
+			Game g;
+			resetGame(&g, &rules, seed);
+			rng = seed;
+			fillRandom(g.planes[0], rules.width, rules.height, 1, MAX_WIDTH, colors, &rng);
+			double game_gravity = benchGame(&g, 0, reps);
+			gravity(&g);
+			snprintf(game_times, sizeof(game_times), "%.0f / %.0f (%s)", game_gravity, benchGame(&g, 1, reps), g.kernels->name);
+		}
+		printf("%-10s %9ld %7d %12.0f %12.0f %10.2f %10.2f  %s\n", name, cells, reps, gravity_ns, clear_ns,
+			gravity_ns / cells, clear_ns / cells, game_times);
+		fflush(stdout);
+		free(unsettled);
+		free(settled);
+		freeField(&f);
+	}
+	return 0;
+}
+
+/**
+ * Works out how far a piece has been rotated from its spawn orientation
+ * by finding where its child cell sits around the pivot.
+ *
+ * @param b Piece to inspect.
+ * @return Clockwise quarter turns from spawn (0-3).
+ */
+int blockRotation(Block *b) {
+	if (b->shape[1][2]) return 1;
+	if (b->shape[2][1]) return 2;
+	if (b->shape[1][0]) return 3;
+	return 0;
+}
+
+/**
+ * Starts an empty replay for a freshly reset game.
+ *
+ * @param r Replay to initialize.
+ * @param g Game being recorded; its seed and rules go into the header.
+ * @return void
+ */
+void replayInit(Replay *r, Game *g) {
+	memset(r, 0, sizeof(*r));
+	r->header.magic = REPLAY_MAGIC;
+	r->header.version = REPLAY_VERSION;
+	r->header.colors = g->rules.colors;
+	r->header.width = g->rules.width;
+	r->header.height = g->rules.height;
+	r->header.hidden = g->rules.hidden;
+	r->header.threshold = g->rules.threshold;
+	r->header.preview = g->rules.preview;
+	r->header.scoring = g->rules.scoring;
+	r->header.all_clear = (uint16_t)g->rules.all_clear;
+	r->header.garbage_rate = (uint8_t)g->rules.garbage_rate;
+	r->header.seed = g->seed;
+}
+
+/**
+ * Records the lock of a game's current piece at its current position.
+ * Call it right before the piece is placed.
+ *
+ * @param r    Replay being recorded.
+ * @param g    Game whose current piece is about to lock.
+ * @param tick Player tick of the lock.
+ * @return 0 on success, -1 if out of memory (the move is dropped).
+ */
+int replayAppend(Replay *r, Game *g, uint32_t tick) {
+	if (r->count == r->capacity) {
+		int capacity = r->capacity ? r->capacity * 2 : 256;
+		ReplayMove *moves = realloc(r->moves, sizeof(ReplayMove) * capacity);
+		if (!moves) return -1;
+		r->moves = moves;
+		r->capacity = capacity;
+	}
+	ReplayMove *m = &r->moves[r->count++];
+	m->tick = tick;
+	m->x = (int8_t)g->cx;
+	m->y = (int8_t)g->cy;
+	m->rotation = (uint8_t)blockRotation(&g->current);
+	m->flags = 0;
+	return 0;
+}
+
+/**
+ * Writes a replay file: the header followed by every recorded move and
+ * any split times.
+ *
+ * @param r      Replay to save.
+ * @param path   Destination file.
+ * @param score  Final score, stored for listings and verification.
+ * @param append 1 to add the replay after those already in the file, 0 to replace the file.
+ * @return 0 on success, -1 on failure (reason printed to stderr).
+ */
+int saveReplay(Replay *r, const char *path, int score, int append) {
+	r->header.moves = r->count;
+	r->header.score = score;
+	FILE *f = fopen(path, append ? "ab" : "wb");
+	if (!f) {
+		fprintf(stderr, "cannot write replay %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	int ok = fwrite(&r->header, sizeof(r->header), 1, f) == 1
+		&& (r->count == 0 || fwrite(r->moves, sizeof(ReplayMove), r->count, f) == (size_t)r->count)
+		&& fwrite(r->split_us, sizeof(uint32_t), r->header.splits, f) == r->header.splits;
+	if (fclose(f) != 0) ok = 0;
+	if (!ok) fprintf(stderr, "cannot write replay %s\n", path);
+	return ok ? 0 : -1;
+}
+
+/**
+ * Reads the next replay from a stream holding one or more replays back to
+ * back, rejecting replays written for a different format version or with
+ * rules this build cannot play. The move buffer is reused and only grows,
+ * so streaming a corpus allocates nothing per game.
+ *
+ * @param f    Stream positioned at a replay header.
+ * @param r    Replay to fill (zeroed or previously filled); free it with freeReplay.
+ * @param path File name for messages.
+ * @return 1 if a replay was read, 0 at the end of the stream, -1 on failure
+ *         (reason printed to stderr).
+ */
+int readReplay(FILE *f, Replay *r, const char *path) {
+	Rules rules;
+	size_t n = fread(&r->header, 1, sizeof(r->header), f);
+	if (n == 0 && feof(f)) return 0;
+	if (n != sizeof(r->header) || r->header.magic != REPLAY_MAGIC) {
+		fprintf(stderr, "%s is not a replay file\n", path);
+		return -1;
+	}
+	if (r->header.version != REPLAY_VERSION) {
+		fprintf(stderr, "%s was recorded with an incompatible version\n", path);
+		return -1;
+	}
+	if (rulesError(replayRules(r, &rules))) {
+		fprintf(stderr, "%s has invalid rules: %s\n", path, rulesError(&rules));
+		return -1;
+	}
+	if (r->header.moves > INT_MAX / sizeof(ReplayMove)) {
+		fprintf(stderr, "%s is truncated\n", path);
+		return -1;
+	}
+	if ((int)r->header.moves > r->capacity) {
+		ReplayMove *moves = realloc(r->moves, sizeof(ReplayMove) * r->header.moves);
+		if (!moves) {
+			fprintf(stderr, "out of memory for %s\n", path);
+			return -1;
+		}
+		r->moves = moves;
+		r->capacity = (int)r->header.moves;
+	}
+	r->count = (int)r->header.moves;
+	if (fread(r->moves, sizeof(ReplayMove), r->count, f) != (size_t)r->count
+		|| fread(r->split_us, sizeof(uint32_t), r->header.splits, f) != r->header.splits) {
+		fprintf(stderr, "%s is truncated\n", path);
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * Reads a replay file into memory (its first replay, see readReplay).
+ *
+ * @param r    Replay to fill; free it with freeReplay.
+ * @param path File to read.
+ * @return 0 on success, -1 on failure (reason printed to stderr).
+ */
+int loadReplay(Replay *r, const char *path) {
+	memset(r, 0, sizeof(*r));
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "cannot open replay %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	int status = readReplay(f, r, path);
+	if (status == 0) fprintf(stderr, "%s is not a replay file\n", path);
+	fclose(f);
+	if (status != 1) {
+		freeReplay(r);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Reads the rules a replay was recorded with from its header.
+ *
+ * @param r     Loaded replay.
+ * @param rules Output rules.
+ * @return `rules`
+ */
+Rules *replayRules(const Replay *r, Rules *rules) {
+	rules->width = r->header.width;
+	rules->height = r->header.height;
+	rules->hidden = r->header.hidden;
+	rules->colors = r->header.colors;
+	rules->threshold = r->header.threshold;
+	rules->preview = r->header.preview;
+	rules->scoring = r->header.scoring;
+	rules->all_clear = r->header.all_clear;
+	rules->garbage_rate = r->header.garbage_rate;
+	return rules;
+}
+
+/**
+ * Releases a replay's move buffer.
+ *
+ * @param r Replay to free.
+ * @return void
+ */
+void freeReplay(Replay *r) {
+	free(r->moves);
+	r->moves = NULL;
+	r->count = r->capacity = 0;
+}
+
+/**
+ * Re-plays one recorded lock: turns the freshly spawned pair to the
+ * recorded rotation, puts it at the recorded position and locks it.
+ *
+ * @param g     Game being re-simulated.
+ * @param m     Recorded move.
+ * @param trace Output score breakdown of the lock's chain, or NULL.
+ * @return 1 on success, 0 if the position is blocked or the lock's outcome
+ *         differs from the recorded flags (the replay has desynced).
+ */
+int replayApply(Game *g, const ReplayMove *m, ChainTrace *trace) {
+	Block b = g->current;
+	for (int i = 0; i < (m->rotation & 3); i++) rotateRight(&b);
+	if (checkCollision(g, &b, m->x, m->y)) return 0;
+	g->current = b;
+	g->cx = m->x;
+	g->cy = m->y;
+	ChainTrace local;
+	if (!trace) trace = &local;
+	lockPiece(g, trace);
+	return trace->all_clear == !!(m->flags & REPLAY_ALL_CLEAR);
+}
+
+/**
+ * Starts a ghost race: loads the replay and resets the ghost's game to
+ * the replay's seed and rules.
+ *
+ * @param race Race to start.
+ * @param path Replay file to race against.
+ * @return 0 on success, -1 if the replay cannot be loaded.
+ */
+int startGhostRace(GhostRace *race, const char *path) {
+	memset(race, 0, sizeof(*race));
+	if (loadReplay(&race->replay, path) != 0) return -1;
+	Rules rules;
+	replayRules(&race->replay, &rules);
+	resetGame(&race->game, &rules, race->replay.header.seed);
+	race->active = 1;
+	return 0;
+}
+
+/**
+ * Advances the ghost to the player's tick, re-simulating every recorded
+ * lock that happened at or before it. Each lock is a single lockPiece,
+ * so a frame costs microseconds even when several moves fall due.
+ *
+ * @param race Running race.
+ * @param tick Player's current tick.
+ * @return void
+ */
+void ghostAdvance(GhostRace *race, uint32_t tick) {
+	while (race->next_move < race->replay.count && race->replay.moves[race->next_move].tick <= tick) {
+		if (race->game.over || !replayApply(&race->game, &race->replay.moves[race->next_move], NULL)) {
+			race->next_move = race->replay.count;	// desynced or topped out: freeze the ghost
+			break;
+		}
+		race->next_move++;
+	}
+}
+
+/**
+ * Starts a ghost race over from the replay's first move.
+ *
+ * @param race Race to restart.
+ * @return void
+ */
+void restartGhostRace(GhostRace *race) {
+	Rules rules = race->game.rules;
+	resetGame(&race->game, &rules, race->replay.header.seed);
+	race->next_move = 0;
+}
+
+/**
+ * Queues a key for a game. Only one thread may push to a queue.
+ *
+ * @param q     Queue to append to.
+ * @param key   Curses key code.
+ * @param piece Piece the key is meant for (Game.pieces).
+ * @return 0 on success, -1 if the queue is full.
+ */
+int inputPush(InputQueue *q, int key, int piece) {
+	uint32_t tail = q->tail;
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == INPUT_QUEUE_SIZE) return -1;
+	InputKey *k = &q->keys[tail & (INPUT_QUEUE_SIZE - 1)];
+	k->key = key;
+	k->piece = piece;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Takes the next key queued for a game's current piece, discarding keys
+ * meant for pieces that already locked. Only one thread may pop.
+ *
+ * @param q     Queue to read.
+ * @param piece Current piece (Game.pieces).
+ * @return Key code, or ERR if none is waiting.
+ */
+int inputPop(InputQueue *q, int piece) {
+	uint32_t head = q->head;
+	while (head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+		InputKey k = q->keys[head & (INPUT_QUEUE_SIZE - 1)];
+		__atomic_store_n(&q->head, ++head, __ATOMIC_RELEASE);
+		if (k.piece == piece) return k.key;
+	}
+	return ERR;
+}
+
+/**
+ * Applies one key to a game's falling piece: arrows move, Z/X rotate,
+ * Down holds a soft drop and Up hard-drops.
+ *
+ * @param g   Game whose piece is moved.
+ * @param key Curses key code.
+ * @return INPUT_IGNORED, INPUT_MOVED, INPUT_SOFT or INPUT_DROP (the caller then locks the piece).
+ */
+int gameInput(Game *g, int key) {
+	Block r = g->current;
+	switch (key) {
+		case KEY_LEFT:
+			if (!checkCollision(g, &g->current, g->cx - 1, g->cy)) g->cx--;
+			return INPUT_MOVED;
+		case KEY_RIGHT:
+			if (!checkCollision(g, &g->current, g->cx + 1, g->cy)) g->cx++;
+			return INPUT_MOVED;
+		case 'z': case 'Z':
+			rotateLeft(&r);
+			attemptRotation(g, r, &g->cx, &g->cy);
+			return INPUT_MOVED;
+		case 'x': case 'X':
+			rotateRight(&r);
+			attemptRotation(g, r, &g->cx, &g->cy);
+			return INPUT_MOVED;
+		case KEY_DOWN:
+			return INPUT_SOFT;
+		case KEY_UP:
+			hardDrop(g);
+			return INPUT_DROP;
+	}
+	return INPUT_IGNORED;
+}
+
+/**
+ * Finds an AI strength by name, listing the choices on stderr if there
+ * is no such level.
+ *
+ * @param name Level name from --versus.
+ * @return The level, or NULL if unknown.
+ */
+const VersusLevel *findVersusLevel(const char *name) {
+	int count = (int)(sizeof(versus_levels) / sizeof(versus_levels[0]));
+	for (int i = 0; i < count; i++) {
+		if (strcmp(name, versus_levels[i].name) == 0) return &versus_levels[i];
+	}
+	fprintf(stderr, "unknown versus level '%s' (choose", name);
+	for (int i = 0; i < count; i++) fprintf(stderr, "%s %s", i ? "," : "", versus_levels[i].name);
+	fprintf(stderr, ")\n");
+	return NULL;
+}
+
+/**
+ * AI thread of a versus match: waits for a posted position, plays the
+ * opening book's move or searches it within the request's deadline, and
+ * queues the keys that steer the pair to the chosen placement, ending
+ * with a hard drop.
+ *
+ * @param arg The Versus match.
+ * @return NULL
+ */
+void *versusThread(void *arg) {
+	Versus *v = arg;
+	uint32_t seen = 0;
+	Game g;
+	for (;;) {
+		pthread_mutex_lock(&v->lock);
+		while (!v->quit && v->sequence == seen) pthread_cond_wait(&v->wake, &v->lock);
+		if (v->quit) {
+			pthread_mutex_unlock(&v->lock);
+			arenaFree(&search_arena);
+			return NULL;
+		}
+		seen = v->sequence;
+		g = v->request;
+		uint64_t deadline = v->deadline;
+		pthread_mutex_unlock(&v->lock);
+
+		Placement p = { g.rules.width / 2, 0 };
+		if (!bookMove(&opening_book, &g, &p)) {
+			if (v->level->beam > 0) searchExpectimax(&g, v->level->beam, deadline, &p);
+			else p = thinkGreedy(&g);
+		}
+		arenaRewind(&search_arena, 0);
+
+		// Replay the rotations on the copy so wall kicks are counted in the slide
+		int rotation = p.rotation & 3;
+		for (int i = 0; i < (rotation == 3 ? 1 : rotation); i++) {
+			Block r = g.current;
+			if (rotation == 3) rotateLeft(&r);
+			else rotateRight(&r);
+			attemptRotation(&g, r, &g.cx, &g.cy);
+			inputPush(&v->input, rotation == 3 ? 'z' : 'x', g.pieces);
+		}
+		for (int x = g.cx; x != p.column - 1; x += x < p.column - 1 ? 1 : -1) {
+			inputPush(&v->input, x < p.column - 1 ? KEY_RIGHT : KEY_LEFT, g.pieces);
+		}
+		inputPush(&v->input, KEY_UP, g.pieces);
+	}
+}
+
+/**
+ * Starts a versus match: deals the AI the player's piece sequence and
+ * starts its thread, kept off the UI thread's CPU where the system allows
+ * it (see keepOffUiCpu).
+ *
+ * @param v     Match to start.
+ * @param level AI strength.
+ * @param rules Rules both games are played with.
+ * @param seed  Piece sequence seed shared by both games.
+ * @return 0 on success, -1 if the thread cannot start.
+ */
+int startVersus(Versus *v, const VersusLevel *level, const Rules *rules, uint32_t seed) {
+	memset(v, 0, sizeof(*v));
+	v->level = level;
+	resetGame(&v->game, rules, seed);
+	v->requested = -1;
+	v->last_fall = monotonicNs();
+	pthread_mutex_init(&v->lock, NULL);
+	pthread_cond_init(&v->wake, NULL);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	keepOffUiCpu(&attr);
+	int status = pthread_create(&v->thread, &attr, versusThread, v);
+	pthread_attr_destroy(&attr);
+	if (status != 0) {
+		fprintf(stderr, "cannot start the versus AI thread\n");
+		return -1;
+	}
+	v->active = 1;
+	return 0;
+}
+
+/**
+ * Stops a versus match's AI thread.
+ *
+ * @param v Match to stop (may be inactive).
+ * @return void
+ */
+void stopVersus(Versus *v) {
+	if (!v->active) return;
+	pthread_mutex_lock(&v->lock);
+	v->quit = 1;
+	pthread_cond_signal(&v->wake);
+	pthread_mutex_unlock(&v->lock);
+	pthread_join(v->thread, NULL);
+	pthread_mutex_destroy(&v->lock);
+	pthread_cond_destroy(&v->wake);
+	v->active = 0;
+}
+
+/**
+ * Converts points a chain scored into nuisance puyos: they first cancel
+ * nuisance pending against the scorer, and the rest is sent to the
+ * opponent. Points short of a whole puyo carry over to the next chain.
+ *
+ * @param from   Game that scored.
+ * @param to     Opponent's game, or NULL to only update the scorer's side.
+ * @param carry  Scorer's leftover points.
+ * @param points Points the chain scored.
+ * @return void
+ */
+void versusSend(Game *from, Game *to, int *carry, int points) {
+	*carry += points;
+	int nuisance = *carry / VERSUS_TARGET_POINTS;
+	*carry %= VERSUS_TARGET_POINTS;
+	int cancel = nuisance < from->garbage ? nuisance : from->garbage;
+	from->garbage -= cancel;
+	if (to) to->garbage += nuisance - cancel;
+}
+
+/**
+ * Locks the AI's piece: resolves its chain, sends the nuisance it earns,
+ * then drops its own pending nuisance and spawns the next pair.
+ *
+ * @param v Running match.
+ * @return void
+ */
+void versusLock(Versus *v) {
+	lockVersusPiece(&v->game, &v->carry[1], &game);
+	v->last_fall = monotonicNs();
+}
+
+/**
+ * Locks the current piece like lockPiece, but sends the chain's nuisance
+ * to the opponent (see dropAfterLock) before the player's own pending
+ * nuisance drops.
+ *
+ * @param g        Game to advance.
+ * @param carry    Player's leftover points toward the next nuisance puyo.
+ * @param opponent Game that receives the nuisance.
+ * @return Number of chain steps triggered by the lock.
+ */
+int lockVersusPiece(Game *g, int *carry, Game *opponent) {
+	Block pair = g->current;
+	int bx = g->cx, by = g->cy, before = g->score;
+	placeBlock(g, &pair, bx, by);
+	g->pieces++;
+	spawnPiece(g);
+	int chain = settle(g, &pair, bx, by, NULL);
+	dropAfterLock(g, g->score - before, carry, opponent);
+	if (checkCollision(g, &g->current, g->cx, g->cy)) g->over = 1;
+	return chain;
+}
+
+/**
+ * Runs one UI tick of the AI's game: posts a freshly spawned pair to the
+ * AI thread, applies at most one of its queued keys (input speed cap) and
+ * lets the piece fall at the same speed as the player's. Never blocks.
+ *
+ * @param v Running match.
+ * @return void
+ */
+void versusTick(Versus *v) {
+	Game *g = &v->game;
+	uint64_t now = monotonicNs();
+	double fall_time = base_speed / (0.5 + (g->level * 0.25));
+	if (g->over) return;
+
+	// Think budget: the level's, capped so the keys land before the pair falls halfway
+	if (g->pieces != v->requested && pthread_mutex_trylock(&v->lock) == 0) {
+		double window = fall_time * (g->rules.height / 2) - 8.0 / v->level->keys_per_second;
+		double budget = v->level->budget_ms / 1000.0 < window ? v->level->budget_ms / 1000.0 : window;
+		v->request = *g;
+		v->deadline = now + (uint64_t)(budget > 0 ? budget * 1e9 : 0);
+		v->sequence++;
+		pthread_cond_signal(&v->wake);
+		pthread_mutex_unlock(&v->lock);
+		v->requested = g->pieces;
+	}
+
+	if (now >= v->next_key) {
+		int key = inputPop(&v->input, g->pieces);
+		if (key != ERR) {
+			v->next_key = now + 1000000000u / v->level->keys_per_second;
+			if (gameInput(g, key) == INPUT_DROP) {
+				versusLock(v);
+				return;
+			}
+		}
+	}
+	if (now - v->last_fall >= (uint64_t)(fall_time * 1e9)) {
+		v->last_fall = now;
+		if (!checkCollision(g, &g->current, g->cx, g->cy + 1)) g->cy++;
+		else versusLock(v);
+	}
+}
 
-	// Chain and UI
-	if (fade_timer > 0.0 && last_chain > 1) {
-		int attr = (fade > 0.5) ? A_BOLD : A_DIM;
-		attron(attr);
-		mvprintw(1, WIDTH * 2 + 8, "CHAIN x%d!", chain);
-		attroff(attr);
-	} else {
-		mvprintw(1, WIDTH * 2 + 8, "             ");
+/**
+ * Hint thread: waits for a posted position, takes the opening book's
+ * move or searches it until the request's deadline, and publishes the
+ * placement under the position's key.
+ *
+ * @param arg The Hint engine.
+ * @return NULL
+ */
+void *hintThread(void *arg) {
+	Hint *h = arg;
+	uint64_t seen = 0;
+	Game g;
+	for (;;) {
+		pthread_mutex_lock(&h->lock);
+		while (!h->quit && h->request_key == seen) pthread_cond_wait(&h->wake, &h->lock);
+		if (h->quit) {
+			pthread_mutex_unlock(&h->lock);
+			arenaFree(&search_arena);
+			return NULL;
+		}
+		seen = h->request_key;
+		g = h->request;
+		uint64_t deadline = h->deadline;
+		pthread_mutex_unlock(&h->lock);
+
+		Placement p;
+		int found = bookMove(&opening_book, &g, &p) || searchExpectimax(&g, HINT_BEAM, deadline, &p);
+		arenaRewind(&search_arena, 0);
+		if (!found) continue;
+		pthread_mutex_lock(&h->lock);
+		h->result = p;
+		h->result_key = seen;
+		pthread_mutex_unlock(&h->lock);
 	}
+}
 
-	// Next piece + info text
-	drawNextBlock();
-	mvprintw(HEIGHT + 3, 0, "Z/X: Rotate | Up: Hard Drop | Down: Soft Drop | Q: Quit");
-	mvprintw(HEIGHT + 4, 0, "Score: %d  Level: %d  Clears: %d", score, level, clears);
+/**
+ * Starts the hint thread, kept off the UI thread's CPU like the versus AI
+ * (see keepOffUiCpu).
+ *
+ * @param h Hint engine to start.
+ * @return 0 on success, -1 if the thread cannot start.
+ */
+int startHints(Hint *h) {
+	memset(h, 0, sizeof(*h));
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->wake, NULL);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	keepOffUiCpu(&attr);
+	int status = pthread_create(&h->thread, &attr, hintThread, h);
+	pthread_attr_destroy(&attr);
+	if (status != 0) {
+		fprintf(stderr, "cannot start the hint thread\n");
+		return -1;
+	}
+	h->active = 1;
+	return 0;
+}
 
-	refresh();
+/**
+ * Stops the hint thread.
+ *
+ * @param h Hint engine to stop (may be inactive).
+ * @return void
+ */
+void stopHints(Hint *h) {
+	if (!h->active) return;
+	pthread_mutex_lock(&h->lock);
+	h->quit = 1;
+	pthread_cond_signal(&h->wake);
+	pthread_mutex_unlock(&h->lock);
+	pthread_join(h->thread, NULL);
+	pthread_mutex_destroy(&h->lock);
+	pthread_cond_destroy(&h->wake);
+	h->active = 0;
 }
 
 /**
- * Instantly moves the current piece to its lowest valid position on
- * the board (a hard drop).
+ * Asks the hint thread to search a position, unless it is the one last
+ * posted. A search in progress finishes first; its result stays valid
+ * for its own position. The lock is only ever held to copy a request or
+ * result, so the UI thread waits on it for no longer than a copy.
  *
+ * @param h        Running hint engine.
+ * @param g        Position with a freshly spawned pair, live or predicted.
+ * @param deadline monotonicNs by which the hint should be ready.
  * @return void
  */
-void hardDrop() {
-	while (!checkCollision(&current, cx, cy + 1)) cy++;
+void postHint(Hint *h, const Game *g, uint64_t deadline) {
+	uint64_t key = positionKey(g, g->rules.preview + 1);
+	if (key == h->posted) return;
+	h->posted = key;
+	pthread_mutex_lock(&h->lock);
+	h->request = *g;
+	h->request_key = key;
+	h->deadline = deadline;
+	pthread_cond_signal(&h->wake);
+	pthread_mutex_unlock(&h->lock);
 }
 
 /**
- * Presents a simple difficulty selection menu and configures the
- * number of colors and base fall speed accordingly.
+ * Looks up the hint for a position without waiting: nothing is returned
+ * while the hint thread holds the lock or has not answered for exactly
+ * this position yet.
+ *
+ * @param h Hint engine (may be inactive).
+ * @param g Live game.
+ * @param p Output suggested placement.
+ * @return 1 if a hint is ready, 0 otherwise.
+ */
+int currentHint(Hint *h, const Game *g, Placement *p) {
+	if (!h->active || input_locked) return 0;
+	uint64_t key = positionKey(g, g->rules.preview + 1);
+	if (pthread_mutex_trylock(&h->lock) != 0) return 0;
+	int ready = h->result_key == key;
+	if (ready) *p = h->result;
+	pthread_mutex_unlock(&h->lock);
+	return ready;
+}
+
+/**
+ * Adds a replay file, or every file in a directory (not recursing), to a
+ * corpus.
+ *
+ * @param c    Corpus to extend.
+ * @param path File or directory.
+ * @return 0 on success, -1 on failure (reason printed to stderr).
+ */
+int addCorpusPath(Corpus *c, const char *path) {
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	DIR *dir = S_ISDIR(st.st_mode) ? opendir(path) : NULL;
+	if (S_ISDIR(st.st_mode) && !dir) {
+		fprintf(stderr, "cannot list %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	struct dirent *entry = NULL;
+	while (!dir || (entry = readdir(dir)) != NULL) {
+		char *file;
+		if (dir) {
+			if (entry->d_name[0] == '.') continue;
+			file = malloc(strlen(path) + strlen(entry->d_name) + 2);
+			if (file) sprintf(file, "%s/%s", path, entry->d_name);
+			if (file && (stat(file, &st) != 0 || !S_ISREG(st.st_mode))) {
+				free(file);
+				continue;
+			}
+		} else {
+			file = malloc(strlen(path) + 1);
+			if (file) strcpy(file, path);
+		}
+		if (file && c->count == c->capacity) {
+			int capacity = c->capacity ? c->capacity * 2 : 256;
+			char **paths = realloc(c->paths, sizeof(char *) * capacity);
+			if (paths) {
+				c->paths = paths;
+				c->capacity = capacity;
+			}
+		}
+		if (!file || c->count == c->capacity) {
+			fprintf(stderr, "out of memory listing %s\n", path);
+			free(file);
+			if (dir) closedir(dir);
+			return -1;
+		}
+		c->paths[c->count++] = file;
+		if (!dir) break;
+	}
+	if (dir) closedir(dir);
+	return 0;
+}
+
+/**
+ * Counts a pre-chain skyline in an analysis' space-saving summary: a
+ * known shape gains the count, a new one takes a free slot or evicts the
+ * least frequent shape and inherits its count as error, so frequent
+ * shapes are never lost in a fixed-size table.
  *
+ * @param a           Analysis to update.
+ * @param key         Skyline (see analyzeGame).
+ * @param count       Chains to add.
+ * @param error       Overestimate already in `count`.
+ * @param chain_steps Total length of the chains actually counted.
  * @return void
  */
-void chooseDifficulty() {
-	clear();
-	echo();
-	nodelay(stdscr, FALSE);
-	mvprintw(4, 5, "Terminal Puyo");
-	mvprintw(5, 5, "Jude Rorie");
-	mvprintw(6, 5, "Select Difficulty:");
-	mvprintw(7, 7, "1. Easy");
-	mvprintw(8, 7, "2. Medium");
-	mvprintw(9, 7, "3. Hard");
-	mvprintw(10, 7, "4. Very Hard");
-	mvprintw(12, 5, "Enter Choice (1-4): ");
-	refresh();
-	int choice = getch();
-	noecho();
-	nodelay(stdscr, TRUE);
-	clear();
-	switch (choice) {
-		case '1': max_colors = 4; base_speed = 1.0; break;
-		case '2': max_colors = 5; base_speed = 0.8; break;
-		case '3': max_colors = 6; base_speed = 0.6; break;
-		default: max_colors = 7; base_speed = 0.45; break;
+void countShape(Analysis *a, uint64_t key, uint64_t count, uint64_t error, uint64_t chain_steps) {
+	ShapeCount *least = NULL;
+	for (uint64_t i = 0; i < a->shape_count; i++) {
+		ShapeCount *s = &a->shapes[i];
+		if (s->key == key) {
+			s->count += count;
+			s->error += error;
+			s->chain_steps += chain_steps;
+			return;
+		}
+		if (!least || s->count < least->count) least = s;
 	}
+	if (a->shape_count < SHAPE_SLOTS) {
+		ShapeCount *s = &a->shapes[a->shape_count++];
+		s->key = key;
+		s->count = count;
+		s->error = error;
+		s->chain_steps = chain_steps;
+		return;
+	}
+	least->key = key;
+	least->error = least->count + error;
+	least->count += count;
+	least->chain_steps = chain_steps;
 }
 
 /**
- * Handles the piece lock-in and cascade logic after a piece can no
- * longer move: locking, clearing groups, applying gravity, spawning
- * the next piece, and checking for game over.
+ * Re-simulates one replay and adds its placements and chains to an
+ * analysis. Before each lock it records the stack height quarter, and for
+ * locks that set a chain off it also records the pair's landing cells, the
+ * move number range and the skyline (each column's height above the
+ * lowest, capped at 15). Stops at the first move that desyncs.
  *
+ * @param a Analysis to add to.
+ * @param r Replay to re-simulate.
  * @return void
  */
-void lock_and_cascade() {
-	// Disable movement
-	input_locked = 1;
-	
-	// Lock current piece into board
-	placeBlock(&current, cx, cy);
+void analyzeGame(Analysis *a, const Replay *r) {
+	Rules rules;
+	Game g;
+	replayRules(r, &rules);
+	resetGame(&g, &rules, r->header.seed);
+	int W = rules.width, H = rules.height;
+	a->games++;
+	if ((uint64_t)W > a->width) a->width = W;
+	if ((uint64_t)H > a->height) a->height = H;
+	for (int i = 0; i < r->count && !g.over; i++) {
+		const ReplayMove *m = &r->moves[i];
+		int heights[MAX_WIDTH], top = 0, low = H;
+		for (int x = 0; x < W; x++) {
+			heights[x] = __builtin_popcountll(g.planes[0][x]);
+			if (heights[x] > top) top = heights[x];
+			if (heights[x] < low) low = heights[x];
+		}
+		uint64_t key = 0;
+		for (int x = 0; x < W; x++) key |= (uint64_t)(heights[x] - low < 15 ? heights[x] - low : 15) << (4 * x);
+		Block b = g.current;
+		for (int k = 0; k < (m->rotation & 3); k++) rotateRight(&b);
+		ChainTrace trace;
+		if (!replayApply(&g, m, &trace)) {
+			a->desynced++;
+			break;
+		}
+		int pivot = m->x + 1, bucket = i / MOVE_BUCKET_SIZE < MOVE_BUCKETS ? i / MOVE_BUCKET_SIZE : MOVE_BUCKETS - 1;
+		a->moves++;
+		a->placements[top * PROFILES / (H + 1)][pivot][m->rotation & 3]++;
+		a->bucket_moves[bucket]++;
+		if (trace.steps == 0) continue;
+		a->chains++;
+		a->chain_lengths[bucket][trace.steps < CHAIN_BUCKETS ? trace.steps : CHAIN_BUCKETS - 1]++;
+		countShape(a, key, 1, 0, trace.steps);
+		// The pair's cells land on their columns' stacks, lower cells first
+		for (int y = SIZE - 1; y >= 0; y--) {
+			for (int x = 0; x < SIZE; x++) {
+				int column = m->x + x;
+				if (b.shape[y][x] && column >= 0 && column < W && heights[column] < H) a->triggers[heights[column]++][column]++;
+			}
+		}
+	}
+}
 
-	// Spawn next piece
-	current = next;
-	makeBlock(&next);
-	cx = WIDTH / 2 - 1;
-	cy = 0;
+/**
+ * Analyze worker thread: claims corpus files until none are left and
+ * streams every replay in them into the worker's analysis.
+ *
+ * @param arg The worker's AnalyzeWorker.
+ * @return NULL
+ */
+void *analyzeWorker(void *arg) {
+	AnalyzeWorker *w = arg;
+	Corpus *c = w->corpus;
+	Replay replay;
+	memset(&replay, 0, sizeof(replay));
+	int i;
+	while ((i = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED)) < c->count) {
+		FILE *f = fopen(c->paths[i], "rb");
+		if (!f) {
+			fprintf(stderr, "cannot open replay %s: %s\n", c->paths[i], strerror(errno));
+			w->failed = 1;
+			continue;
+		}
+		int status;
+		while ((status = readReplay(f, &replay, c->paths[i])) == 1) analyzeGame(&w->analysis, &replay);
+		if (status < 0) w->failed = 1;
+		fclose(f);
+	}
+	freeReplay(&replay);
+	return NULL;
+}
 
-	// Full cascade loop: clear → gravity → recheck until stable
-	int chain = 0;
-	while (1) {
-		int any_wave_cleared = 0;
+/**
+ * Adds one analysis into another.
+ *
+ * @param total Analysis to add to.
+ * @param a     Analysis to add.
+ * @return void
+ */
+void mergeAnalysis(Analysis *total, const Analysis *a) {
+	total->games += a->games;
+	total->moves += a->moves;
+	total->chains += a->chains;
+	total->desynced += a->desynced;
+	if (a->width > total->width) total->width = a->width;
+	if (a->height > total->height) total->height = a->height;
+	for (int p = 0; p < PROFILES; p++) {
+		for (int x = 0; x < MAX_WIDTH; x++) {
+			for (int r = 0; r < 4; r++) total->placements[p][x][r] += a->placements[p][x][r];
+		}
+	}
+	for (int y = 0; y < MAX_HEIGHT; y++) {
+		for (int x = 0; x < MAX_WIDTH; x++) total->triggers[y][x] += a->triggers[y][x];
+	}
+	for (int b = 0; b < MOVE_BUCKETS; b++) {
+		total->bucket_moves[b] += a->bucket_moves[b];
+		for (int l = 0; l < CHAIN_BUCKETS; l++) total->chain_lengths[b][l] += a->chain_lengths[b][l];
+	}
+	for (uint64_t i = 0; i < a->shape_count; i++) countShape(total, a->shapes[i].key, a->shapes[i].count, a->shapes[i].error,
+		a->shapes[i].chain_steps);
+}
+
+/**
+ * Writes an analysis in binary: an AnalysisHeader followed by the
+ * Analysis.
+ *
+ * @param a    Analysis to save.
+ * @param path Destination file.
+ * @return 0 on success, -1 on failure (reason printed to stderr).
+ */
+int saveAnalysis(const Analysis *a, const char *path) {
+	AnalysisHeader h = { ANALYSIS_MAGIC, ANALYSIS_VERSION, PROFILES, MAX_WIDTH, MAX_HEIGHT, MOVE_BUCKETS,
+		MOVE_BUCKET_SIZE, CHAIN_BUCKETS, SHAPE_SLOTS, 0 };
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		fprintf(stderr, "cannot write analysis %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	int ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(a, sizeof(*a), 1, f) == 1;
+	if (fclose(f) != 0) ok = 0;
+	if (!ok) fprintf(stderr, "cannot write analysis %s\n", path);
+	return ok ? 0 : -1;
+}
 
-		while (1) {
-			double mult = 1.0 + 0.5 * (chain);
-			int cleared = clearGroups(mult);
-			if (cleared == 0) break;
+/**
+ * Shades a heatmap cell: blank for zero, then ten steps up to the
+ * largest count.
+ *
+ * @param count Cell's count.
+ * @param max   Largest count on the map.
+ * @return Shade character.
+ */
+char heatChar(uint64_t count, uint64_t max) {
+	static const char shades[] = " .:-=+*#%@";
+	if (count == 0 || max == 0) return ' ';
+	int i = (int)(count * 9 / max);
+	return shades[i > 0 ? i : 1];
+}
 
-			any_wave_cleared = 1;
-			chain++;
-			last_chain = chain;
-			fade_timer = 5.0;
+/**
+ * Renders an analysis as terminal heatmaps: placements by column and
+ * rotation for each stack height quarter, chain trigger cells, chain
+ * lengths by move number, and the most frequent pre-chain skylines.
+ *
+ * @param a   Analysis to render.
+ * @param out Destination stream.
+ * @return void
+ */
+void writeAnalysis(const Analysis *a, FILE *out) {
+	static const char *rotations[4] = { "up", "right", "down", "left" };
+	int W = (int)a->width, H = (int)a->height;
+	fprintf(out, "%llu games, %llu moves, %llu chains, %llu desynced\n", (unsigned long long)a->games,
+		(unsigned long long)a->moves, (unsigned long long)a->chains, (unsigned long long)a->desynced);
+
+	for (int p = 0; p < PROFILES; p++) {
+		uint64_t max = 0, total = 0;
+		for (int x = 0; x < W; x++) {
+			for (int r = 0; r < 4; r++) {
+				if (a->placements[p][x][r] > max) max = a->placements[p][x][r];
+				total += a->placements[p][x][r];
+			}
+		}
+		if (total == 0) continue;
+		fprintf(out, "\nplacements, stack %d-%d%% high (%llu):\n       ", 100 * p / PROFILES, 100 * (p + 1) / PROFILES,
+			(unsigned long long)total);
+		for (int x = 0; x < W; x++) fprintf(out, " %d", (x + 1) % 10);
+		fprintf(out, "\n");
+		for (int r = 0; r < 4; r++) {
+			fprintf(out, "%-7s", rotations[r]);
+			for (int x = 0; x < W; x++) fprintf(out, " %c", heatChar(a->placements[p][x][r], max));
+			fprintf(out, "\n");
+		}
+	}
 
-			for (int f = 0; f < 4; f++) {
-				drawBoard(last_chain, fade_timer * (1.0 - (double)f / 4.0));
-				usleep(100000);
+	uint64_t max = 0;
+	int top = -1;
+	for (int y = 0; y < H; y++) {
+		for (int x = 0; x < W; x++) {
+			if (a->triggers[y][x] > max) max = a->triggers[y][x];
+			if (a->triggers[y][x]) top = y;
+		}
+	}
+	if (top >= 0) {
+		fprintf(out, "\nchain triggers by row (from the floor) and column:\n       ");
+		for (int x = 0; x < W; x++) fprintf(out, " %d", (x + 1) % 10);
+		fprintf(out, "\n");
+		for (int y = top; y >= 0; y--) {
+			fprintf(out, "row %-3d", y + 1);
+			for (int x = 0; x < W; x++) fprintf(out, " %c", heatChar(a->triggers[y][x], max));
+			fprintf(out, "\n");
+		}
+	}
+
+	if (a->chains) {
+		max = 0;
+		for (int b = 0; b < MOVE_BUCKETS; b++) {
+			for (int l = 1; l < CHAIN_BUCKETS; l++) if (a->chain_lengths[b][l] > max) max = a->chain_lengths[b][l];
+		}
+		fprintf(out, "\nchain length by move number (last column: %d or longer):\n           ", CHAIN_BUCKETS - 1);
+		for (int l = 1; l < CHAIN_BUCKETS; l++) fprintf(out, " %d", l % 10);
+		fprintf(out, "+  chains/move  avg length\n");
+		for (int b = 0; b < MOVE_BUCKETS; b++) {
+			if (!a->bucket_moves[b]) continue;
+			char range[16];
+			if (b + 1 < MOVE_BUCKETS) snprintf(range, sizeof(range), "%d-%d", b * MOVE_BUCKET_SIZE + 1, (b + 1) * MOVE_BUCKET_SIZE);
+			else snprintf(range, sizeof(range), "%d+", b * MOVE_BUCKET_SIZE + 1);
+			fprintf(out, "%-10s ", range);
+			uint64_t chains = 0, steps = 0;
+			for (int l = 1; l < CHAIN_BUCKETS; l++) {
+				fprintf(out, " %c", heatChar(a->chain_lengths[b][l], max));
+				chains += a->chain_lengths[b][l];
+				steps += a->chain_lengths[b][l] * l;
 			}
-			animateGravity(25000);
+			fprintf(out, "   %10.3f  %10.2f\n", (double)chains / a->bucket_moves[b], chains ? (double)steps / chains : 0.0);
 		}
+	}
 
-		gravity();
-		if (!any_wave_cleared) break;
+	if (a->shape_count) {
+		// Selection of the ten most frequent, the summary is small
+		int shown[SHAPE_SLOTS] = {0};
+		fprintf(out, "\nmost frequent pre-chain skylines (column heights above the lowest):\n");
+		for (int n = 0; n < 10; n++) {
+			int best = -1;
+			for (int i = 0; i < (int)a->shape_count; i++) {
+				if (!shown[i] && (best < 0 || a->shapes[i].count > a->shapes[best].count)) best = i;
+			}
+			if (best < 0) break;
+			shown[best] = 1;
+			const ShapeCount *s = &a->shapes[best];
+			char skyline[MAX_WIDTH + 1];
+			for (int x = 0; x < W; x++) skyline[x] = "0123456789abcdef"[s->key >> (4 * x) & 15];
+			skyline[W] = '\0';
+			uint64_t exact = s->count - s->error;
+			fprintf(out, "  %-16s %10llu chains (at least %llu), avg length %.2f\n", skyline, (unsigned long long)s->count,
+				(unsigned long long)exact, exact ? (double)s->chain_steps / exact : 0.0);
+		}
 	}
+}
 
-	// If no clears occurred, reset chain display
-	if (chain == 0) {
-		last_chain = 0;
-		fade_timer = 0.0;
+/**
+ * Runs the "analyze" command: re-simulates every game of a replay corpus
+ * on worker threads and prints placement and chain heatmaps.
+ *
+ * Options:
+ *   --threads N   worker threads (default: CPUs this process may use)
+ *   --pin         bind each worker to one CPU, spread over the NUMA nodes (see startWorker)
+ *   --out FILE    also save the aggregates in binary (see AnalysisHeader)
+ *   PATH...       replay files (one or more replays back to back) or directories of them
+ *
+ * @param argc Argument count after the command name.
+ * @param argv Arguments after the command name.
+ * @return Exit status code.
+ */
+int runAnalyze(int argc, char **argv) {
+	Corpus corpus;
+	memset(&corpus, 0, sizeof(corpus));
+	int threads = topology.first[topology.nodes], status = 0;
+	const char *out_path = NULL;
+	for (int i = 0; i < argc && status == 0; i++) {
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--pin") == 0) pin_workers = 1;
+		else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) out_path = argv[++i];
+		else if (argv[i][0] != '-') status = addCorpusPath(&corpus, argv[i]) != 0;
+		else {
+			fprintf(stderr, "usage: analyze [--threads N] [--pin] [--out FILE] PATH...\n");
+			status = 1;
+		}
 	}
-	
-	// Enable movement
-	input_locked = 0;
-	
-	// Game Over check
-	if (checkCollision(&current, cx, cy)) {
-		mvprintw(HEIGHT / 2, WIDTH - 3, "GAME OVER!");
-		mvprintw(HEIGHT / 2 + 2, WIDTH - 10, " Press any key to quit ");
-		refresh();
-		nodelay(stdscr, FALSE);
-		getch();
-		endwin();
-		exit(0);
+	if (status == 0 && corpus.count == 0) {
+		fprintf(stderr, "analyze needs at least one replay file or directory\n");
+		status = 1;
+	}
+	if (threads < 1) threads = 1;
+	if (threads > TOURNAMENT_MAX_THREADS) threads = TOURNAMENT_MAX_THREADS;
+	if (threads > corpus.count) threads = corpus.count > 0 ? corpus.count : 1;
+	AnalyzeWorker *workers = status == 0 ? calloc(threads, sizeof(AnalyzeWorker)) : NULL;
+	Analysis *total = status == 0 ? calloc(1, sizeof(Analysis)) : NULL;
+	if (status == 0 && (!workers || !total)) {
+		fprintf(stderr, "out of memory\n");
+		status = 1;
+	}
+	if (status == 0) {
+		uint64_t start = monotonicNs();
+		for (int i = 0; i < threads; i++) {
+			workers[i].corpus = &corpus;
+			startWorker(&workers[i].thread, analyzeWorker, &workers[i], i, threads);
+		}
+		for (int i = 0; i < threads; i++) {
+			pthread_join(workers[i].thread, NULL);
+			mergeAnalysis(total, &workers[i].analysis);
+			if (workers[i].failed) status = 1;
+		}
+		double seconds = (monotonicNs() - start) / 1e9;
+		writeAnalysis(total, stdout);
+		printf("\n%d files on %d threads in %.3f s (%.0f moves/s)\n", corpus.count, threads, seconds,
+			seconds > 0 ? total->moves / seconds : 0.0);
+		if (out_path && saveAnalysis(total, out_path) != 0) status = 1;
+	}
+	for (int i = 0; i < corpus.count; i++) free(corpus.paths[i]);
+	free(corpus.paths);
+	free(workers);
+	free(total);
+	return status;
+}
+
+/**
+ * Parses a timed mode spec: clears:N or score:N (sprint to N clears or
+ * points) or time:SECONDS (time attack).
+ *
+ * @param spec Spec from --mode.
+ * @param t    Clock to configure.
+ * @return 0 on success, -1 on a bad spec (reason printed to stderr).
+ */
+int parseMode(const char *spec, TimedRun *t) {
+	const char *colon = strchr(spec, ':');
+	long goal = colon ? strtol(colon + 1, NULL, 10) : 0;
+	memset(t, 0, sizeof(*t));
+	if (colon && strncmp(spec, "clears", colon - spec) == 0 && colon - spec == 6) t->mode = MODE_CLEARS;
+	else if (colon && strncmp(spec, "score", colon - spec) == 0 && colon - spec == 5) t->mode = MODE_SCORE;
+	else if (colon && strncmp(spec, "time", colon - spec) == 0 && colon - spec == 4) t->mode = MODE_TIME;
+	if (t->mode == MODE_ENDLESS || goal < 1 || goal > (t->mode == MODE_TIME ? 3600 : 10000000)) {
+		fprintf(stderr, "bad mode '%s' (clears:N, score:N or time:SECONDS up to 3600)\n", spec);
+		t->mode = MODE_ENDLESS;
+		return -1;
 	}
+	t->goal = (uint32_t)goal;
+	return 0;
+}
+
+/**
+ * Starts a timed game's clock.
+ *
+ * @param t   Clock to start (its mode and goal set by parseMode).
+ * @param now monotonicNs when play starts.
+ * @return void
+ */
+void startTimedRun(TimedRun *t, uint64_t now) {
+	t->start = now;
+	t->elapsed = 0;
+	t->completed = 0;
+	t->level = 1;
+	t->splits = 0;
+}
+
+/**
+ * Advances a timed game's clock by one tick: records a split for every
+ * level gained and checks the goal.
+ *
+ * @param t   Running clock.
+ * @param g   Game being timed.
+ * @param now monotonicNs of the current tick.
+ * @return 1 if the run just ended (goal reached, time up or topped out), 0 otherwise.
+ */
+int timedRunTick(TimedRun *t, Game *g, uint64_t now) {
+	uint64_t elapsed = now - t->start, limit = (uint64_t)t->goal * 1000000000u;
+	for (; t->level < g->level; t->level++) {
+		if (t->splits < REPLAY_MAX_SPLITS) t->split[t->splits++] = elapsed;
+	}
+	if (t->mode == MODE_CLEARS) t->completed = g->clears >= (int)t->goal;
+	else if (t->mode == MODE_SCORE) t->completed = g->score >= (int)t->goal;
+	else t->completed = elapsed >= limit;
+	t->elapsed = t->mode == MODE_TIME && t->completed ? limit : elapsed;
+	return t->completed || g->over;
+}
+
+/**
+ * Formats a duration as M:SS.mmm. Only time attacks are capped (an
+ * hour), so the minutes can run to ten digits.
+ *
+ * @param buf  Output buffer.
+ * @param size Buffer size; 32 bytes holds any duration.
+ * @param ns   Duration in nanoseconds.
+ * @return `buf`
+ */
+char *formatTime(char *buf, size_t size, uint64_t ns) {
+	uint64_t ms = ns / 1000000u;
+	snprintf(buf, size, "%u:%02u.%03u", (unsigned)(ms / 60000), (unsigned)(ms / 1000 % 60), (unsigned)(ms % 1000));
+	return buf;
+}
+
+/**
+ * Saves the live game's replay if recording was requested, with the
+ * result and splits of a timed game. Retried attempts are appended after
+ * the session's earlier ones, the back-to-back form analyze reads.
+ *
+ * @return void
+ */
+void finishRecording() {
+	if (record_path && timed_run.mode != MODE_ENDLESS) {
+		ReplayHeader *h = &recording.header;
+		h->mode = (uint8_t)timed_run.mode;
+		h->goal = timed_run.goal;
+		h->elapsed_us = (uint32_t)(timed_run.elapsed / 1000u);
+		h->completed = (uint8_t)timed_run.completed;
+		h->splits = (uint8_t)timed_run.splits;
+		for (int i = 0; i < timed_run.splits; i++) recording.split_us[i] = (uint32_t)(timed_run.split[i] / 1000u);
+	}
+	if (record_path) saveReplay(&recording, record_path, game.score, attempts > 0);
 }
 
 /**
  * Entry point for the Terminal Puyo game. Initializes ncurses,
  * configures colors and difficulty, then runs the main game loop.
  *
+ * Commands:
+ *   tournament ...  rate bots against each other (see runTournament)
+ *   mega ...        headless random play on a huge field (see runMega)
+ *   bench ...       time the board kernels against board area (see runBench)
+ *   analyze ...     placement and chain heatmaps over replay files (see runAnalyze)
+ *   book ...        search openings offline into an opening book (see runBook)
+ *
+ * Options:
+ *   --bot PATH    let the bot listening on the Unix socket PATH play
+ *   --bot shm:NAME  same, through the shared-memory region /puyo-NAME
+ *   --games N     with --bot, run N headless games instead of the UI
+ *   --pieces N    piece limit per headless game (default 500)
+ *   --seed S      piece sequence seed (default: current time)
+ *   --board SPEC  board size: classic (6x13, top row hidden), wide (10x20, default) or WxH[+HIDDEN]
+ *   --colors N    play with N colors (1..14) instead of choosing a difficulty
+ *   --threshold N puyos a group needs to pop (2..8, default 4)
+ *   --scoring NAME  score table: tsu (default) or classic
+ *   --all-clear N bonus for emptying the board (default 2100)
+ *   --garbage N   garbage drill: N nuisance puyos fall after every lock (default 0)
+ *   --preview N   pairs shown ahead of the current one (1..5, default 1)
+ *   --metrics SPEC  expose Prometheus metrics (unix:PATH, http:PORT, file:PATH[,SECS])
+ *   --record FILE   save a replay of the game to FILE
+ *   --ghost FILE    race against the replay in FILE, shown as a second board
+ *   --versus LEVEL  play against the AI (easy, normal, hard or expert; see versus_levels)
+ *   --mode SPEC     timed game: clears:N or score:N (sprint), time:SECONDS (time attack)
+ *   --hint          show the built-in AI's suggested placement for every pair
+ *   --book FILE     opening book the versus AI and hints play from (see runBook)
+ *   --huge-pages    back the versus AI's and the hints' search arenas with huge pages
+ *   --pin           pin the UI thread to its CPU and keep the versus AI and hints off it (see keepOffUiCpu)
+ *   --cpu NAME      kernel level: auto (default), scalar, sse4.2, avx2, avx2-pext or avx512
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
  * @return Exit status code (0 on normal termination).
  */
-int main(void) {
-	srand(time(NULL));
+int main(int argc, char **argv) {
+	selectCpu(NULL);
+	readTopology(&topology);
+	if (argc > 1 && strcmp(argv[1], "tournament") == 0) return runTournament(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "mega") == 0) return runMega(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) return runBench(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "analyze") == 0) return runAnalyze(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "book") == 0) return runBook(argc - 2, argv + 2);
+
+	const char *bot_path = NULL, *ghost_path = NULL, *book_path = NULL;
+	const VersusLevel *versus_level = NULL;
+	int bot_games = 0, max_pieces = 500, forced_colors = 0;
+	uint32_t seed = (uint32_t)time(NULL);
+	Rules rules = { 10, 20, 0, 4, 4, 1, 0, 2100, 0 };
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--bot") == 0 && i + 1 < argc) bot_path = argv[++i];
+		else if (strcmp(argv[i], "--games") == 0 && i + 1 < argc) bot_games = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--pieces") == 0 && i + 1 < argc) max_pieces = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--board") == 0 && i + 1 < argc) {
+			if (parseBoard(argv[++i], &rules, rulesError) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--colors") == 0 && i + 1 < argc) forced_colors = rules.colors = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) rules.threshold = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--scoring") == 0 && i + 1 < argc) {
+			if (parseScoring(argv[++i], &rules) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--all-clear") == 0 && i + 1 < argc) rules.all_clear = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--garbage") == 0 && i + 1 < argc) rules.garbage_rate = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc) rules.preview = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+			if (metricsStart(argv[++i]) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) record_path = argv[++i];
+		else if (strcmp(argv[i], "--ghost") == 0 && i + 1 < argc) ghost_path = argv[++i];
+		else if (strcmp(argv[i], "--huge-pages") == 0) arena_huge_pages = 1;
+		else if (strcmp(argv[i], "--pin") == 0) pin_workers = 1;
+		else if (strcmp(argv[i], "--hint") == 0) hints.active = 1;
+		else if (strcmp(argv[i], "--book") == 0 && i + 1 < argc) book_path = argv[++i];
+		else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+			if (parseMode(argv[++i], &timed_run) != 0) return 1;
+		}
+		else if (strcmp(argv[i], "--versus") == 0 && i + 1 < argc) {
+			if (!(versus_level = findVersusLevel(argv[++i]))) return 1;
+		}
+		else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+			if (selectCpu(argv[++i]) != 0) return 1;
+		}
+		else {
+			fprintf(stderr, "usage: %s [tournament|mega|bench|analyze|book ...] [--bot PATH|shm:NAME [--games N] [--pieces N]] [--seed S] [--board SPEC] "
+				"[--colors N] [--threshold N] [--scoring NAME] [--all-clear N] [--garbage N] [--preview N] [--metrics SPEC] [--record FILE] [--ghost FILE] [--versus LEVEL] [--mode SPEC] [--hint] [--book FILE] [--huge-pages] [--pin] [--cpu NAME]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (bot_games < 0 || bot_games > BOT_MAX_BATCH || (bot_games > 0 && !bot_path) || max_pieces < 1) {
+		fprintf(stderr, "--games needs --bot and must be 1..%d; --pieces must be positive\n", BOT_MAX_BATCH);
+		return 1;
+	}
+	const char *err = rulesError(&rules);
+	if (err) {
+		fprintf(stderr, "bad rules: %s\n", err);
+		return 1;
+	}
+	// Replays hold no incoming nuisance, so a recorded versus game would not re-simulate
+	if (versus_level && (ghost_path || bot_path || record_path)) {
+		fprintf(stderr, "--versus cannot be combined with --ghost, --bot or --record\n");
+		return 1;
+	}
+
+	// A ghost race deals the player the ghost's board and piece sequence
+	if (ghost_path) {
+		if (startGhostRace(&ghost_race, ghost_path) != 0) return 1;
+		seed = ghost_race.replay.header.seed;
+		replayRules(&ghost_race.replay, &rules);
+		forced_colors = rules.colors;
+	}
+	if (bot_path && rules.height > BOT_ROWS) {
+		fprintf(stderr, "bots can play boards up to %d rows\n", BOT_ROWS);
+		return 1;
+	}
+	if (book_path) {
+		if (loadBook(&opening_book, book_path) != 0) return 1;
+		if (forced_colors && !bookRulesMatch(&opening_book.header, &rules)) {
+			fprintf(stderr, "warning: %s was built for other rules and will not be used\n", book_path);
+		}
+	}
+	BotLink bot = { BOT_LINK_NONE, BOT_NO_SOCKET, NULL, 0, "", NULL, 0 };
+	if (bot_path && botConnect(&bot, bot_path, bot_games > 0 ? bot_games : 1) != 0) return 1;
+	if (bot_games > 0) {
+		int status = runBotGames(&bot, &rules, bot_games, max_pieces, seed);
+		botClose(&bot);
+		return status == 0 ? 0 : 1;
+	}
+
 	initscr();
 	noecho();
 	cbreak();
 	curs_set(0);
 	keypad(stdscr, TRUE);
 	start_color();
+	int min_cols = rules.width * 2 + (rules.preview > 3 ? 9 + 3 * rules.preview : 20);	// room for the preview row
+	int min_lines = rules.height + (timed_run.mode != MODE_ENDLESS ? 6 : 5);	// room for the clock row
+	if (LINES < min_lines || COLS < min_cols) {
+		endwin();
+		fprintf(stderr, "a %dx%d board needs a terminal of at least %dx%d\n", rules.width, rules.height,
+			min_cols, min_lines);
+		return 1;
+	}
+	ghost_view.left = rules.width * 2 + 24;
 
-	// Initialize colors
-	for (int i = 1; i <= 7; i++)
-		init_pair(i, i, COLOR_BLACK);
+	initColors();
 
-	chooseDifficulty();
+	chooseDifficulty(&rules);
 	nodelay(stdscr, TRUE);
-	makeBlock(&current);
-	makeBlock(&next);
+	if (forced_colors) rules.colors = forced_colors;
+	resetGame(&game, &rules, seed);
+	replayInit(&recording, &game);
+	if (versus_level && startVersus(&versus, versus_level, &rules, seed) != 0) {
+		endwin();
+		return 1;
+	}
+	if (hints.active && startHints(&hints) != 0) {
+		stopVersus(&versus);
+		endwin();
+		return 1;
+	}
+	startTimedRun(&timed_run, monotonicNs());
+	metricAdd(&metricsShard()->sessions, 1);
+	metricsGameStarted(&game);
 
 	struct timespec last_fall, now;
 	clock_gettime(CLOCK_MONOTONIC, &last_fall);
 
-	int running = 1, soft = 0;
+	int running = 1, soft = 0, retry = 0, status = 0;
 
 	// Grab inputs and clock for realtime gameplay
 	while (running) {
-		drawBoard(last_chain, fade_timer);
-		gravity();
+		// R deals the next attempt in place (a ghost race keeps its seed)
+		if (retry) {
+			if (retryGame(ghost_race.active ? seed : ++seed) != 0) {
+				status = 1;
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &last_fall);
+			soft = retry = 0;
+		}
+
+		uint64_t tick_start = monotonicNs();
+		advanceChain(tick_start);
+		if (ghost_race.active) ghostAdvance(&ghost_race, ticks);
+		if (versus.active) versusTick(&versus);
+		if (hints.active && !input_locked) postHint(&hints, &game, tick_start + HINT_BUDGET_MS * 1000000ull);
+		int timed_out = timed_run.mode != MODE_ENDLESS && timedRunTick(&timed_run, &game, tick_start);
+		drawBoard(last_chain, chain_anim.phase == CHAIN_FLASH
+			? fade_timer * (1.0 - (double)chain_anim.frame / CHAIN_FLASH_FRAMES) : fade_timer);
+
+		// Topping out, a finished timed run or the versus AI topping out ends the game
+		int choice = ERR;
+		if (game.over) choice = showEnd("GAME OVER!");
+		else if (timed_out) {
+			char result[48], time[32];
+			if (timed_run.mode == MODE_TIME) snprintf(result, sizeof(result), "TIME UP! %d points", game.score);
+			else snprintf(result, sizeof(result), "FINISHED in %s", formatTime(time, sizeof(time), timed_run.elapsed));
+			choice = showEnd(result);
+		}
+		else if (versus.active && versus.game.over) choice = showEnd("YOU WIN!");
+		if (choice != ERR) {
+			if (choice != 'r' && choice != 'R') break;
+			retry = 1;
+			continue;
+		}
 
 		int ch = getch();
+		if (ch != ERR) inputPush(&player_input, ch, game.pieces);
+
+		// An attached bot places every piece as soon as it spawns
+		if (bot.kind != BOT_LINK_NONE && !input_locked && ch != 'q') {
+			BotState s;
+			BotMove m;
+			botFillState(&game, 0, &s);
+			if (botExchange(&bot, &s, &m, 1) != 0) {
+				endwin();
+				fprintf(stderr, "bot at %s went away; game ended\n", bot_path);
+				botClose(&bot);
+				return 1;
+			}
+			Placement p = { m.column, m.rotation };
+			if (!applyPlacement(&game, p)) hardDrop(&game);
+			lock_and_cascade();
+			metricTime(&metricsShard()->tick[TICK_LIVE], monotonicNs() - tick_start);
+			ticks++;
+			continue;
+		}
 
-		// Input keys
+		// Input keys, through the same queue and handler as the versus AI's
 		if (!input_locked) {
-			if (ch == 'q') break;
-			else if (ch == KEY_LEFT && !checkCollision(&current, cx - 1, cy)) cx--;
-			else if (ch == KEY_RIGHT && !checkCollision(&current, cx + 1, cy)) cx++;
-			else if (ch == 'z' || ch == 'Z') { Block r = current; rotateLeft(&r); attemptRotation(r, &cx, &cy); }
-			else if (ch == 'x' || ch == 'X') { Block r = current; rotateRight(&r); attemptRotation(r, &cx, &cy); }
-			else if (ch == KEY_DOWN) soft = 1;
-			else if (ch == KEY_UP) {
-				hardDrop();
-				lock_and_cascade();
-				gravity();
-				clearGroups(1);
+			int key = inputPop(&player_input, game.pieces);
+			if (key == 'q') break;
+			if (key == 'r' || key == 'R') {
+				retry = 1;
+				continue;
 			}
-			else soft = 0;
+			int result = gameInput(&game, key);
+			if (result == INPUT_SOFT) soft = 1;
+			else if (result == INPUT_DROP) lock_and_cascade();
+			else if (result == INPUT_IGNORED) soft = 0;
 		}
 
 		clock_gettime(CLOCK_MONOTONIC, &now);
 		double elapsed = (now.tv_sec - last_fall.tv_sec) + (now.tv_nsec - last_fall.tv_nsec) / 1e9;
-		double fall_time = (soft ? 0.025 : base_speed) / (0.5 + (level * 0.25));
+		double fall_time = (soft ? 0.025 : base_speed) / (0.5 + (game.level * 0.25));
 
-		if (fade_timer > 0.0) {
+		if (fade_timer > 0.0 && chain_anim.phase == CHAIN_IDLE) {
 			fade_timer -= 0.03;
 			if (fade_timer < 0.0) fade_timer = 0.0;
 		}
 
-		if (elapsed >= fall_time) {
+		if (!input_locked && elapsed >= fall_time) {
 			last_fall = now;
-			if (!checkCollision(&current, cx, cy + 1)) cy++;
+			if (!checkCollision(&game, &game.current, game.cx, game.cy + 1)) game.cy++;
 			else {
 				lock_and_cascade();
-				gravity();
-				clearGroups(1);
 			}
 		}
+		metricTime(&metricsShard()->tick[TICK_LIVE], monotonicNs() - tick_start);
+		ticks++;
 		usleep(10000);
 	}
+	stopVersus(&versus);
+	stopHints(&hints);
+	if (!game.over) metricsGameFinished(&game);	// quit mid-game or after a finished timed run
+	finishRecording();
+	freeReplay(&recording);
+	closeBook(&opening_book);
 	endwin();
-	return 0;
+	botClose(&bot);
+	return status;
 }